@@ -1,6 +1,8 @@
 #ifndef CNN_H_
 #define CNN_H_
 
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <tapa.h>
 
@@ -14,14 +16,36 @@ using aligned_vector = std::vector<T, tapa::aligned_allocator<T>>;
 #define conv2_weight(o, i, k) (conv2_weight[ (o) * kChannels1 * kKernel2 + (i) * kKernel2 + (k) ])
 #define conv3_weight(o, i, k) (conv3_weight[ (o) * kChannels2 * kKernel3 + (i) * kKernel3 + (k) ])
 
-#define fc1_weight(o, i) (fc1_weight[ (o) * LinearSize1 + (i) ])
-#define fc2_weight(o, i) (fc2_weight[ (o) * LinearSize2 + (i) ])
+// FC weights are kept column-major (LoadData transposes the PyTorch layout) so
+// the weights fed by one input activation are contiguous and zero inputs can
+// skip their whole column.
+#define fc1_weight(o, i) (fc1_weight[ (i) * LinearSize2 + (o) ])
+#define fc2_weight(o, i) (fc2_weight[ (i) * kOutSize + (o) ])
+
+// Optional rank-r factorization W ~= U * V of an FC layer (U is out x r,
+// V is r x in), stored column-major like the dense weights.
+#define fc1_u(o, r) (fc1_u[ (r) * LinearSize2 + (o) ])
+#define fc1_v(r, i) (fc1_v[ (i) * fc1_rank + (r) ])
+#define fc2_u(o, r) (fc2_u[ (r) * kOutSize + (o) ])
+#define fc2_v(r, i) (fc2_v[ (i) * fc2_rank + (r) ])
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
 //MY CONSTANTS: ----------------------------------------
 const int kInSize = 41;
 
+// Raw detector frames: kRawSize uint16 counts, kRawBin adjacent pixels per
+// model input bin. Preprocessing (both engines):
+//   c[p] = (raw[p] - dark[p]) * gain[p]          dark / flat-field correction
+//   b[i] = sum of c over the kRawBin pixels of bin i
+//   x[i] = b[i] / sum(b) * scale[i] + shift[i]   flux normalization
+const int kRawBin = 8;
+const int kRawSize = kInSize * kRawBin;
+
+// Input formats (input_mode kernel argument)
+const int kInputFloat = 0;  // input: kInSize preprocessed floats
+const int kInputRaw = 1;    // raw: kRawSize detector counts, calibrated on chip
+
 // x = self.conv1(x)
 
 const int kChannels1 = 16;
@@ -66,18 +90,401 @@ const int LinearSize2 = 128;
 // rms...
 
 const int kOutSize = 1000;
+
+// Largest supported rank of a factorized FC layer (sizes on-chip buffers)
+const int kMaxRank = 64;
+
+// nnz[0] = nonzero inputs to fc1, nnz[1] = nonzero inputs to fc2
+const int kNnzStats = 2;
+
+// Output formats (output_mode kernel argument). The spectrum is always RMS
+// normalized on chip; only the selected buffer is written.
+const int kOutputFull = 0;   // output: kOutSize floats
+const int kOutputPeaks = 1;  // peaks: num_peaks (index, value, width) triplets
+const int kOutputHalf = 2;   // output_half: kOutSize fp16 values
+
+const int kMaxPeaks = 16;
+const int kPeakFields = 3;
+
+// Pre-screen cascade ahead of conv1 (both engines). Cheapest check first; a
+// frame that trips one skips the network and takes the fast path:
+//   empty       max |x| <= empty_level
+//   saturated   at least saturation_count bins >= saturation_level
+//   low signal  max(x) - mean(x) < signal_threshold
+//   gate        w2 . relu(W1 x + b1) + b2 < gate_threshold (tiny MLP)
+// A negative level or threshold turns its check off.
+const int kRouteFull = 0;       // ran the network
+const int kRouteEmpty = 1;
+const int kRouteSaturated = 2;
+const int kRouteLowSignal = 3;
+const int kRouteGate = 4;
+const int kNumRoutes = 5;
+extern const char* const kRouteNames[kNumRoutes];
+
+// Fast path result: the route only, or the route's cached template spectrum
+const int kFastFlag = 0;
+const int kFastTemplate = 1;
+
+const int kGateHidden = 8;
+
+// Packed screen parameters (the kernel's `screen` argument)
+enum ScreenParam {
+  kScreenEnabled,
+  kScreenFastMode,
+  kScreenEmptyLevel,
+  kScreenSaturationLevel,
+  kScreenSaturationCount,
+  kScreenSignalThreshold,
+  kScreenUseGate,
+  kScreenGateThreshold,
+  kScreenGateW1,                                      // kGateHidden x kInSize
+  kScreenGateB1 = kScreenGateW1 + kGateHidden * kInSize,
+  kScreenGateW2 = kScreenGateB1 + kGateHidden,
+  kScreenGateB2 = kScreenGateW2 + kGateHidden,
+  kScreenSize
+};
+
+// --- kernel tuning knobs (safe defaults), see kernel_model for estimates ---
+#ifndef IC_UNROLL
+#define IC_UNROLL 4          // try 2/4/8 depending on DSPs/BRAM
+#endif
+#ifndef K1_UNROLL
+#define K1_UNROLL kKernel1   // fully unroll tiny tap loops
+#endif
+#ifndef K2_UNROLL
+#define K2_UNROLL kKernel2
+#endif
+#ifndef K3_UNROLL
+#define K3_UNROLL kKernel3
+#endif
+
+// Inference PEs replicated by CnnBatchKernel (make NUM_PE=...)
+#ifndef NUM_PE
+#define NUM_PE 4
+#endif
 //END MY CONSTANTS: --------------------------------------
 
+// ---- Activation memory plan ----
+// Every intermediate is live from the layer step that writes it to the last
+// step that reads it. Steps: 0 conv1/bn1/relu1, 1 pool1, 2 conv2/bn2/relu2,
+// 3 pool2, 4 conv3/bn3/relu3, 5 fc1, 6 fc2, 7 rms/output. Buffers whose
+// lifetimes do not overlap share storage: the CPU engine packs them into one
+// arena, the kernel into two ping-pong buffers. Flatten is a view of L3.
+enum ActBuffer { kActL1, kActP1, kActL2, kActP2, kActL3, kActL4, kActL5, kNumActs };
+
+// Pooled maps are read IC_UNROLL channels at a time; an odd row pitch puts
+// consecutive channels in distinct cyclic banks.
+constexpr int kPitch2 = kSize2 | 1;
+constexpr int kPitch3 = kSize3 | 1;
+
+struct ActLife { int size; int def; int last_use; };
+
+constexpr ActLife kActLife[kNumActs] = {
+  {kChannels1 * kInSize, 0, 1},  // L1
+  {kChannels1 * kPitch2, 1, 2},  // P1
+  {kChannels2 * kSize2,  2, 3},  // L2
+  {kChannels2 * kPitch3, 3, 4},  // P2
+  {LinearSize1,          4, 5},  // L3 / flat3
+  {LinearSize2,          5, 6},  // L4
+  {kOutSize,             6, 7},  // L5, the spectrum
+};
+
+struct ActPlan {
+  int offset[kNumActs];  // CPU arena offsets (floats)
+  int arena_size;
+  int slot[kNumActs];    // kernel buffer (0 = ping, 1 = pong)
+  int slot_size[2];
+  int num_slots;
+};
+
+constexpr bool LifetimesOverlap(const ActLife & a, const ActLife & b) {
+  return a.def <= b.last_use && b.def <= a.last_use;
+}
+
+constexpr ActPlan PlanActivations() {
+  ActPlan plan{};
+
+  // Arena: largest first, each at the lowest offset clear of every placed
+  // buffer it is live together with
+  bool placed[kNumActs] = {};
+  for (int n = 0; n < kNumActs; ++n) {
+    int b = -1;
+    for (int i = 0; i < kNumActs; ++i)
+      if (!placed[i] && (b < 0 || kActLife[i].size > kActLife[b].size)) b = i;
+    int offset = 0;
+    for (bool moved = true; moved;) {
+      moved = false;
+      for (int q = 0; q < kNumActs; ++q) {
+        if (!placed[q] || !LifetimesOverlap(kActLife[q], kActLife[b])) continue;
+        const int q_end = plan.offset[q] + kActLife[q].size;
+        if (offset < q_end && plan.offset[q] < offset + kActLife[b].size) {
+          offset = q_end;
+          moved = true;
+        }
+      }
+    }
+    plan.offset[b] = offset;
+    placed[b] = true;
+    if (offset + kActLife[b].size > plan.arena_size)
+      plan.arena_size = offset + kActLife[b].size;
+  }
+
+  // Kernel: greedy coloring in production order
+  for (int b = 0; b < kNumActs; ++b) {
+    bool used[kNumActs] = {};
+    for (int q = 0; q < b; ++q)
+      if (LifetimesOverlap(kActLife[q], kActLife[b])) used[plan.slot[q]] = true;
+    int slot = 0;
+    while (used[slot]) ++slot;
+    plan.slot[b] = slot;
+    if (slot + 1 > plan.num_slots) plan.num_slots = slot + 1;
+    if (slot < 2 && kActLife[b].size > plan.slot_size[slot])
+      plan.slot_size[slot] = kActLife[b].size;
+  }
+  return plan;
+}
+
+constexpr ActPlan kActPlan = PlanActivations();
+static_assert(kActPlan.num_slots <= 2, "activations need more than two ping-pong buffers");
+
+// ---- Winograd minimal filtering F(m, r) for the 1-D convolutions ----
+// A tile of m outputs of an r-tap correlation costs alpha = m + r - 1
+// multiplies instead of m * r:  y = AT * [(G * g) .* (BT * d)], with d the
+// alpha inputs starting at the tile's first output minus the padding.
+// Toom-Cook construction on the points kWinogradPoints plus infinity: G and
+// AT evaluate at the points, BT holds the Lagrange interpolation (transposed,
+// since the layers correlate rather than convolve).
+const int kMaxWinoTile = 6;
+const int kMaxWinoAlpha = kMaxWinoTile + kKernel2 - 1;
+
+// Compile-time tile sizes of the HLS conv2 / conv3 (0 = direct convolution)
+#ifndef WINO_M2
+#define WINO_M2 0
+#endif
+#ifndef WINO_M3
+#define WINO_M3 0
+#endif
+
+constexpr double kWinogradPoints[kMaxWinoAlpha - 1] = {0, 1, -1, 2, -2, 0.5, -0.5, 3, -3};
+
+struct WinogradTransform {
+  int m = 0, r = 0, alpha = 0;
+  double bt[kMaxWinoAlpha][kMaxWinoAlpha] = {};  // alpha x alpha, input transform
+  double at[kMaxWinoTile][kMaxWinoAlpha] = {};   // m x alpha, output transform
+  double g[kMaxWinoAlpha][kKernel2] = {};        // alpha x r, weight transform
+};
+
+constexpr WinogradTransform MakeWinograd(int m, int r) {
+  WinogradTransform w;
+  w.m = m;
+  w.r = r;
+  w.alpha = m + r - 1;
+  const int n = w.alpha - 1;  // finite points
+  const double* p = kWinogradPoints;
+  for (int j = 0; j < n; ++j) {
+    double pw = 1;
+    for (int i = 0; i < m || i < r; ++i) {
+      if (i < m) w.at[i][j] = pw;
+      if (i < r) w.g[j][i] = pw;
+      pw *= p[j];
+    }
+  }
+  w.at[m - 1][n] = 1;  // the point at infinity picks the leading coefficients
+  w.g[n][r - 1] = 1;
+
+  // BT row j < n: Lagrange basis L_j over the finite points; row n: the monic
+  // M(x) = prod (x - p_l), which carries the leading coefficient
+  for (int j = 0; j <= n; ++j) {
+    double poly[kMaxWinoAlpha] = {1};
+    int deg = 0;
+    double denom = 1;
+    for (int l = 0; l < n; ++l) {
+      if (l == j) continue;
+      for (int d = deg + 1; d > 0; --d) poly[d] = poly[d - 1] - p[l] * poly[d];
+      poly[0] = -p[l] * poly[0];
+      ++deg;
+      if (j < n) denom *= p[j] - p[l];
+    }
+    for (int d = 0; d <= deg; ++d) w.bt[j][d] = poly[d] / denom;
+  }
+  return w;
+}
+
+// IEEE fp16 <-> fp32, round to nearest even
+inline uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const uint32_t fexp = (x >> 23) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+  const int exp = int(fexp) - 127 + 15;
+  if (fexp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);  // inf / nan
+  if (exp >= 0x1f) return sign | 0x7c00;                         // overflow
+  if (exp <= 0) {                                                // subnormal
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    const int shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    const uint32_t rem = mant & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) ++h;
+    return sign | h;
+  }
+  uint32_t h = sign | (uint32_t(exp) << 10) | (mant >> 13);
+  const uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;  // may carry into exp
+  return h;
+}
+
+inline float HalfToFloat(uint16_t h) {
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {
+      exp = 127 - 15 + 1;
+      while (!(mant & 0x400)) { mant <<= 1; --exp; }
+      x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+  } else {
+    x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Peak count clamped to the 1..kMaxPeaks slots the peak buffers hold
+inline int ClampPeaks(int num_peaks) {
+  return num_peaks < 1 ? 1 : num_peaks > kMaxPeaks ? kMaxPeaks : num_peaks;
+}
+
+// The num_peaks highest local maxima of a spectrum as (index, value, width)
+// triplets sorted by value, width being the interpolated full width at half
+// maximum in bins. Unused slots get index -1. num_peaks is clamped
+// (ClampPeaks).
+inline void ExtractPeaks(const float y[kOutSize], int num_peaks,
+                         float peaks[kMaxPeaks * kPeakFields]) {
+  num_peaks = ClampPeaks(num_peaks);
+  int idx[kMaxPeaks];
+  float val[kMaxPeaks];
+  for (int k = 0; k < kMaxPeaks; ++k) { idx[k] = -1; val[k] = -3.4e38f; }
+
+  for (int i = 0; i < kOutSize; ++i) {
+    const float left = i > 0 ? y[i - 1] : -3.4e38f;
+    const float right = i < kOutSize - 1 ? y[i + 1] : -3.4e38f;
+    const float v = y[i];
+    if (!(v > left && v >= right && v > val[num_peaks - 1])) continue;
+    int k = num_peaks - 1;
+    while (k > 0 && val[k - 1] < v) { val[k] = val[k - 1]; idx[k] = idx[k - 1]; --k; }
+    val[k] = v;
+    idx[k] = i;
+  }
+
+  for (int k = 0; k < num_peaks; ++k) {
+    float width = 0.0f;
+    if (idx[k] >= 0 && val[k] > 0.0f) {
+      const float half = val[k] * 0.5f;
+      int l = idx[k], r = idx[k];
+      while (l > 0 && y[l - 1] > half) --l;
+      while (r < kOutSize - 1 && y[r + 1] > half) ++r;
+      const float lpos = l > 0 ? l - 1 + (half - y[l - 1]) / (y[l] - y[l - 1]) : 0.0f;
+      const float rpos = r < kOutSize - 1 ? r + (y[r] - half) / (y[r] - y[r + 1])
+                                          : float(kOutSize - 1);
+      width = rpos - lpos;
+    }
+    peaks[k * kPeakFields + 0] = float(idx[k]);
+    peaks[k * kPeakFields + 1] = idx[k] >= 0 ? val[k] : 0.0f;
+    peaks[k * kPeakFields + 2] = width;
+  }
+}
+
+
+// Trained parameters, as produced by scripts/pth_to_bin.py. fc*_rank is 0
+// unless the data directory also holds fc*_u.bin / fc*_v.bin, in which case
+// both engines use the factors instead of the dense weight.
+struct CnnModel {
+    aligned_vector<float> conv1_bias = aligned_vector<float>(kChannels1);
+    aligned_vector<float> conv2_bias = aligned_vector<float>(kChannels2);
+    aligned_vector<float> conv3_bias = aligned_vector<float>(kChannels3);
+    aligned_vector<float> conv1_weight = aligned_vector<float>(kChannels1 * kKernel1);
+    aligned_vector<float> conv2_weight = aligned_vector<float>(kChannels2 * kChannels1 * kKernel2);
+    aligned_vector<float> conv3_weight = aligned_vector<float>(kChannels3 * kChannels2 * kKernel3);
+
+    aligned_vector<float> bn1_bias = aligned_vector<float>(kChannels1);
+    aligned_vector<float> bn2_bias = aligned_vector<float>(kChannels2);
+    aligned_vector<float> bn3_bias = aligned_vector<float>(kChannels3);
+    aligned_vector<float> bn1_weight = aligned_vector<float>(kChannels1);
+    aligned_vector<float> bn2_weight = aligned_vector<float>(kChannels2);
+    aligned_vector<float> bn3_weight = aligned_vector<float>(kChannels3);
+    aligned_vector<float> bn1_running_mean = aligned_vector<float>(kChannels1);
+    aligned_vector<float> bn2_running_mean = aligned_vector<float>(kChannels2);
+    aligned_vector<float> bn3_running_mean = aligned_vector<float>(kChannels3);
+    aligned_vector<float> bn1_running_var = aligned_vector<float>(kChannels1);
+    aligned_vector<float> bn2_running_var = aligned_vector<float>(kChannels2);
+    aligned_vector<float> bn3_running_var = aligned_vector<float>(kChannels3);
+
+    aligned_vector<float> fc1_bias = aligned_vector<float>(LinearSize2);
+    aligned_vector<float> fc2_bias = aligned_vector<float>(kOutSize);
+    aligned_vector<float> fc1_weight = aligned_vector<float>(LinearSize1 * LinearSize2);
+    aligned_vector<float> fc2_weight = aligned_vector<float>(LinearSize2 * kOutSize);
+
+    // Low-rank factors; kept at least one element so they can always be mapped
+    int fc1_rank = 0;
+    int fc2_rank = 0;
+    aligned_vector<float> fc1_u = aligned_vector<float>(1);
+    aligned_vector<float> fc1_v = aligned_vector<float>(1);
+    aligned_vector<float> fc2_u = aligned_vector<float>(1);
+    aligned_vector<float> fc2_v = aligned_vector<float>(1);
+
+    // Winograd conv2 / conv3 (PrepareWinograd): tile m, 0 = direct conv, and
+    // the transformed weights G * g, [oc][ic][alpha]
+    int conv2_tile = 0;
+    int conv3_tile = 0;
+    aligned_vector<float> conv2_wino = aligned_vector<float>(1);
+    aligned_vector<float> conv3_wino = aligned_vector<float>(1);
+
+    // Detector calibration for raw frames (calib_*.bin next to the weights)
+    bool has_calib = false;
+    aligned_vector<float> calib_dark = aligned_vector<float>(kRawSize);
+    aligned_vector<float> calib_gain = aligned_vector<float>(kRawSize);
+    aligned_vector<float> calib_scale = aligned_vector<float>(kInSize);
+    aligned_vector<float> calib_shift = aligned_vector<float>(kInSize);
+
+    // Pre-screen gating model (gate_*.bin, scripts/gate_to_bin.py)
+    bool has_gate = false;
+    aligned_vector<float> gate_w1 = aligned_vector<float>(kGateHidden * kInSize);
+    aligned_vector<float> gate_b1 = aligned_vector<float>(kGateHidden);
+    aligned_vector<float> gate_w2 = aligned_vector<float>(kGateHidden);
+    aligned_vector<float> gate_b2 = aligned_vector<float>(1);
+};
 
 void CnnKernel(
     tapa::mmap<float> input,
 
+    int input_mode,
+    tapa::mmap<uint16_t> raw,
+    tapa::mmap<float> calib_dark,
+    tapa::mmap<float> calib_gain,
+    tapa::mmap<float> calib_scale,
+    tapa::mmap<float> calib_shift,
+
+    tapa::mmap<float> screen,            // kScreenSize packed parameters
+    tapa::mmap<float> screen_template,   // [route][kOutSize]
+
     tapa::mmap<float> conv1_bias,
     tapa::mmap<float> conv2_bias,
     tapa::mmap<float> conv3_bias,
     tapa::mmap<float> conv1_weight,
     tapa::mmap<float> conv2_weight,
     tapa::mmap<float> conv3_weight,
+    tapa::mmap<float> conv2_wino,   // used when built with WINO_M2 > 0
+    tapa::mmap<float> conv3_wino,   // used when built with WINO_M3 > 0
 
     tapa::mmap<float> bn1_bias,
     tapa::mmap<float> bn2_bias,
@@ -96,70 +503,299 @@ void CnnKernel(
     tapa::mmap<float> fc2_bias,
     tapa::mmap<float> fc1_weight,
     tapa::mmap<float> fc2_weight,
+
+    int fc1_rank,
+    tapa::mmap<float> fc1_u,
+    tapa::mmap<float> fc1_v,
+    int fc2_rank,
+    tapa::mmap<float> fc2_u,
+    tapa::mmap<float> fc2_v,
+
+    int output_mode,
+    int num_peaks,
     
-    tapa::mmap<float> output);
+    tapa::mmap<float> output,
+    tapa::mmap<float> peaks,
+    tapa::mmap<uint16_t> output_half,
+    tapa::mmap<int> nnz,
+    tapa::mmap<int> route);
+
+// Layer boundaries where a batch can move from the device to the CPU
+// engine. The device runs every stage before the boundary and streams that
+// boundary's activations back (compact [channel][x], pitch padding dropped);
+// CnnFinishBatch runs the rest on the CPU.
+const int kSplitCpu = 0;     // nothing on the device: the inputs
+const int kSplitConv1 = 1;   // after conv1/bn1/relu/pool: P1
+const int kSplitConv2 = 2;   // after conv2/bn2/relu/pool: P2
+const int kSplitConv3 = 3;   // after conv3/bn3/relu: flat3
+const int kSplitFc1 = 4;     // after fc1/relu: L4
+const int kSplitDevice = 5;  // everything on the device: normalized spectra
+const int kNumSplits = 6;
+
+constexpr int kSplitSize[kNumSplits] = {
+  kInSize, kChannels1 * kSize2, kChannels2 * kSize3, LinearSize1, LinearSize2, kOutSize,
+};
+extern const char* const kSplitNames[kNumSplits];
+
+// Batch kernel: n inputs -> n activations at boundary `split` (kSplitConv1..
+// kSplitDevice; kSplitDevice gives the full normalized spectra), sharded
+// across NUM_PE PEs that share one broadcast of the weights (see cnn.cpp).
+// Any other split does nothing and leaves outputs untouched.
+void CnnBatchKernel(
+    int n,
+    int split,
+    tapa::mmap<float> inputs,
+
+    tapa::mmap<float> conv1_bias,
+    tapa::mmap<float> conv2_bias,
+    tapa::mmap<float> conv3_bias,
+    tapa::mmap<float> conv1_weight,
+    tapa::mmap<float> conv2_weight,
+    tapa::mmap<float> conv3_weight,
+
+    tapa::mmap<float> bn1_bias,
+    tapa::mmap<float> bn2_bias,
+    tapa::mmap<float> bn3_bias,
+    tapa::mmap<float> bn1_weight,
+    tapa::mmap<float> bn2_weight,
+    tapa::mmap<float> bn3_weight,
+    tapa::mmap<float> bn1_running_mean,
+    tapa::mmap<float> bn2_running_mean,
+    tapa::mmap<float> bn3_running_mean,
+    tapa::mmap<float> bn1_running_var,
+    tapa::mmap<float> bn2_running_var,
+    tapa::mmap<float> bn3_running_var,
+
+    tapa::mmap<float> fc1_bias,
+    tapa::mmap<float> fc2_bias,
+    tapa::mmap<float> fc1_weight,
+    tapa::mmap<float> fc2_weight,
+
+    int fc1_rank,
+    tapa::mmap<float> fc1_u,
+    tapa::mmap<float> fc1_v,
+    int fc2_rank,
+    tapa::mmap<float> fc2_u,
+    tapa::mmap<float> fc2_v,
+
+    tapa::mmap<float> outputs);   // n x kSplitSize[split]
 
 // Sequential CNN implementation
 void CnnSequential(
+    const aligned_vector<float> & input,
+    const CnnModel & model,
+    aligned_vector<float> & output,
+    aligned_vector<int> & nnz);
+
+// Monte-Carlo dropout: per-bin mean and variance of the normalized spectrum
+// over `samples` stochastic passes with dropout probability p after conv3
+// and fc1. The conv stack runs once; the masked FC passes run batched.
+void CnnMcDropout(
+    const aligned_vector<float> & input,
+    const CnnModel & model,
+    int samples,
+    float p,
+    uint32_t seed,
+    aligned_vector<float> & mean,
+    aligned_vector<float> & var);
+
+// FC kernel variants of the CPU engine
+const int kFcSkipZeros = 0;  // per sample, only columns of nonzero inputs
+const int kFcBatched = 1;    // whole block at once, each column read once
+const int kFcTiled = 2;      // per sample, dense with an output tile in registers
+
+// CPU engine configuration, normally picked by AutotuneCpu (tune.h)
+struct CpuConfig {
+    int fc1_variant = kFcSkipZeros;
+    int fc1_tile = 32;
+    int fc2_variant = kFcSkipZeros;
+    int fc2_tile = 32;
+    int batch_block = 16;  // samples pushed through the FC layers together
+    int threads = 1;
+};
+
+// The weights the CPU engine reads, as plain pointers into a CnnModel
+// (ViewWeights) or into copies placed elsewhere (NumaEngine's per-node ones)
+struct CnnWeightView {
+    const float* conv1_bias;
+    const float* conv2_bias;
+    const float* conv3_bias;
+    const float* conv1_weight;
+    const float* conv2_weight;
+    const float* conv3_weight;
+    int conv2_tile;
+    int conv3_tile;
+    const float* conv2_wino;
+    const float* conv3_wino;
+
+    const float* bn1_bias;
+    const float* bn2_bias;
+    const float* bn3_bias;
+    const float* bn1_weight;
+    const float* bn2_weight;
+    const float* bn3_weight;
+    const float* bn1_running_mean;
+    const float* bn2_running_mean;
+    const float* bn3_running_mean;
+    const float* bn1_running_var;
+    const float* bn2_running_var;
+    const float* bn3_running_var;
+
+    const float* fc1_bias;
+    const float* fc2_bias;
+    const float* fc1_weight;
+    const float* fc2_weight;
+    int fc1_rank;
+    int fc2_rank;
+    const float* fc1_u;
+    const float* fc1_v;
+    const float* fc2_u;
+    const float* fc2_v;
+};
+
+// Valid as long as model is alive and unchanged
+CnnWeightView ViewWeights(const CnnModel & model);
+
+// Batched CPU engine: n inputs of kInSize floats -> n normalized spectra
+void CnnBatch(
+    const float* inputs,
+    int n,
+    const CnnModel & model,
+    const CpuConfig & cfg,
+    float* outputs);
+
+// CnnBatch on weights that need not live in a CnnModel
+void CnnBatch(
+    const float* inputs,
+    int n,
+    const CnnWeightView & weights,
+    const CpuConfig & cfg,
+    float* outputs);
+
+// n raw detector frames (kRawSize counts each) -> n model inputs (kInSize)
+void CnnPreprocess(const uint16_t* frames, int n, const CnnModel & model, float* inputs);
+
+// CnnBatch on raw frames, preprocessed block by block inside the workers
+void CnnBatchRaw(
+    const uint16_t* frames,
+    int n,
+    const CnnModel & model,
+    const CpuConfig & cfg,
+    float* outputs);
+
+// Pre-screen settings (see kRouteEmpty...), negative = check off
+struct ScreenConfig {
+    bool enabled = false;
+    int fast_mode = kFastFlag;
+    float empty_level = -1;
+    float saturation_level = -1;
+    int saturation_count = 1;
+    float signal_threshold = -1;
+    bool use_gate = false;     // needs a model with gate_*.bin
+    float gate_threshold = 0;
+};
+
+// A ScreenConfig in kernel form: the packed parameters including the gate
+// weights, and the fast-path templates [route][kOutSize] (row 0 unused)
+struct ScreenTables {
+    aligned_vector<float> params = aligned_vector<float>(kScreenSize);
+    aligned_vector<float> templates = aligned_vector<float>(kNumRoutes * kOutSize);
+};
+
+// Packs cfg and caches each route's template: the network's output on the
+// route's canonical frame (zeros, saturation_level everywhere, and a flat
+// 1 / kInSize frame for low signal and the gate)
+bool PrepareScreen(const CnnModel & model, const ScreenConfig & cfg,
+                   ScreenTables & tables, string* error);
+
+// Route of one input (kRouteFull when screening is off)
+int CnnScreen(const float* input, const float* params);
+
+struct ScreenStats {
+    uint64_t count[kNumRoutes] = {};
+};
+
+// CnnBatch behind the pre-screen: the network runs on the kRouteFull inputs
+// only, compacted into one batch; the other rows get their template, or
+// zeros in kFastFlag mode. routes (may be null) receives every input's
+// route; stats (may be null) is added to.
+void CnnBatchScreened(
+    const float* inputs,
+    int n,
+    const CnnModel & model,
+    const CpuConfig & cfg,
+    const ScreenTables & screen,
+    float* outputs,
+    int* routes,
+    ScreenStats* stats);
+
+// Back half of a split batch: n activations at boundary `split` (as written
+// by CnnBatchKernel) -> n normalized spectra, blocked like CnnBatch
+void CnnFinishBatch(
+    const float* acts,
+    int n,
+    int split,
+    const CnnModel & model,
+    const CpuConfig & cfg,
+    float* outputs);
+
+// Conv stack only: n inputs -> n flattened conv3 activations (LinearSize1)
+void CnnConvFlat(const float* inputs, int n, const CnnModel & model, float* flat3);
+
+// Single FC layer over `rows` activations with a given variant (for tuning)
+void CnnFc1Block(const CnnModel & model, int variant, int tile,
+                 const float* in, int rows, float* out);
+void CnnFc2Block(const CnnModel & model, int variant, int tile,
+                 const float* in, int rows, float* out);
+
+// Content hash of all parameters, identifies a model in caches and files
+uint64_t ModelHash(const CnnModel & model);
+
+// Loads the parameters in data_dir; returns false with *error set instead of
+// exiting, for loads that must not take the process down
+bool LoadModel(
+    const string& data_dir,
+    CnnModel & model,
+    string* error);
+
+// Switches conv2 / conv3 to Winograd F(m, r) with the given tile sizes (0
+// keeps the direct convolution, else 2..kMaxWinoTile) and pre-transforms
+// their weights; call after loading
+bool PrepareWinograd(CnnModel & model, int conv2_tile, int conv3_tile, string* error);
+
+// Loads the sample in data_dir/input.bin, same error contract as LoadModel
+bool LoadInput(
+    const string& data_dir,
     aligned_vector<float> & input,
+    string* error);
 
-    aligned_vector<float> & conv1_bias,
-    aligned_vector<float> & conv2_bias,
-    aligned_vector<float> & conv3_bias,
-    aligned_vector<float> & conv1_weight,
-    aligned_vector<float> & conv2_weight,
-    aligned_vector<float> & conv3_weight,
-
-    aligned_vector<float> & bn1_bias,
-    aligned_vector<float> & bn2_bias,
-    aligned_vector<float> & bn3_bias,
-    aligned_vector<float> & bn1_weight,
-    aligned_vector<float> & bn2_weight,
-    aligned_vector<float> & bn3_weight,
-    aligned_vector<float> & bn1_running_mean,
-    aligned_vector<float> & bn2_running_mean,
-    aligned_vector<float> & bn3_running_mean,
-    aligned_vector<float> & bn1_running_var,
-    aligned_vector<float> & bn2_running_var,
-    aligned_vector<float> & bn3_running_var,
-
-    aligned_vector<float> & fc1_bias,
-    aligned_vector<float> & fc2_bias,
-    aligned_vector<float> & fc1_weight,
-    aligned_vector<float> & fc2_weight,
-
-    aligned_vector<float> & output);
+// Loads one raw detector frame from data_dir/raw.bin
+bool LoadRaw(
+    const string& data_dir,
+    aligned_vector<uint16_t> & frame,
+    string* error);
 
+// Loads the expected output in data_dir/output.bin
+bool LoadOutput(
+    const string& data_dir,
+    aligned_vector<float> & output,
+    string* error);
+
+// Loads input.bin and the model, exiting on failure
 void LoadData(
     const string& data_dir, 
     aligned_vector<float> & input,
+    CnnModel & model);
 
-    aligned_vector<float> & conv1_bias,
-    aligned_vector<float> & conv2_bias,
-    aligned_vector<float> & conv3_bias,
-    aligned_vector<float> & conv1_weight,
-    aligned_vector<float> & conv2_weight,
-    aligned_vector<float> & conv3_weight,
-
-    aligned_vector<float> & bn1_bias,
-    aligned_vector<float> & bn2_bias,
-    aligned_vector<float> & bn3_bias,
-    aligned_vector<float> & bn1_weight,
-    aligned_vector<float> & bn2_weight,
-    aligned_vector<float> & bn3_weight,
-    aligned_vector<float> & bn1_running_mean,
-    aligned_vector<float> & bn2_running_mean,
-    aligned_vector<float> & bn3_running_mean,
-    aligned_vector<float> & bn1_running_var,
-    aligned_vector<float> & bn2_running_var,
-    aligned_vector<float> & bn3_running_var,
-
-    aligned_vector<float> & fc1_bias,
-    aligned_vector<float> & fc2_bias,
-    aligned_vector<float> & fc1_weight,
-    aligned_vector<float> & fc2_weight);
+// Relative and absolute tolerance check used by all the Verify functions
+float IsError(float a, float b);
 
 int Verify(const string& data_dir,
            aligned_vector<float> & output);
 
+// Compares extracted peaks against the peaks of the ground-truth spectrum
+int VerifyPeaks(const string& data_dir,
+                aligned_vector<float> & peaks,
+                int num_peaks);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef KERNEL_MODEL_H_
+#define KERNEL_MODEL_H_
+
+#include <string>
+#include <vector>
+#include "cnn.h"
+
+using std::string;
+
+// Analytical model of CnnKernel for picking the tuning knobs without a
+// synthesis run. Every stage is a sequence of pipelined loops, costed as
+//   trips * II + depth   (+ an AXI round trip per burst from DRAM)
+// where II is the larger of the compute steps left after unrolling and the
+// BRAM port limit of the partitioned arrays the loop reads (two ports per
+// bank). Resources count one fp32 multiply-add per unrolled lane; BRAM
+// counts the partitioned activation and index buffers. It is a first-order
+// model: use it to rank configurations, then check the pick against
+// csynth (kernel_model --csynth) or a hardware run.
+
+// Compile-time knobs of the kernel plus the platform parameters
+struct KernelKnobs {
+    int ic_unroll = IC_UNROLL;
+    int k1_unroll = K1_UNROLL;
+    int k2_unroll = K2_UNROLL;
+    int k3_unroll = K3_UNROLL;
+    int wino_m2 = WINO_M2;
+    int wino_m3 = WINO_M3;
+    // mmap data width; wider ports move several floats per beat. CnnKernel
+    // builds 32 (its ports are tapa::mmap<float>): a wider one needs the FC
+    // weight and factor ports as tapa::mmap<tapa::vec_t<float, N>>, the host
+    // arrays padded to N floats per column, and the FC column loops reading
+    // one vector per beat. Larger values estimate what that change buys.
+    int port_bits = 32;
+    double clock_mhz = 300;
+    double dram_gbps = 19.2;   // one DDR4-2400 channel
+};
+
+// Data-dependent inputs: active FC inputs per sample (ReLU zeros are
+// skipped) and the low-rank factorization
+struct KernelWorkload {
+    int fc1_active = LinearSize1 / 2;
+    int fc2_active = LinearSize2 / 2;
+    int fc1_rank = 0;
+    int fc2_rank = 0;
+};
+
+// Operator costs; fp32 on DSP58 / DSP48E2 class devices at ~300 MHz
+const int kFmulLatency = 3;
+const int kFaddLatency = 4;
+const int kBramLatency = 2;
+const int kAxiLatency = 64;     // DRAM round trip that starts every burst
+const int kFmulDsp = 3;
+const int kFaddDsp = 2;
+const int kBram18Words = 512;   // 32-bit words per BRAM18
+const int kLutramDepth = 64;    // shallower banks map to LUTRAM
+
+struct StageEstimate {
+    string name;
+    double cycles = 0;
+    int ii = 1;               // II of the stage's main pipelined loop
+    int lanes = 0;            // parallel multiply-adds
+    int dsp = 0;
+    int bram18 = 0;
+    double dram_bytes = 0;
+    double flops = 0;
+    string limit;             // what sets the II or dominates the cycles
+};
+
+struct KernelEstimate {
+    std::vector<StageEstimate> stages;
+    double cycles = 0;
+    int dsp = 0;
+    int bram18 = 0;           // stage buffers plus the ping/pong activations
+    double dram_bytes = 0;
+    double flops = 0;
+
+    double seconds(const KernelKnobs & k) const { return cycles / (k.clock_mhz * 1e6); }
+};
+
+// Checks the knobs are in range (unrolls >= 1, Winograd tile 0 or 2..kMaxWinoTile)
+bool ValidKnobs(const KernelKnobs & knobs, string* error);
+
+KernelEstimate EstimateKernel(const KernelKnobs & knobs, const KernelWorkload & work);
+
+// Per-stage table with roofline columns (arithmetic intensity, attained vs
+// compute and DRAM roofs) and the totals
+string FormatEstimate(const KernelKnobs & knobs, const KernelEstimate & est);
+
+// "IC_UNROLL=4 K1_UNROLL=7 ..." as passed to make
+string DescribeKnobs(const KernelKnobs & knobs);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef NUMA_ENGINE_H_
+#define NUMA_ENGINE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cnn.h"
+
+using std::string;
+
+// NUMA nodes with CPUs, from /sys/devices/system/node. Machines without the
+// sysfs tree (or with NUMA off) show up as one node holding every CPU.
+struct NumaTopology {
+    std::vector<int> nodes;               // node ids
+    std::vector<std::vector<int>> cpus;   // CPUs of nodes[i]
+};
+
+NumaTopology DetectNuma();
+
+// Node of the page holding p (touched pages only), -1 when unknown
+int NumaNodeOf(const void* p);
+
+// Whether transparent huge pages can back madvise(MADV_HUGEPAGE) regions
+bool TransparentHugePages();
+
+// CPU engine with one model replica and one pinned worker pool per NUMA
+// node. A replica is a packed copy of the weight arrays in a region the
+// engine maps, binds to the node before first touch and advises onto huge
+// pages, read through a CnnWeightView; FC weight columns never cross the
+// interconnect. Run sends a batch to the node owning its input buffer
+// (round-robin when the node is unknown) and blocks until it is done; the
+// node's workers share it block by block like CnnBatch.
+class NumaEngine {
+ public:
+    struct NodeStats {
+        int node = 0;
+        int workers = 0;
+        uint64_t batches = 0;
+        uint64_t samples = 0;
+        double busy_seconds = 0;     // summed over the node's workers
+        double local_weights = 0;    // fraction of replica weight pages on the node
+        bool huge_pages = false;     // replica weights advised onto huge pages
+    };
+
+    NumaEngine();
+    ~NumaEngine();
+    NumaEngine(const NumaEngine &) = delete;
+    NumaEngine & operator=(const NumaEngine &) = delete;
+
+    // Replicates model onto every node and starts threads_per_node workers
+    // per node (0 = one per CPU of the node); cfg.threads is ignored
+    bool Start(const CnnModel & model, const CpuConfig & cfg, int threads_per_node,
+               string* error);
+
+    // n inputs -> n normalized spectra, as CnnBatch
+    void Run(const float* inputs, int n, float* outputs);
+
+    // count floats mapped and bound on node i, for batches Run should send
+    // there. Valid until the engine is destroyed; nullptr when mmap fails.
+    float* Buffer(int i, size_t count);
+
+    int nodes() const { return int(nodes_.size()); }
+    NodeStats stats(int i) const;
+
+ private:
+    struct Job;
+    struct Node;
+
+    void Work(Node & node);
+
+    CpuConfig cfg_;
+    std::vector<std::unique_ptr<Node>> nodes_;
+    std::atomic<unsigned> next_node_{0};
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <cstdint>
+#include <string>
+#include "cnn.h"
+
+using std::string;
+
+// Hardware events counted through perf_event_open
+enum PerfEvent {
+    kPerfCycles,
+    kPerfInstructions,
+    kPerfL1dMisses,    // L1D read misses
+    kPerfLlcMisses,    // last-level cache misses, ~64 B of DRAM traffic each
+    kNumPerfEvents
+};
+
+// Counter totals plus wall time; differences of two readings cover a region
+struct PerfReading {
+    uint64_t count[kNumPerfEvents] = {};
+    double seconds = 0;
+
+    PerfReading operator-(const PerfReading & o) const;
+    PerfReading & operator+=(const PerfReading & o);
+};
+
+// Opens one counter per event for the calling thread and the threads it
+// creates afterwards. Events the kernel or hardware refuses (no PMU in a VM,
+// perf_event_paranoid, ...) are left closed and reported as unavailable;
+// readings then only carry the wall time.
+class PerfCounters {
+ public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters & operator=(const PerfCounters &) = delete;
+
+    bool available(PerfEvent e) const { return fd_[e] >= 0; }
+    bool any_available() const;
+    const string & error() const { return error_; }
+
+    PerfReading Read() const;
+
+ private:
+    int fd_[kNumPerfEvents];
+    string error_;
+};
+
+// IPC, misses per sample, LLC-miss traffic in GB/s and GFLOPS of a region
+string FormatPerf(const PerfCounters & counters, const PerfReading & delta,
+                  double samples, double flops);
+
+// Per-layer breakdown of the CPU engine
+enum ProfiledLayer { kProfConv1, kProfConv2, kProfConv3, kProfFc1, kProfFc2, kProfRms,
+                     kNumProfiledLayers };
+extern const char* const kProfiledLayerNames[kNumProfiledLayers];
+
+// Dense FLOPs of one layer for one sample
+double ProfiledLayerFlops(int layer);
+
+struct LayerProfile {
+    PerfReading layer[kNumProfiledLayers];
+    int samples = 0;
+};
+
+// Runs n samples through the CPU engine, reading the counters between layers
+void CnnProfileLayers(const float* inputs, int n, const CnnModel & model,
+                      const PerfCounters & counters, LayerProfile & profile);
+
+#endif
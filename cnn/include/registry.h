@@ -0,0 +1,98 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "cnn.h"
+
+using std::string;
+
+// A model as published in the registry
+struct RegisteredModel {
+    CnnModel model;
+    uint64_t hash = 0;      // ModelHash(model)
+    uint64_t version = 0;   // increases with every publish into any slot
+    string source;          // data directory it was loaded from
+};
+
+// Named, hot-swappable models. Publishing replaces a slot's model with one
+// atomic pointer exchange; the old model is freed by epoch-based
+// reclamation once no reader that could still see it is active. Readers
+// (ReadGuard) never take a lock: they announce the global epoch in a free
+// reader slot, load the model pointers and clear the slot when done, so a
+// batch that started on the old weights finishes on them and the next batch
+// picks up the new ones. Every published model runs the engine's Winograd
+// tiles (PrepareWinograd), so a swap or A/B never mixes conv implementations.
+class ModelRegistry {
+ public:
+    static const int kMaxModels = 8;
+    static const int kMaxReaders = 64;
+
+    // conv2_tile / conv3_tile as for PrepareWinograd, 0 = direct
+    explicit ModelRegistry(int conv2_tile = 0, int conv3_tile = 0);
+    ~ModelRegistry();
+    ModelRegistry(const ModelRegistry &) = delete;
+    ModelRegistry & operator=(const ModelRegistry &) = delete;
+
+    // Handle of a named model slot, created empty on first use (-1 when all
+    // kMaxModels slots are taken). Resolve handles once, outside the hot path.
+    int Slot(const string & name);
+
+    // Prepares the registry's Winograd tiles, validates and publishes a model
+    // into the named slot
+    bool Publish(const string & name, CnnModel model, const string & source,
+                 string* error);
+
+    // Loads data_dir on a background thread, validates it and publishes it
+    // into the named slot; inference continues on the current model meanwhile
+    void LoadAsync(const string & name, const string & data_dir);
+
+    // Waits for background loads; returns their failures as "name: reason"
+    std::vector<string> WaitForLoads();
+
+    // Frees retired models no reader can still hold
+    void Reclaim();
+
+    class ReadGuard {
+     public:
+        explicit ReadGuard(ModelRegistry & registry);
+        ~ReadGuard();
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard & operator=(const ReadGuard &) = delete;
+
+        // Model in a slot as of this guard's lifetime, nullptr if empty
+        const RegisteredModel* get(int slot) const {
+            return registry_.models_[slot].load(std::memory_order_seq_cst);
+        }
+
+     private:
+        ModelRegistry & registry_;
+        int reader_;
+    };
+
+ private:
+    std::atomic<const RegisteredModel*> models_[kMaxModels];
+    std::atomic<uint64_t> readers_[kMaxReaders];  // 0 = idle, else pinned epoch
+    std::atomic<uint64_t> epoch_;
+    const int conv2_tile_;
+    const int conv3_tile_;
+
+    std::mutex writer_mutex_;  // slot names, retired list, loader threads
+    string names_[kMaxModels];
+    uint64_t next_version_ = 1;
+    std::vector<std::pair<const RegisteredModel*, uint64_t>> retired_;
+    std::vector<std::thread> loaders_;
+    std::vector<string> load_errors_;
+};
+
+// Sanity checks run before a model is published: finite parameters,
+// non-negative BN variances and, when data_dir holds input.bin and
+// output.bin, that the model reproduces them
+bool ValidateModel(const CnnModel & model, const string & data_dir, string* error);
+
+#endif
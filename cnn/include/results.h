@@ -0,0 +1,130 @@
+#ifndef RESULTS_H_
+#define RESULTS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "cnn.h"
+
+using std::string;
+
+// Chunked result container for long inference runs (.cnnr):
+//
+//   [header, kResultAlign bytes] [chunk 0] [chunk 1] ... [index] [trailer]
+//
+// Every chunk holds up to chunk_rows spectra and starts on a kResultAlign
+// boundary, so a chunk can be mmapped and, for plain float32, used in place.
+// The index lists (offset, rows, bytes) per chunk; the trailer at the very
+// end points at it. Appending reopens a file, drops its index and keeps
+// writing chunks after the last one.
+//
+// Encodings: float32 or fp16 (FloatToHalf) values, optionally delta coded:
+// each row stored as the element-wise integer difference of its bit patterns
+// to the previous row of the same chunk. Delta coding is lossless and keeps
+// chunks independent; it leaves near-identical consecutive spectra mostly
+// zero bytes for a downstream compressor or a sparse filesystem.
+
+const int kResultAlign = 4096;
+const int kResultDefaultChunkRows = 1024;
+// Largest chunk whose float32 encoding still fits ResultChunk::bytes
+const int kResultMaxChunkRows = UINT32_MAX / (kOutSize * sizeof(float));
+
+const int kResultFloat = 0;
+const int kResultHalf = 1;
+
+struct ResultHeader {
+    char magic[8];          // "CNNRES1"
+    uint32_t version;
+    uint32_t dtype;         // kResultFloat or kResultHalf
+    uint32_t delta;         // 1 = rows delta coded within a chunk
+    uint32_t row_size;      // values per row (kOutSize)
+    uint32_t input_size;    // model input values per sample (kInSize)
+    uint32_t chunk_rows;
+    uint64_t model_hash;    // ModelHash of the model that produced the rows
+    uint64_t rows;          // valid once the file is closed
+    uint64_t index_offset;  // valid once the file is closed
+};
+
+struct ResultChunk {
+    uint64_t offset;
+    uint32_t rows;
+    uint32_t bytes;
+};
+
+class ResultWriter {
+ public:
+    ResultWriter() = default;
+    ~ResultWriter();
+    ResultWriter(const ResultWriter &) = delete;
+    ResultWriter & operator=(const ResultWriter &) = delete;
+
+    // Creates path, or appends to it when append is set and it exists; an
+    // existing file must match the dtype, delta flag and model hash
+    bool Open(const string & path, uint64_t model_hash, int dtype, bool delta,
+              int chunk_rows, bool append, string* error);
+
+    // n rows of kOutSize floats, e.g. straight from CnnBatch
+    bool Append(const float* rows, int n, string* error);
+
+    // Flushes the partial chunk and writes the index; also done on destruction
+    bool Close(string* error);
+
+    uint64_t rows() const { return header_.rows + pending_; }
+
+ private:
+    bool FlushChunk(string* error);
+
+    int fd_ = -1;
+    ResultHeader header_ = {};
+    uint64_t end_ = 0;  // file offset of the next chunk
+    std::vector<ResultChunk> index_;
+    std::vector<float> buffer_;  // rows of the chunk being filled
+    int pending_ = 0;
+    std::vector<char> encoded_;
+};
+
+class ResultReader {
+ public:
+    ResultReader() = default;
+    ~ResultReader();
+    ResultReader(const ResultReader &) = delete;
+    ResultReader & operator=(const ResultReader &) = delete;
+
+    bool Open(const string & path, string* error);
+
+    const ResultHeader & header() const { return header_; }
+    const std::vector<ResultChunk> & index() const { return index_; }
+    uint64_t rows() const { return header_.rows; }
+
+    // Decodes rows [first, first + n) into out (n * row_size floats)
+    bool Read(uint64_t first, int n, float* out, string* error) const;
+
+    // Zero-copy view of row i for plain float32 files, nullptr otherwise
+    const float* Row(uint64_t i) const;
+
+ private:
+    const ResultChunk* Find(uint64_t row, uint64_t* first_row) const;
+
+    int fd_ = -1;
+    const char* base_ = nullptr;
+    size_t size_ = 0;
+    ResultHeader header_ = {};
+    std::vector<ResultChunk> index_;
+    std::vector<uint64_t> first_rows_;  // first row of every chunk
+};
+
+// n batch inputs (n * kInSize floats) for data_dir: row i is sample i of a
+// multi-sample inputs.bin holding at least n samples, else a copy of input.
+// Returns true for the inputs.bin rows, whose ground truth is output.cnnr.
+bool LoadBatchInputs(const string & data_dir, const aligned_vector<float> & input, int n,
+                     float* inputs);
+
+// Checks n batch outputs against the ground truth in data_dir. per_row
+// outputs (LoadBatchInputs returned true) are checked against row first + i
+// of output.cnnr, which must be written by the model with model_hash; other
+// outputs are all checked against output.bin. Returns the number of rows with
+// errors; *missing is set when no ground truth covers the rows.
+int VerifyBatch(const string & data_dir, const float* outputs, uint64_t first, int n,
+                bool per_row, uint64_t model_hash, bool* missing);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef SPLIT_ENGINE_H_
+#define SPLIT_ENGINE_H_
+
+#include <cstdint>
+#include <string>
+#include "cnn.h"
+
+using std::string;
+
+// Layer-level partitioning between the device and the CPU engine. The
+// device (CnnBatchKernel) runs the layers in front of a split boundary
+// (kSplitConv1..kSplitDevice) one chunk of samples at a time and streams the
+// chunk's boundary activations back; the CPU engine finishes each chunk with
+// CnnFinishBatch while the device already runs the next one. Two activation
+// buffers alternate, so the halves overlap and neither waits for more than
+// one chunk.
+struct SplitStats {
+    int chunks = 0;
+    double device_seconds = 0;   // summed kernel time (tapa::invoke)
+    double cpu_seconds = 0;      // summed CnnFinishBatch time
+    double wall_seconds = 0;
+    double bytes_back = 0;       // boundary activations read back from the device
+};
+
+// n inputs -> n normalized spectra with the split at `split`, chunk samples
+// per device run (the last one may be shorter). kSplitCpu runs CnnBatch
+// alone. bitstream is the CnnBatchKernel one (--batch_btstm, not the CnnKernel
+// --btstm), empty for software simulation.
+bool RunSplit(
+    const string & bitstream,
+    const CnnModel & model,
+    const CpuConfig & cfg,
+    int split,
+    const float* inputs,
+    int n,
+    int chunk,
+    float* outputs,
+    SplitStats* stats,
+    string* error);
+
+#endif
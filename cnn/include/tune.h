@@ -0,0 +1,20 @@
+#ifndef TUNE_H_
+#define TUNE_H_
+
+#include <string>
+#include "cnn.h"
+
+using std::string;
+
+// Picks the fastest CpuConfig for this machine and model: micro-benchmarks
+// the FC variants for the fc1 and fc2 shapes, then the batch block and the
+// thread count. Results are persisted in cache_path keyed by CPU model and
+// ModelHash, so later starts skip the benchmarks unless retune is set, which
+// replaces the cached entry.
+CpuConfig AutotuneCpu(const CnnModel & model,
+                      const string & cache_path,
+                      bool retune = false);
+
+string DescribeCpuConfig(const CpuConfig & cfg);
+
+#endif
@@ -1,30 +1,270 @@
-// --- tuning knobs (safe defaults) ---
-#ifndef IC_UNROLL
-#define IC_UNROLL 4          // try 2/4/8 depending on DSPs/BRAM
-#endif
-#ifndef K1_UNROLL
-#define K1_UNROLL kKernel1   // fully unroll tiny tap loops
-#endif
-#ifndef K2_UNROLL
-#define K2_UNROLL kKernel2
-#endif
-#ifndef K3_UNROLL
-#define K3_UNROLL kKernel3
-#endif
-
 #include <cmath>
 #include <tapa.h>
 #include "cnn.h"
 
+// FC layer kIn -> kOut that skips zero inputs: the nonzero indices of `in`
+// are compacted first and only their weight columns are streamed (weights
+// and factors are column-major, see cnn.h). With rank > 0 the layer runs as
+// two thin GEMVs, t = V * in and out = bias + U * t, instead of the dense
+// weight. Returns the number of nonzero inputs.
+template <int kIn, int kOut>
+int LinearSkipZeros(
+    const float in[kIn],
+    tapa::mmap<float> bias,
+    tapa::mmap<float> weight,
+    int rank,
+    tapa::mmap<float> u,
+    tapa::mmap<float> v,
+    float out[kOut]) {
+  int nz[kIn];
+  int n = 0;
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kIn; ++i)
+    if (in[i] != 0.0f) nz[n++] = i;
+
+  [[tapa::pipeline(1)]]
+  for (int o = 0; o < kOut; ++o) out[o] = bias[o];
+
+  if (rank == 0) {
+    for (int j = 0; j < n; ++j) {
+#pragma HLS LOOP_TRIPCOUNT max=kIn
+      const int i = nz[j];
+      const float a = in[i];
+      [[tapa::pipeline(1)]]
+      for (int o = 0; o < kOut; ++o) {
+#pragma HLS UNROLL factor=IC_UNROLL
+        out[o] += a * weight[i * kOut + o];
+      }
+    }
+    return n;
+  }
+
+  float t[kMaxRank];
+#pragma HLS ARRAY_PARTITION variable=t cyclic factor=IC_UNROLL dim=1
+  [[tapa::pipeline(1)]]
+  for (int r = 0; r < rank; ++r) t[r] = 0.0f;
+
+  for (int j = 0; j < n; ++j) {
+#pragma HLS LOOP_TRIPCOUNT max=kIn
+    const int i = nz[j];
+    const float a = in[i];
+    [[tapa::pipeline(1)]]
+    for (int r = 0; r < rank; ++r) {
+#pragma HLS LOOP_TRIPCOUNT max=kMaxRank
+      t[r] += a * v[i * rank + r];
+    }
+  }
+
+  for (int r = 0; r < rank; ++r) {
+#pragma HLS LOOP_TRIPCOUNT max=kMaxRank
+    const float a = t[r];
+    [[tapa::pipeline(1)]]
+    for (int o = 0; o < kOut; ++o) {
+#pragma HLS UNROLL factor=IC_UNROLL
+      out[o] += a * u[r * kOut + o];
+    }
+  }
+  return n;
+}
+
+// Raw-frame stage in front of conv1 (see cnn.h for the math). Pixels stream
+// in one per cycle through the dark/gain correction; the corrected frame is
+// partitioned by kRawBin so a bin's pixels sum in one cycle, and the flux sum
+// uses partial sums like the RMS normalization.
+static void Preprocess(
+    tapa::mmap<uint16_t> raw,
+    tapa::mmap<float> calib_dark,
+    tapa::mmap<float> calib_gain,
+    tapa::mmap<float> calib_scale,
+    tapa::mmap<float> calib_shift,
+    float x[kInSize]) {
+  float c[kRawSize];
+#pragma HLS ARRAY_PARTITION variable=c cyclic factor=kRawBin dim=1
+  [[tapa::pipeline(1)]]
+  for (int p = 0; p < kRawSize; ++p)
+    c[p] = (float(raw[p]) - calib_dark[p]) * calib_gain[p];
+
+  constexpr int kPartials = 8;
+  float part[kPartials];
+#pragma HLS ARRAY_PARTITION variable=part complete dim=1
+  for (int k = 0; k < kPartials; ++k) part[k] = 0.f;
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kInSize; ++i) {
+    float b = 0.f;
+#pragma HLS UNROLL
+    for (int j = 0; j < kRawBin; ++j) b += c[i * kRawBin + j];
+    x[i] = b;
+    part[i % kPartials] += b;
+  }
+  float total = 0.f;
+  for (int k = 0; k < kPartials; ++k) total += part[k];
+  const float inv = total > 0.f ? 1.0f / total : 0.f;
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kInSize; ++i) x[i] = x[i] * inv * calib_scale[i] + calib_shift[i];
+}
+
+// Pre-screen cascade (see cnn.h): one pipelined pass collects the peak,
+// peak magnitude, saturated bins and the mean (partial sums as in the RMS
+// normalization), then the checks run cheapest first. The gate MLP only runs
+// for frames that pass them: kGateHidden dot products over in0.
+static int Screen(const float x[kInSize], tapa::mmap<float> screen) {
+  if (screen[kScreenEnabled] == 0.f) return kRouteFull;
+  const float empty_level = screen[kScreenEmptyLevel];
+  const float sat_level = screen[kScreenSaturationLevel];
+  const int sat_count = int(screen[kScreenSaturationCount]);
+  const float signal = screen[kScreenSignalThreshold];
+
+  constexpr int kPartials = 8;
+  float part[kPartials];
+#pragma HLS ARRAY_PARTITION variable=part complete dim=1
+  for (int k = 0; k < kPartials; ++k) part[k] = 0.f;
+  float peak = x[0], peak_abs = 0.f;
+  int saturated = 0;
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kInSize; ++i) {
+    const float v = x[i];
+    part[i % kPartials] += v;
+    peak = max(peak, v);
+    peak_abs = max(peak_abs, std::fabs(v));
+    saturated += v >= sat_level;
+  }
+  float sum = 0.f;
+  for (int k = 0; k < kPartials; ++k) sum += part[k];
+
+  if (empty_level >= 0.f && peak_abs <= empty_level) return kRouteEmpty;
+  if (sat_level >= 0.f && saturated >= sat_count) return kRouteSaturated;
+  if (signal >= 0.f && peak - sum / kInSize < signal) return kRouteLowSignal;
+  if (screen[kScreenUseGate] != 0.f) {
+    float score = screen[kScreenGateB2];
+    for (int h = 0; h < kGateHidden; ++h) {
+      float acc = screen[kScreenGateB1 + h];
+      [[tapa::pipeline(1)]]
+      for (int i = 0; i < kInSize; ++i) acc += screen[kScreenGateW1 + h * kInSize + i] * x[i];
+      score += screen[kScreenGateW2 + h] * max(acc, 0.f);
+    }
+    if (score < screen[kScreenGateThreshold]) return kRouteGate;
+  }
+  return kRouteFull;
+}
+
+// Output reduction of a normalized spectrum: full, top-K peaks or fp16
+static void WriteOutput(
+    const float* y,
+    int output_mode,
+    int num_peaks,
+    tapa::mmap<float> output,
+    tapa::mmap<float> peaks,
+    tapa::mmap<uint16_t> output_half) {
+  if (output_mode == kOutputPeaks) {
+    float pk[kMaxPeaks * kPeakFields];
+    // The port carries whatever the host passed; never index past pk
+    const int count = ClampPeaks(num_peaks);
+    ExtractPeaks(y, count, pk);
+    for (int i = 0; i < count * kPeakFields; ++i) peaks[i] = pk[i];
+  } else if (output_mode == kOutputHalf) {
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kOutSize; ++i) output_half[i] = FloatToHalf(y[i]);
+  } else {
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kOutSize; ++i) output[i] = y[i];
+  }
+}
+
+// Conv layer as Winograd F(kM, kK): every tile of kM outputs takes alpha =
+// kM + kK - 1 multiplies per (oc, ic) instead of kM * kK. The transforms
+// are compile-time constants (MakeWinograd), so the fully unrolled BT / AT
+// products fold into adds and constant scalings. Input tiles are transformed
+// once into v and shared by all output channels; weights arrive already
+// transformed ([oc][ic][alpha], PrepareWinograd). Layout as the direct conv:
+// in [ic * kPitchIn + x], out [oc * kLen + x], bias added here.
+template <int kIC, int kOC, int kK, int kLen, int kPitchIn, int kM>
+static void WinogradConv(const float* in, tapa::mmap<float> wino, const float* bias,
+                         float* out) {
+  constexpr WinogradTransform kW = MakeWinograd(kM, kK);
+  constexpr int kAlpha = kM + kK - 1;
+  constexpr int kTiles = (kLen + kM - 1) / kM;
+  constexpr int pad = kK / 2;
+
+  static float v[kTiles][kIC][kAlpha];
+#pragma HLS ARRAY_PARTITION variable=v cyclic factor=IC_UNROLL dim=2
+#pragma HLS ARRAY_PARTITION variable=v complete dim=3
+  for (int t = 0; t < kTiles; ++t) {
+    [[tapa::pipeline(1)]]
+    for (int ic = 0; ic < kIC; ++ic) {
+      float d[kAlpha];
+#pragma HLS ARRAY_PARTITION variable=d complete dim=1
+      for (int j = 0; j < kAlpha; ++j) {
+#pragma HLS UNROLL
+        const int idx = t * kM - pad + j;
+        d[j] = (idx >= 0 && idx < kLen) ? in[ic * kPitchIn + idx] : 0.0f;
+      }
+      for (int i = 0; i < kAlpha; ++i) {
+#pragma HLS UNROLL
+        float acc = 0.0f;
+        for (int j = 0; j < kAlpha; ++j) {
+#pragma HLS UNROLL
+          if (kW.bt[i][j] != 0.0) acc += float(kW.bt[i][j]) * d[j];
+        }
+        v[t][ic][i] = acc;
+      }
+    }
+  }
+
+  static float u[kIC][kAlpha];
+#pragma HLS ARRAY_PARTITION variable=u cyclic factor=IC_UNROLL dim=1
+#pragma HLS ARRAY_PARTITION variable=u complete dim=2
+  for (int oc = 0; oc < kOC; ++oc) {
+    // Per-OC transformed weight tile
+    [[tapa::pipeline(1)]]
+    for (int f = 0; f < kIC * kAlpha; ++f)
+      u[f / kAlpha][f % kAlpha] = wino[oc * kIC * kAlpha + f];
+
+    [[tapa::pipeline(1)]]
+    for (int t = 0; t < kTiles; ++t) {
+      float acc[kAlpha];
+#pragma HLS ARRAY_PARTITION variable=acc complete dim=1
+      for (int i = 0; i < kAlpha; ++i) acc[i] = 0.0f;
+#pragma HLS UNROLL factor=IC_UNROLL
+      for (int ic = 0; ic < kIC; ++ic) {
+        for (int i = 0; i < kAlpha; ++i) {
+#pragma HLS UNROLL
+          acc[i] += u[ic][i] * v[t][ic][i];
+        }
+      }
+      for (int x = 0; x < kM; ++x) {
+#pragma HLS UNROLL
+        float y = bias[oc];
+        for (int i = 0; i < kAlpha; ++i) {
+#pragma HLS UNROLL
+          if (kW.at[x][i] != 0.0) y += float(kW.at[x][i]) * acc[i];
+        }
+        if (t * kM + x < kLen) out[oc * kLen + t * kM + x] = y;
+      }
+    }
+  }
+}
+
 void CnnKernel(
     tapa::mmap<float> input,
 
+    int input_mode,
+    tapa::mmap<uint16_t> raw,
+    tapa::mmap<float> calib_dark,
+    tapa::mmap<float> calib_gain,
+    tapa::mmap<float> calib_scale,
+    tapa::mmap<float> calib_shift,
+
+    tapa::mmap<float> screen,
+    tapa::mmap<float> screen_template,
+
     tapa::mmap<float> conv1_bias,
     tapa::mmap<float> conv2_bias,
     tapa::mmap<float> conv3_bias,
     tapa::mmap<float> conv1_weight,
     tapa::mmap<float> conv2_weight,
     tapa::mmap<float> conv3_weight,
+    tapa::mmap<float> conv2_wino,
+    tapa::mmap<float> conv3_wino,
 
     tapa::mmap<float> bn1_bias,
     tapa::mmap<float> bn2_bias,
@@ -43,8 +283,22 @@ void CnnKernel(
     tapa::mmap<float> fc2_bias,
     tapa::mmap<float> fc1_weight,
     tapa::mmap<float> fc2_weight,
+
+    int fc1_rank,
+    tapa::mmap<float> fc1_u,
+    tapa::mmap<float> fc1_v,
+    int fc2_rank,
+    tapa::mmap<float> fc2_u,
+    tapa::mmap<float> fc2_v,
+
+    int output_mode,
+    int num_peaks,
     
-    tapa::mmap<float> output) {
+    tapa::mmap<float> output,
+    tapa::mmap<float> peaks,
+    tapa::mmap<uint16_t> output_half,
+    tapa::mmap<int> nnz,
+    tapa::mmap<int> route) {
 
   // ------------------------
   // Tiny caches to avoid repeated DRAM reads (Uses LUTRAM instead)
@@ -77,14 +331,56 @@ void CnnKernel(
   }
 
 #pragma HLS ARRAY_PARTITION variable=in0 cyclic factor=K1_UNROLL dim=1  // =7
-  // One-time prefetch of input -> tiny local buffer
+  // One-time prefetch of input -> tiny local buffer, or build it from a raw
+  // detector frame so the host does no per-frame work
   float in0[kInSize];
-  for (int i = 0; i < kInSize; ++i) in0[i] = input[i];
+  if (input_mode == kInputRaw) {
+    Preprocess(raw, calib_dark, calib_gain, calib_scale, calib_shift, in0);
+  } else {
+    for (int i = 0; i < kInSize; ++i) in0[i] = input[i];
+  }
+
+  // ------------------------
+  // Activation buffers, assigned by the plan in cnn.h: every intermediate
+  // lives in ping or pong, flat indexed [channel * row pitch + x]
+  // ------------------------
+  static float ping[kActPlan.slot_size[0]];
+  static float pong[kActPlan.slot_size[1]];
+#pragma HLS ARRAY_PARTITION variable=ping cyclic factor=IC_UNROLL dim=1
+#pragma HLS ARRAY_PARTITION variable=pong cyclic factor=IC_UNROLL dim=1
+  float* const L1 = kActPlan.slot[kActL1] == 0 ? ping : pong;
+  float* const P1 = kActPlan.slot[kActP1] == 0 ? ping : pong;
+  float* const L2 = kActPlan.slot[kActL2] == 0 ? ping : pong;
+  float* const P2 = kActPlan.slot[kActP2] == 0 ? ping : pong;
+  float* const L3 = kActPlan.slot[kActL3] == 0 ? ping : pong;
+  float* const L4 = kActPlan.slot[kActL4] == 0 ? ping : pong;
+  float* const L5 = kActPlan.slot[kActL5] == 0 ? ping : pong;
+
+  // Pre-screen: trivial frames skip the network and report their route
+  // only, or the route's cached template spectrum
+  const int r = Screen(in0, screen);
+  if (r != kRouteFull) {
+    nnz[0] = 0;
+    nnz[1] = 0;
+    route[0] = r;
+    if (int(screen[kScreenFastMode]) == kFastFlag) return;
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kOutSize; ++i) L5[i] = screen_template[r * kOutSize + i];
+    WriteOutput(L5, output_mode, num_peaks, output, peaks, output_half);
+    return;
+  }
+
+#if !WINO_M2 || !WINO_M3
+  // One weight tile shared by conv2 and conv3 (conv1 keeps its own)
+  static_assert(kKernel3 <= kKernel2, "conv3 taps must fit the shared tile");
+  static float wt[kChannels2][kKernel2];
+#pragma HLS ARRAY_PARTITION variable=wt cyclic factor=IC_UNROLL dim=1
+#pragma HLS ARRAY_PARTITION variable=wt complete dim=2
+#endif
 
   // ------------------------
   // Conv1
   // ------------------------
-  static float L1[kChannels1][kInSize];
   constexpr int pad1 = kKernel1 / 2;
 
   // Local copy of conv1 weights (small) -> allow full tap unroll
@@ -104,7 +400,7 @@ void CnnKernel(
         float in_val = (idx >= 0 && idx < kInSize) ? in0[idx] : 0.f;
         acc += in_val * w1[oc][k];
       }
-      L1[oc][x] = acc;
+      L1[oc * kInSize + x] = acc;
     }
   }
 
@@ -114,8 +410,8 @@ void CnnKernel(
     float inv_sigma = 1.0f / std::sqrt(b1_v[oc] + eps);
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kInSize; ++x) {
-      float normalized = (L1[oc][x] - b1_m[oc]) * inv_sigma;
-      L1[oc][x] = normalized * b1_w[oc] + b1_b[oc];
+      float normalized = (L1[oc * kInSize + x] - b1_m[oc]) * inv_sigma;
+      L1[oc * kInSize + x] = normalized * b1_w[oc] + b1_b[oc];
     }
   }
 
@@ -123,36 +419,32 @@ void CnnKernel(
   for (int oc = 0; oc < kChannels1; ++oc) {
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kInSize; ++x)
-      L1[oc][x] = max(L1[oc][x], 0.0f);
+      L1[oc * kInSize + x] = max(L1[oc * kInSize + x], 0.0f);
   }
 
   // MaxPool1 -> P1
-  static float P1[kChannels1][kSize2];
   for (int oc = 0; oc < kChannels1; ++oc) {
     [[tapa::pipeline(1)]]
     for (int i = 0; i < kSize2; ++i) {
-      int base = i * 2;
-      P1[oc][i] = max(L1[oc][base], L1[oc][base + 1]);
+      int base = oc * kInSize + i * 2;
+      P1[oc * kPitch2 + i] = max(L1[base], L1[base + 1]);
     }
   }
 
   // ------------------------
   // Conv2
   // ------------------------
-  static float L2[kChannels2][kSize2];
+#if WINO_M2
+  WinogradConv<kChannels1, kChannels2, kKernel2, kSize2, kPitch2, WINO_M2>(
+      P1, conv2_wino, c2_bias, L2);
+#else
   constexpr int pad2 = kKernel2 / 2;
 
-  // Bank along IC since we unroll IC
-#pragma HLS ARRAY_PARTITION variable=P1 cyclic factor=IC_UNROLL dim=1
-
   for (int oc = 0; oc < kChannels2; ++oc) {
     // Per-OC weight tile
-    static float w2[kChannels1][kKernel2];
-#pragma HLS ARRAY_PARTITION variable=w2 cyclic factor=IC_UNROLL dim=1
-#pragma HLS ARRAY_PARTITION variable=w2 complete dim=2
     for (int ic = 0; ic < kChannels1; ++ic)
       for (int k = 0; k < kKernel2; ++k)
-        w2[ic][k] = conv2_weight(oc, ic, k);
+        wt[ic][k] = conv2_weight(oc, ic, k);
 
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize2; ++x) {
@@ -162,21 +454,22 @@ void CnnKernel(
 #pragma HLS UNROLL factor=K2_UNROLL
         for (int k = 0; k < kKernel2; ++k) {
           int idx = x + k - pad2;
-          float in_val = (idx >= 0 && idx < kSize2) ? P1[ic][idx] : 0.0f;
-          acc += in_val * w2[ic][k];
+          float in_val = (idx >= 0 && idx < kSize2) ? P1[ic * kPitch2 + idx] : 0.0f;
+          acc += in_val * wt[ic][k];
         }
       }
-      L2[oc][x] = acc;
+      L2[oc * kSize2 + x] = acc;
     }
   }
+#endif
 
   // BN2
   for (int oc = 0; oc < kChannels2; ++oc) {
     float inv_sigma = 1.0f / std::sqrt(b2_v[oc] + eps);
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize2; ++x) {
-      float normalized = (L2[oc][x] - b2_m[oc]) * inv_sigma;
-      L2[oc][x] = normalized * b2_w[oc] + b2_b[oc];
+      float normalized = (L2[oc * kSize2 + x] - b2_m[oc]) * inv_sigma;
+      L2[oc * kSize2 + x] = normalized * b2_w[oc] + b2_b[oc];
     }
   }
 
@@ -184,34 +477,31 @@ void CnnKernel(
   for (int oc = 0; oc < kChannels2; ++oc) {
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize2; ++x)
-      L2[oc][x] = max(L2[oc][x], 0.0f);
+      L2[oc * kSize2 + x] = max(L2[oc * kSize2 + x], 0.0f);
   }
 
   // MaxPool2 -> P2
-  static float P2[kChannels2][kSize3];
   for (int oc = 0; oc < kChannels2; ++oc) {
     [[tapa::pipeline(1)]]
     for (int i = 0; i < kSize3; ++i) {
-      int base = i * 2;
-      P2[oc][i] = max(L2[oc][base], L2[oc][base + 1]);
+      int base = oc * kSize2 + i * 2;
+      P2[oc * kPitch3 + i] = max(L2[base], L2[base + 1]);
     }
   }
 
   // ------------------------
   // Conv3
   // ------------------------
-  static float L3[kChannels3][kSize3];
+#if WINO_M3
+  WinogradConv<kChannels2, kChannels3, kKernel3, kSize3, kPitch3, WINO_M3>(
+      P2, conv3_wino, c3_bias, L3);
+#else
   constexpr int pad3 = kKernel3 / 2;
 
-#pragma HLS ARRAY_PARTITION variable=P2 cyclic factor=IC_UNROLL dim=1
-
   for (int oc = 0; oc < kChannels3; ++oc) {
-    static float w3[kChannels2][kKernel3];
-#pragma HLS ARRAY_PARTITION variable=w3 cyclic factor=IC_UNROLL dim=1
-#pragma HLS ARRAY_PARTITION variable=w3 complete dim=2
     for (int ic = 0; ic < kChannels2; ++ic)
       for (int k = 0; k < kKernel3; ++k)
-        w3[ic][k] = conv3_weight(oc, ic, k);   // use macro
+        wt[ic][k] = conv3_weight(oc, ic, k);   // use macro
 
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize3; ++x) {
@@ -221,21 +511,22 @@ void CnnKernel(
 #pragma HLS UNROLL factor=K3_UNROLL
         for (int k = 0; k < kKernel3; ++k) {
           int idx = x + k - pad3;
-          float in_val = (idx >= 0 && idx < kSize3) ? P2[ic][idx] : 0.0f;
-          acc += in_val * w3[ic][k];
+          float in_val = (idx >= 0 && idx < kSize3) ? P2[ic * kPitch3 + idx] : 0.0f;
+          acc += in_val * wt[ic][k];
         }
       }
-      L3[oc][x] = acc;
+      L3[oc * kSize3 + x] = acc;
     }
   }
+#endif
 
   // BN3
   for (int oc = 0; oc < kChannels3; ++oc) {
     float inv_sigma = 1.0f / std::sqrt(b3_v[oc] + eps);
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize3; ++x) {
-      float normalized = (L3[oc][x] - b3_m[oc]) * inv_sigma;
-      L3[oc][x] = normalized * b3_w[oc] + b3_b[oc];
+      float normalized = (L3[oc * kSize3 + x] - b3_m[oc]) * inv_sigma;
+      L3[oc * kSize3 + x] = normalized * b3_w[oc] + b3_b[oc];
     }
   }
 
@@ -243,47 +534,480 @@ void CnnKernel(
   for (int oc = 0; oc < kChannels3; ++oc) {
     [[tapa::pipeline(1)]]
     for (int x = 0; x < kSize3; ++x)
-      L3[oc][x] = max(L3[oc][x], 0.0f);
+      L3[oc * kSize3 + x] = max(L3[oc * kSize3 + x], 0.0f);
   }
 
-  // Flatten
-  static float flat3[LinearSize1];
-#pragma HLS ARRAY_PARTITION variable=flat3 cyclic factor=IC_UNROLL dim=1
-  for (int oc = 0; oc < kChannels3; ++oc) {
-    [[tapa::pipeline(1)]]
-    for (int x = 0; x < kSize3; ++x)
-      flat3[oc * kSize3 + x] = L3[oc][x];
-  }
+  // Flatten: L3 is stored [oc * kSize3 + x] with no padding, so it is flat3
+  const float* flat3 = L3;
 
   // FC1 (640 -> 128) + ReLU
-  static float L4[LinearSize2];
-#pragma HLS ARRAY_PARTITION variable=L4 cyclic factor=IC_UNROLL dim=1
+  // ReLU3 leaves many zeros in flat3, so only active weight columns are read
+  nnz[0] = LinearSkipZeros<LinearSize1, LinearSize2>(
+      flat3, fc1_bias, fc1_weight, fc1_rank, fc1_u, fc1_v, L4);
+
   [[tapa::pipeline(1)]]
-  for (int o = 0; o < LinearSize2; ++o) {
-    float acc = fc1_bias[o];
-#pragma HLS UNROLL factor=IC_UNROLL
-    for (int i = 0; i < LinearSize1; ++i)
-      acc += flat3[i] * fc1_weight(o, i);
-    L4[o] = max(acc, 0.0f);
+  for (int o = 0; o < LinearSize2; ++o) L4[o] = max(L4[o], 0.0f);
+
+  // FC2 (128 -> 1000), same zero-skipping over the ReLU'd L4
+  nnz[1] = LinearSkipZeros<LinearSize2, kOutSize>(
+      L4, fc2_bias, fc2_weight, fc2_rank, fc2_u, fc2_v, L5);
+
+  // RMS normalize while L5 is still on chip: partial sums break the fadd
+  // dependency, then the spectrum is scaled in place and written once
+  constexpr int kPartials = 8;
+  float part[kPartials];
+#pragma HLS ARRAY_PARTITION variable=part complete dim=1
+  for (int p = 0; p < kPartials; ++p) part[p] = 0.f;
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kOutSize; ++i) part[i % kPartials] += L5[i] * L5[i];
+  float ms = 0.f;
+  for (int p = 0; p < kPartials; ++p) ms += part[p];
+  ms /= kOutSize;
+  constexpr float eps2 = 1e-6f;
+  const float inv_rms = 1.0f / std::sqrt(ms + eps2);
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < kOutSize; ++i) L5[i] *= inv_rms;
+
+  WriteOutput(L5, output_mode, num_peaks, output, peaks, output_half);
+  route[0] = kRouteFull;
+}
+// ---------------------------------------------------------------------------
+// Batch kernel with NUM_PE replicated inference PEs.
+//
+// The PEs run in lockstep rounds of one sample each. BatchDispatch deals the
+// samples round-robin and pads the last round with zeros. WeightBroadcast
+// loads the conv / BN parameters and FC biases into every PE once, then each
+// round streams the FC weights to all PEs in the same cycle, so NUM_PE
+// samples share one pass over the weights in DRAM. BatchCollect drains the
+// PEs round-robin, which restores input order. With split < kSplitDevice the
+// PEs stop at that layer boundary and stream its activations out instead;
+// FC weights are only broadcast for the FC layers in front of it.
+// ---------------------------------------------------------------------------
+
+// Boundaries the PEs can stop at. Any other split runs no rounds in every
+// task, so nothing is read or written (RunSplit rejects it on the host).
+static bool DeviceSplit(int split) { return split >= kSplitConv1 && split <= kSplitDevice; }
+
+static int PeRounds(int n, int split) {
+  return DeviceSplit(split) ? (n + NUM_PE - 1) / NUM_PE : 0;
+}
+
+// Whether the stage ending at `boundary` runs on the device; the PEs' early
+// stops and the FC weight broadcast both follow it
+static bool OnDevice(int split, int boundary) {
+  return DeviceSplit(split) && boundary <= split;
+}
+
+// FC weights travel in beats of kPack floats (one wide word per cycle); a
+// round's weights are one packed sequence, padded at the end of the round
+constexpr int kPack = 8;
+struct FloatPack {
+  float v[kPack];
+};
+
+struct PackWriter {
+  FloatPack pack;
+  int fill = 0;
+
+  void Put(tapa::ostreams<FloatPack, NUM_PE>& q, float x) {
+#pragma HLS INLINE
+    pack.v[fill++] = x;
+    if (fill == kPack) Flush(q);
+  }
+  void Flush(tapa::ostreams<FloatPack, NUM_PE>& q) {
+#pragma HLS INLINE
+    if (fill == 0) return;
+    for (int p = 0; p < NUM_PE; ++p) {
+#pragma HLS UNROLL
+      q[p].write(pack);
+    }
+    fill = 0;
+  }
+};
+
+struct PackReader {
+  FloatPack pack;
+  int pos = kPack;
+
+  float Get(tapa::istream<FloatPack>& q) {
+#pragma HLS INLINE
+    if (pos == kPack) {
+      pack = q.read();
+      pos = 0;
+    }
+    return pack.v[pos++];
+  }
+};
+
+void BatchDispatch(int n, int split, tapa::mmap<float> inputs,
+                   tapa::ostreams<float, NUM_PE>& in_q) {
+  for (int r = 0; r < PeRounds(n, split); ++r) {
+    for (int p = 0; p < NUM_PE; ++p) {
+      const int s = r * NUM_PE + p;
+      [[tapa::pipeline(1)]]
+      for (int i = 0; i < kInSize; ++i) in_q[p].write(s < n ? inputs[s * kInSize + i] : 0.f);
+    }
   }
+}
 
-  // FC2 (128 -> 1000)
+// Sends one value to every PE in the same cycle
+static void Broadcast(tapa::ostreams<float, NUM_PE>& q, float v) {
+#pragma HLS INLINE
+  for (int p = 0; p < NUM_PE; ++p) {
+#pragma HLS UNROLL
+    q[p].write(v);
+  }
+}
+
+static void BroadcastArray(tapa::mmap<float> src, int count, tapa::ostreams<float, NUM_PE>& q) {
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < count; ++i) Broadcast(q, src[i]);
+}
+
+static void BroadcastPacked(tapa::mmap<float> src, int count, PackWriter& w,
+                            tapa::ostreams<FloatPack, NUM_PE>& q) {
   [[tapa::pipeline(1)]]
-  for (int o = 0; o < kOutSize; ++o) {
-    float acc = fc2_bias[o];
+  for (int i = 0; i < count; ++i) w.Put(q, src[i]);
+}
+
+// FC layer weights in the order PeLinear consumes them: the dense columns,
+// or V then U of the factorization
+static void BroadcastLinear(int in_size, int out_size, tapa::mmap<float> weight, int rank,
+                            tapa::mmap<float> u, tapa::mmap<float> v, PackWriter& w,
+                            tapa::ostreams<FloatPack, NUM_PE>& q) {
+  if (rank == 0) {
+    BroadcastPacked(weight, in_size * out_size, w, q);
+  } else {
+    BroadcastPacked(v, in_size * rank, w, q);
+    BroadcastPacked(u, rank * out_size, w, q);
+  }
+}
+
+void WeightBroadcast(
+    int n,
+    int split,
+    tapa::mmap<float> conv1_bias,
+    tapa::mmap<float> conv2_bias,
+    tapa::mmap<float> conv3_bias,
+    tapa::mmap<float> conv1_weight,
+    tapa::mmap<float> conv2_weight,
+    tapa::mmap<float> conv3_weight,
+    tapa::mmap<float> bn1_bias,
+    tapa::mmap<float> bn2_bias,
+    tapa::mmap<float> bn3_bias,
+    tapa::mmap<float> bn1_weight,
+    tapa::mmap<float> bn2_weight,
+    tapa::mmap<float> bn3_weight,
+    tapa::mmap<float> bn1_running_mean,
+    tapa::mmap<float> bn2_running_mean,
+    tapa::mmap<float> bn3_running_mean,
+    tapa::mmap<float> bn1_running_var,
+    tapa::mmap<float> bn2_running_var,
+    tapa::mmap<float> bn3_running_var,
+    tapa::mmap<float> fc1_bias,
+    tapa::mmap<float> fc2_bias,
+    tapa::mmap<float> fc1_weight,
+    tapa::mmap<float> fc2_weight,
+    int fc1_rank,
+    tapa::mmap<float> fc1_u,
+    tapa::mmap<float> fc1_v,
+    int fc2_rank,
+    tapa::mmap<float> fc2_u,
+    tapa::mmap<float> fc2_v,
+    tapa::ostreams<float, NUM_PE>& param_q,
+    tapa::ostreams<FloatPack, NUM_PE>& fc_q) {
+  // Once per batch, in the order InferencePE loads them
+  BroadcastArray(conv1_bias, kChannels1, param_q);
+  BroadcastArray(conv1_weight, kChannels1 * kKernel1, param_q);
+  BroadcastArray(bn1_weight, kChannels1, param_q);
+  BroadcastArray(bn1_bias, kChannels1, param_q);
+  BroadcastArray(bn1_running_mean, kChannels1, param_q);
+  BroadcastArray(bn1_running_var, kChannels1, param_q);
+  BroadcastArray(conv2_bias, kChannels2, param_q);
+  BroadcastArray(conv2_weight, kChannels2 * kChannels1 * kKernel2, param_q);
+  BroadcastArray(bn2_weight, kChannels2, param_q);
+  BroadcastArray(bn2_bias, kChannels2, param_q);
+  BroadcastArray(bn2_running_mean, kChannels2, param_q);
+  BroadcastArray(bn2_running_var, kChannels2, param_q);
+  BroadcastArray(conv3_bias, kChannels3, param_q);
+  BroadcastArray(conv3_weight, kChannels3 * kChannels2 * kKernel3, param_q);
+  BroadcastArray(bn3_weight, kChannels3, param_q);
+  BroadcastArray(bn3_bias, kChannels3, param_q);
+  BroadcastArray(bn3_running_mean, kChannels3, param_q);
+  BroadcastArray(bn3_running_var, kChannels3, param_q);
+  BroadcastArray(fc1_bias, LinearSize2, param_q);
+  BroadcastArray(fc2_bias, kOutSize, param_q);
+
+  // FC weights once per round, shared by the NUM_PE samples of the round
+  if (!OnDevice(split, kSplitFc1)) return;
+  for (int r = 0; r < PeRounds(n, split); ++r) {
+    PackWriter w;
+    BroadcastLinear(LinearSize1, LinearSize2, fc1_weight, fc1_rank, fc1_u, fc1_v, w, fc_q);
+    if (OnDevice(split, kSplitDevice))
+      BroadcastLinear(LinearSize2, kOutSize, fc2_weight, fc2_rank, fc2_u, fc2_v, w, fc_q);
+    w.Flush(fc_q);
+  }
+}
+
+// Loads `count` parameters from the broadcast
+static void PeLoad(tapa::istream<float>& q, float* dst, int count) {
+  [[tapa::pipeline(1)]]
+  for (int i = 0; i < count; ++i) dst[i] = q.read();
+}
+
+// Folds BN into a per-channel scale and shift
+static void PeLoadBn(tapa::istream<float>& q, int channels, float* scale, float* shift) {
+  constexpr float eps = 1e-5f;
+  float w[kChannels3], b[kChannels3], m[kChannels3], v[kChannels3];
+  PeLoad(q, w, channels);
+  PeLoad(q, b, channels);
+  PeLoad(q, m, channels);
+  PeLoad(q, v, channels);
+  for (int c = 0; c < channels; ++c) {
+    scale[c] = w[c] / std::sqrt(v[c] + eps);
+    shift[c] = b[c] - m[c] * scale[c];
+  }
+}
+
+// Same-padded conv + folded BN + ReLU; input [ic * kPitchIn + x], output
+// [oc * kLen + x], weights [oc][ic][k] as in the model files
+template <int kIC, int kOC, int kK, int kLen, int kPitchIn>
+static void PeConvBnRelu(const float* in, const float* w, const float* bias,
+                         const float* scale, const float* shift, float* out) {
+  constexpr int pad = kK / 2;
+  for (int oc = 0; oc < kOC; ++oc) {
+    [[tapa::pipeline(1)]]
+    for (int x = 0; x < kLen; ++x) {
+      float acc = bias[oc];
 #pragma HLS UNROLL factor=IC_UNROLL
-    for (int i = 0; i < LinearSize2; ++i)
-      acc += L4[i] * fc2_weight(o, i);
-    output[o] = acc;
+      for (int ic = 0; ic < kIC; ++ic) {
+#pragma HLS UNROLL
+        for (int k = 0; k < kK; ++k) {
+          int idx = x + k - pad;
+          float in_val = (idx >= 0 && idx < kLen) ? in[ic * kPitchIn + idx] : 0.0f;
+          acc += in_val * w[(oc * kIC + ic) * kK + k];
+        }
+      }
+      out[oc * kLen + x] = max(acc * scale[oc] + shift[oc], 0.0f);
+    }
   }
+}
 
-  // RMS normalize
-  float ms = 0.f;
+template <int kC, int kLenIn, int kPitchOut>
+static void PeMaxPool(const float* in, float* out) {
+  for (int c = 0; c < kC; ++c) {
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kLenIn / 2; ++i)
+      out[c * kPitchOut + i] = max(in[c * kLenIn + i * 2], in[c * kLenIn + i * 2 + 1]);
+  }
+}
+
+// Streams kC rows of kLen activations stored at row pitch kPitch
+template <int kC, int kLen, int kPitch>
+static void PeEmit(const float* act, tapa::ostream<float>& out_q) {
+  for (int c = 0; c < kC; ++c) {
+    [[tapa::pipeline(1)]]
+    for (int x = 0; x < kLen; ++x) out_q.write(act[c * kPitch + x]);
+  }
+}
+
+// FC layer fed by the weight broadcast. Every PE consumes the whole stream,
+// so zero inputs cannot skip columns here; they just add nothing.
+template <int kIn, int kOut>
+static void PeLinear(const float in[kIn], const float bias[kOut], int rank,
+                     tapa::istream<FloatPack>& fc_q, PackReader& w, float out[kOut]) {
   [[tapa::pipeline(1)]]
-  for (int i = 0; i < kOutSize; ++i) ms += output[i] * output[i];
-  ms /= kOutSize;
-  constexpr float eps2 = 1e-6f;
-  float rms = std::sqrt(ms + eps2);
+  for (int o = 0; o < kOut; ++o) out[o] = bias[o];
+
+  if (rank == 0) {
+    for (int i = 0; i < kIn; ++i) {
+      const float a = in[i];
+      [[tapa::pipeline(1)]]
+      for (int o = 0; o < kOut; ++o) out[o] += a * w.Get(fc_q);
+    }
+    return;
+  }
+
+  float t[kMaxRank];
   [[tapa::pipeline(1)]]
-  for (int i = 0; i < kOutSize; ++i) output[i] /= rms;
-}
\ No newline at end of file
+  for (int r = 0; r < rank; ++r) t[r] = 0.0f;
+  for (int i = 0; i < kIn; ++i) {
+    const float a = in[i];
+    [[tapa::pipeline(1)]]
+    for (int r = 0; r < rank; ++r) {
+#pragma HLS LOOP_TRIPCOUNT max=kMaxRank
+      t[r] += a * w.Get(fc_q);
+    }
+  }
+  for (int r = 0; r < rank; ++r) {
+#pragma HLS LOOP_TRIPCOUNT max=kMaxRank
+    const float a = t[r];
+    [[tapa::pipeline(1)]]
+    for (int o = 0; o < kOut; ++o) out[o] += a * w.Get(fc_q);
+  }
+}
+
+void InferencePE(
+    int n,
+    int split,
+    int fc1_rank,
+    int fc2_rank,
+    tapa::istream<float>& in_q,
+    tapa::istream<float>& param_q,
+    tapa::istream<FloatPack>& fc_q,
+    tapa::ostream<float>& out_q) {
+  // Per-PE copies of the broadcast parameters
+  float c1_bias[kChannels1], w1[kChannels1 * kKernel1], s1[kChannels1], t1[kChannels1];
+  float c2_bias[kChannels2], w2[kChannels2 * kChannels1 * kKernel2], s2[kChannels2], t2[kChannels2];
+  float c3_bias[kChannels3], w3[kChannels3 * kChannels2 * kKernel3], s3[kChannels3], t3[kChannels3];
+  float fc1_b[LinearSize2], fc2_b[kOutSize];
+#pragma HLS ARRAY_PARTITION variable=w1 cyclic factor=kKernel1 dim=1
+#pragma HLS ARRAY_PARTITION variable=w2 cyclic factor=kKernel2 dim=1
+#pragma HLS ARRAY_PARTITION variable=w3 cyclic factor=kKernel3 dim=1
+  PeLoad(param_q, c1_bias, kChannels1);
+  PeLoad(param_q, w1, kChannels1 * kKernel1);
+  PeLoadBn(param_q, kChannels1, s1, t1);
+  PeLoad(param_q, c2_bias, kChannels2);
+  PeLoad(param_q, w2, kChannels2 * kChannels1 * kKernel2);
+  PeLoadBn(param_q, kChannels2, s2, t2);
+  PeLoad(param_q, c3_bias, kChannels3);
+  PeLoad(param_q, w3, kChannels3 * kChannels2 * kKernel3);
+  PeLoadBn(param_q, kChannels3, s3, t3);
+  PeLoad(param_q, fc1_b, LinearSize2);
+  PeLoad(param_q, fc2_b, kOutSize);
+
+  // Activations follow the same plan as CnnKernel, but per PE
+  float ping[kActPlan.slot_size[0]];
+  float pong[kActPlan.slot_size[1]];
+#pragma HLS ARRAY_PARTITION variable=ping cyclic factor=IC_UNROLL dim=1
+#pragma HLS ARRAY_PARTITION variable=pong cyclic factor=IC_UNROLL dim=1
+  float* const L1 = kActPlan.slot[kActL1] == 0 ? ping : pong;
+  float* const P1 = kActPlan.slot[kActP1] == 0 ? ping : pong;
+  float* const L2 = kActPlan.slot[kActL2] == 0 ? ping : pong;
+  float* const P2 = kActPlan.slot[kActP2] == 0 ? ping : pong;
+  float* const L3 = kActPlan.slot[kActL3] == 0 ? ping : pong;
+  float* const L4 = kActPlan.slot[kActL4] == 0 ? ping : pong;
+  float* const L5 = kActPlan.slot[kActL5] == 0 ? ping : pong;
+
+  for (int r = 0; r < PeRounds(n, split); ++r) {
+    float in0[kInSize];
+    PeLoad(in_q, in0, kInSize);
+
+    PeConvBnRelu<1, kChannels1, kKernel1, kInSize, kInSize>(in0, w1, c1_bias, s1, t1, L1);
+    PeMaxPool<kChannels1, kInSize, kPitch2>(L1, P1);
+    if (!OnDevice(split, kSplitConv2)) {
+      PeEmit<kChannels1, kSize2, kPitch2>(P1, out_q);
+      continue;
+    }
+    PeConvBnRelu<kChannels1, kChannels2, kKernel2, kSize2, kPitch2>(P1, w2, c2_bias, s2, t2, L2);
+    PeMaxPool<kChannels2, kSize2, kPitch3>(L2, P2);
+    if (!OnDevice(split, kSplitConv3)) {
+      PeEmit<kChannels2, kSize3, kPitch3>(P2, out_q);
+      continue;
+    }
+    PeConvBnRelu<kChannels2, kChannels3, kKernel3, kSize3, kPitch3>(P2, w3, c3_bias, s3, t3, L3);
+    if (!OnDevice(split, kSplitFc1)) {
+      PeEmit<1, LinearSize1, LinearSize1>(L3, out_q);
+      continue;
+    }
+
+    PackReader w;
+    PeLinear<LinearSize1, LinearSize2>(L3, fc1_b, fc1_rank, fc_q, w, L4);
+    [[tapa::pipeline(1)]]
+    for (int o = 0; o < LinearSize2; ++o) L4[o] = max(L4[o], 0.0f);
+    if (!OnDevice(split, kSplitDevice)) {
+      PeEmit<1, LinearSize2, LinearSize2>(L4, out_q);
+      continue;
+    }
+    PeLinear<LinearSize2, kOutSize>(L4, fc2_b, fc2_rank, fc_q, w, L5);
+
+    // RMS normalization as in CnnKernel
+    constexpr int kPartials = 8;
+    float part[kPartials];
+#pragma HLS ARRAY_PARTITION variable=part complete dim=1
+    for (int p = 0; p < kPartials; ++p) part[p] = 0.f;
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kOutSize; ++i) part[i % kPartials] += L5[i] * L5[i];
+    float ms = 0.f;
+    for (int p = 0; p < kPartials; ++p) ms += part[p];
+    ms /= kOutSize;
+    constexpr float eps2 = 1e-6f;
+    const float inv_rms = 1.0f / std::sqrt(ms + eps2);
+    [[tapa::pipeline(1)]]
+    for (int i = 0; i < kOutSize; ++i) out_q.write(L5[i] * inv_rms);
+  }
+}
+
+void BatchCollect(int n, int split, tapa::istreams<float, NUM_PE>& out_q,
+                  tapa::mmap<float> outputs) {
+  const int size = kSplitSize[DeviceSplit(split) ? split : kSplitDevice];
+  for (int r = 0; r < PeRounds(n, split); ++r) {
+    for (int p = 0; p < NUM_PE; ++p) {
+      const int s = r * NUM_PE + p;
+      [[tapa::pipeline(1)]]
+      for (int i = 0; i < size; ++i) {
+#pragma HLS LOOP_TRIPCOUNT max=kOutSize
+        const float v = out_q[p].read();
+        if (s < n) outputs[s * size + i] = v;
+      }
+    }
+  }
+}
+
+void CnnBatchKernel(
+    int n,
+    int split,
+    tapa::mmap<float> inputs,
+
+    tapa::mmap<float> conv1_bias,
+    tapa::mmap<float> conv2_bias,
+    tapa::mmap<float> conv3_bias,
+    tapa::mmap<float> conv1_weight,
+    tapa::mmap<float> conv2_weight,
+    tapa::mmap<float> conv3_weight,
+
+    tapa::mmap<float> bn1_bias,
+    tapa::mmap<float> bn2_bias,
+    tapa::mmap<float> bn3_bias,
+    tapa::mmap<float> bn1_weight,
+    tapa::mmap<float> bn2_weight,
+    tapa::mmap<float> bn3_weight,
+    tapa::mmap<float> bn1_running_mean,
+    tapa::mmap<float> bn2_running_mean,
+    tapa::mmap<float> bn3_running_mean,
+    tapa::mmap<float> bn1_running_var,
+    tapa::mmap<float> bn2_running_var,
+    tapa::mmap<float> bn3_running_var,
+
+    tapa::mmap<float> fc1_bias,
+    tapa::mmap<float> fc2_bias,
+    tapa::mmap<float> fc1_weight,
+    tapa::mmap<float> fc2_weight,
+
+    int fc1_rank,
+    tapa::mmap<float> fc1_u,
+    tapa::mmap<float> fc1_v,
+    int fc2_rank,
+    tapa::mmap<float> fc2_u,
+    tapa::mmap<float> fc2_v,
+
+    tapa::mmap<float> outputs) {
+  tapa::streams<float, NUM_PE, 2 * kInSize> in_q("in_q");
+  tapa::streams<float, NUM_PE, 2> param_q("param_q");
+  tapa::streams<FloatPack, NUM_PE, 16> fc_q("fc_q");
+  tapa::streams<float, NUM_PE, kOutSize> out_q("out_q");
+
+  tapa::task()
+      .invoke(BatchDispatch, n, split, inputs, in_q)
+      .invoke(WeightBroadcast, n, split,
+              conv1_bias, conv2_bias, conv3_bias, conv1_weight, conv2_weight, conv3_weight,
+              bn1_bias, bn2_bias, bn3_bias, bn1_weight, bn2_weight, bn3_weight,
+              bn1_running_mean, bn2_running_mean, bn3_running_mean,
+              bn1_running_var, bn2_running_var, bn3_running_var,
+              fc1_bias, fc2_bias, fc1_weight, fc2_weight,
+              fc1_rank, fc1_u, fc1_v, fc2_rank, fc2_u, fc2_v,
+              param_q, fc_q)
+      .invoke<tapa::join, NUM_PE>(InferencePE, n, split, fc1_rank, fc2_rank, in_q, param_q,
+                                  fc_q, out_q)
+      .invoke(BatchCollect, n, split, out_q, outputs);
+}
@@ -1,82 +1,834 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <tapa.h>
 #include "cnn.h"
+#include "perf.h"
 
 using std::clog;
 using std::endl;
 using std::string;
 
+// "same"-padded 1-D convolution, weights laid out [out][in][k] as in PyTorch
+static void Conv1d(const float* in, int in_ch, int size,
+                   const float* weight, const float* bias,
+                   int out_ch, int kernel, float* out) {
+    const int pad = kernel / 2;
+    for (int oc = 0; oc < out_ch; ++oc) {
+        float* y = out + oc * size;
+        for (int x = 0; x < size; ++x) y[x] = bias[oc];
+        for (int ic = 0; ic < in_ch; ++ic) {
+            const float* w = weight + (oc * in_ch + ic) * kernel;
+            const float* v = in + ic * size;
+            for (int k = 0; k < kernel; ++k) {
+                const int lo = pad - k > 0 ? pad - k : 0;
+                const int hi = size + pad - k < size ? size + pad - k : size;
+                for (int x = lo; x < hi; ++x) y[x] += v[x + k - pad] * w[k];
+            }
+        }
+    }
+}
+
+// Float copies of the Winograd transforms, by [tile m][kernel r]
+struct WinogradTables {
+    float bt[kMaxWinoTile + 1][kKernel2 + 1][kMaxWinoAlpha][kMaxWinoAlpha] = {};
+    float at[kMaxWinoTile + 1][kKernel2 + 1][kMaxWinoTile][kMaxWinoAlpha] = {};
+    WinogradTables() {
+        for (int m = 2; m <= kMaxWinoTile; ++m)
+            for (int r : {kKernel3, kKernel2}) {
+                const WinogradTransform w = MakeWinograd(m, r);
+                for (int i = 0; i < w.alpha; ++i)
+                    for (int j = 0; j < w.alpha; ++j) bt[m][r][i][j] = float(w.bt[i][j]);
+                for (int i = 0; i < m; ++i)
+                    for (int j = 0; j < w.alpha; ++j) at[m][r][i][j] = float(w.at[i][j]);
+            }
+    }
+};
+
+static const WinogradTables & Winograd() {
+    static const WinogradTables tables;
+    return tables;
+}
+
+// Conv1d as Winograd F(m, kernel) over tiles of m outputs, with the weights
+// pre-transformed by PrepareWinograd ([out][in][alpha]). Every input tile is
+// transformed once and shared by all output channels; the tail tile reads
+// zeros past the end and drops the outputs beyond size.
+static void WinogradConv1d(const float* in, int in_ch, int size,
+                           const float* wino, const float* bias,
+                           int out_ch, int kernel, int m, float* out) {
+    const WinogradTables & t = Winograd();
+    const auto & bt = t.bt[m][kernel];
+    const auto & at = t.at[m][kernel];
+    const int alpha = m + kernel - 1;
+    const int pad = kernel / 2;
+    const int tiles = (size + m - 1) / m;
+
+    // v[tile][ic][alpha]: transformed input tiles
+    float v[(kSize2 + 1) / 2 * kChannels2 * kMaxWinoAlpha];
+    for (int tile = 0; tile < tiles; ++tile)
+        for (int ic = 0; ic < in_ch; ++ic) {
+            float d[kMaxWinoAlpha];
+            for (int j = 0; j < alpha; ++j) {
+                const int x = tile * m - pad + j;
+                d[j] = x >= 0 && x < size ? in[ic * size + x] : 0.0f;
+            }
+            float* vt = v + (tile * in_ch + ic) * alpha;
+            for (int i = 0; i < alpha; ++i) {
+                float acc = 0;
+                for (int j = 0; j < alpha; ++j) acc += bt[i][j] * d[j];
+                vt[i] = acc;
+            }
+        }
+
+    for (int oc = 0; oc < out_ch; ++oc) {
+        const float* u = wino + oc * in_ch * alpha;
+        float* y = out + oc * size;
+        for (int tile = 0; tile < tiles; ++tile) {
+            const float* vt = v + tile * in_ch * alpha;
+            float acc[kMaxWinoAlpha] = {};
+            for (int k = 0; k < in_ch * alpha; k += alpha)
+                for (int i = 0; i < alpha; ++i) acc[i] += u[k + i] * vt[k + i];
+            for (int x = 0; x < m && tile * m + x < size; ++x) {
+                float sum = bias[oc];
+                for (int i = 0; i < alpha; ++i) sum += at[x][i] * acc[i];
+                y[tile * m + x] = sum;
+            }
+        }
+    }
+}
+
+// Inference-mode batch norm followed by ReLU, in place
+static void BatchNormRelu(float* act, int ch, int size,
+                          const float* gamma, const float* beta,
+                          const float* mean, const float* var) {
+    constexpr float eps = 1e-5f;
+    for (int c = 0; c < ch; ++c) {
+        const float scale = gamma[c] / std::sqrt(var[c] + eps);
+        const float shift = beta[c] - mean[c] * scale;
+        float* y = act + c * size;
+        for (int x = 0; x < size; ++x) y[x] = max(y[x] * scale + shift, 0.0f);
+    }
+}
+
+// Non-overlapping max pool of width 2 (odd tails are dropped like nn.MaxPool1d)
+static void MaxPool2(const float* in, int ch, int in_size, float* out) {
+    const int out_size = in_size / 2;
+    for (int c = 0; c < ch; ++c)
+        for (int i = 0; i < out_size; ++i)
+            out[c * out_size + i] = max(in[c * in_size + 2 * i],
+                                        in[c * in_size + 2 * i + 1]);
+}
+
+// Fully connected layer over column-major weights that only touches the
+// columns of nonzero inputs. With rank > 0 it uses the factors W ~= U * V
+// as two thin GEMVs. Returns the number of nonzero inputs.
+static int SparseLinear(const float* in, int in_size,
+                        const float* weight, const float* bias,
+                        int rank, const float* u, const float* v,
+                        int out_size, float* out) {
+    int active[LinearSize1];
+    int n = 0;
+    for (int i = 0; i < in_size; ++i)
+        if (in[i] != 0.0f) active[n++] = i;
+
+    for (int o = 0; o < out_size; ++o) out[o] = bias[o];
+    if (rank == 0) {
+        for (int j = 0; j < n; ++j) {
+            const float a = in[active[j]];
+            const float* col = weight + active[j] * out_size;
+            for (int o = 0; o < out_size; ++o) out[o] += a * col[o];
+        }
+        return n;
+    }
+
+    float t[kMaxRank] = {};
+    for (int j = 0; j < n; ++j) {
+        const float a = in[active[j]];
+        const float* col = v + active[j] * rank;
+        for (int r = 0; r < rank; ++r) t[r] += a * col[r];
+    }
+    for (int r = 0; r < rank; ++r) {
+        const float* col = u + r * out_size;
+        for (int o = 0; o < out_size; ++o) out[o] += t[r] * col[o];
+    }
+    return n;
+}
+
+struct NoLayerMark {
+    void operator()(int) const {}
+};
+
+CnnWeightView ViewWeights(const CnnModel & m) {
+    CnnWeightView w;
+    w.conv1_bias = m.conv1_bias.data();
+    w.conv2_bias = m.conv2_bias.data();
+    w.conv3_bias = m.conv3_bias.data();
+    w.conv1_weight = m.conv1_weight.data();
+    w.conv2_weight = m.conv2_weight.data();
+    w.conv3_weight = m.conv3_weight.data();
+    w.conv2_tile = m.conv2_tile;
+    w.conv3_tile = m.conv3_tile;
+    w.conv2_wino = m.conv2_wino.data();
+    w.conv3_wino = m.conv3_wino.data();
+    w.bn1_bias = m.bn1_bias.data();
+    w.bn2_bias = m.bn2_bias.data();
+    w.bn3_bias = m.bn3_bias.data();
+    w.bn1_weight = m.bn1_weight.data();
+    w.bn2_weight = m.bn2_weight.data();
+    w.bn3_weight = m.bn3_weight.data();
+    w.bn1_running_mean = m.bn1_running_mean.data();
+    w.bn2_running_mean = m.bn2_running_mean.data();
+    w.bn3_running_mean = m.bn3_running_mean.data();
+    w.bn1_running_var = m.bn1_running_var.data();
+    w.bn2_running_var = m.bn2_running_var.data();
+    w.bn3_running_var = m.bn3_running_var.data();
+    w.fc1_bias = m.fc1_bias.data();
+    w.fc2_bias = m.fc2_bias.data();
+    w.fc1_weight = m.fc1_weight.data();
+    w.fc2_weight = m.fc2_weight.data();
+    w.fc1_rank = m.fc1_rank;
+    w.fc2_rank = m.fc2_rank;
+    w.fc1_u = m.fc1_u.data();
+    w.fc1_v = m.fc1_v.data();
+    w.fc2_u = m.fc2_u.data();
+    w.fc2_v = m.fc2_v.data();
+    return w;
+}
+
+// Conv/BN/ReLU/pool stack up to flat3, which ends up at
+// arena + kActPlan.offset[kActL3]. mark(layer) runs after each conv stage
+// (used by CnnProfileLayers). With from = kSplitConv1 / kSplitConv2, input
+// holds that boundary's activations and the stack resumes there.
+template <typename LayerMark = NoLayerMark>
+static void ConvStack(const float* input, const CnnWeightView & m, float* arena,
+                      LayerMark mark = LayerMark(), int from = kSplitCpu) {
+    float* L1 = arena + kActPlan.offset[kActL1];
+    float* P1 = arena + kActPlan.offset[kActP1];
+    float* L2 = arena + kActPlan.offset[kActL2];
+    float* P2 = arena + kActPlan.offset[kActP2];
+    float* L3 = arena + kActPlan.offset[kActL3];
+
+    if (from == kSplitCpu) {
+        Conv1d(input, 1, kInSize, m.conv1_weight, m.conv1_bias,
+               kChannels1, kKernel1, L1);
+        BatchNormRelu(L1, kChannels1, kInSize, m.bn1_weight, m.bn1_bias,
+                      m.bn1_running_mean, m.bn1_running_var);
+        MaxPool2(L1, kChannels1, kInSize, P1);
+        mark(kProfConv1);
+    }
+
+    const float* p1 = from == kSplitConv1 ? input : P1;
+    if (from <= kSplitConv1) {
+        if (m.conv2_tile)
+            WinogradConv1d(p1, kChannels1, kSize2, m.conv2_wino, m.conv2_bias,
+                           kChannels2, kKernel2, m.conv2_tile, L2);
+        else
+            Conv1d(p1, kChannels1, kSize2, m.conv2_weight, m.conv2_bias,
+                   kChannels2, kKernel2, L2);
+        BatchNormRelu(L2, kChannels2, kSize2, m.bn2_weight, m.bn2_bias,
+                      m.bn2_running_mean, m.bn2_running_var);
+        MaxPool2(L2, kChannels2, kSize2, P2);
+        mark(kProfConv2);
+    }
+
+    const float* p2 = from == kSplitConv2 ? input : P2;
+    if (m.conv3_tile)
+        WinogradConv1d(p2, kChannels2, kSize3, m.conv3_wino, m.conv3_bias,
+                       kChannels3, kKernel3, m.conv3_tile, L3);
+    else
+        Conv1d(p2, kChannels2, kSize3, m.conv3_weight, m.conv3_bias,
+               kChannels3, kKernel3, L3);
+    BatchNormRelu(L3, kChannels3, kSize3, m.bn3_weight, m.bn3_bias,
+                  m.bn3_running_mean, m.bn3_running_var);
+    mark(kProfConv3);
+}
+
+// RMS normalize a spectrum into out (in and out may alias)
+static void RmsNormalize(const float* in, float* out) {
+    float ms = 0.f;
+    for (int i = 0; i < kOutSize; ++i) ms += in[i] * in[i];
+    ms /= kOutSize;
+    constexpr float eps2 = 1e-6f;
+    const float inv_rms = 1.0f / std::sqrt(ms + eps2);
+    for (int i = 0; i < kOutSize; ++i) out[i] = in[i] * inv_rms;
+}
+
 // Sequential CNN implementation
 void CnnSequential(
-    aligned_vector<float> & input,
+    const aligned_vector<float> & input,
+    const CnnModel & m,
+    aligned_vector<float> & output,
+    aligned_vector<int> & nnz) {
+
+    // All intermediates share one arena laid out by kActPlan (cnn.h): about
+    // 4.5 KB, so the whole working set stays in L1
+    alignas(64) float arena[kActPlan.arena_size];
+    float* L3 = arena + kActPlan.offset[kActL3];
+    float* L4 = arena + kActPlan.offset[kActL4];
+    float* L5 = arena + kActPlan.offset[kActL5];
+
+    ConvStack(input.data(), ViewWeights(m), arena);
+
+    // L3 is already laid out [channel][x], i.e. flattened
+    nnz[0] = SparseLinear(L3, LinearSize1, m.fc1_weight.data(), m.fc1_bias.data(),
+                          m.fc1_rank, m.fc1_u.data(), m.fc1_v.data(),
+                          LinearSize2, L4);
+    for (int o = 0; o < LinearSize2; ++o) L4[o] = max(L4[o], 0.0f);
+    nnz[1] = SparseLinear(L4, LinearSize2, m.fc2_weight.data(), m.fc2_bias.data(),
+                          m.fc2_rank, m.fc2_u.data(), m.fc2_v.data(),
+                          kOutSize, L5);
+
+    // written to the caller's buffer in a single pass
+    RmsNormalize(L5, output.data());
+}
+
+// Counter-based dropout mask: a stateless 32-bit mix of (seed, pass, unit), so
+// every mask bit is independent and the mask loops vectorize
+static inline uint32_t MaskHash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Batched FC layer: rows x in_size (row-major) -> rows x out_size, weights
+// column-major as in SparseLinear. Each weight column is read once for the
+// whole batch; zero inputs are skipped per row.
+static void BatchLinear(const float* in, int rows, int in_size,
+                        const float* weight, const float* bias,
+                        int rank, const float* u, const float* v,
+                        int out_size, float* out) {
+    for (int r = 0; r < rows; ++r)
+        for (int o = 0; o < out_size; ++o) out[r * out_size + o] = bias[o];
+
+    if (rank == 0) {
+        for (int i = 0; i < in_size; ++i) {
+            const float* col = weight + i * out_size;
+            for (int r = 0; r < rows; ++r) {
+                const float a = in[r * in_size + i];
+                if (a == 0.0f) continue;
+                float* y = out + r * out_size;
+                for (int o = 0; o < out_size; ++o) y[o] += a * col[o];
+            }
+        }
+        return;
+    }
+
+    aligned_vector<float> t(rows * rank, 0.0f);
+    for (int i = 0; i < in_size; ++i) {
+        const float* col = v + i * rank;
+        for (int r = 0; r < rows; ++r) {
+            const float a = in[r * in_size + i];
+            if (a == 0.0f) continue;
+            for (int k = 0; k < rank; ++k) t[r * rank + k] += a * col[k];
+        }
+    }
+    for (int k = 0; k < rank; ++k) {
+        const float* col = u + k * out_size;
+        for (int r = 0; r < rows; ++r) {
+            const float a = t[r * rank + k];
+            float* y = out + r * out_size;
+            for (int o = 0; o < out_size; ++o) y[o] += a * col[o];
+        }
+    }
+}
 
-    aligned_vector<float> & conv1_bias,
-    aligned_vector<float> & conv2_bias,
-    aligned_vector<float> & conv3_bias,
-    aligned_vector<float> & conv1_weight,
-    aligned_vector<float> & conv2_weight,
-    aligned_vector<float> & conv3_weight,
+void CnnMcDropout(
+    const aligned_vector<float> & input,
+    const CnnModel & m,
+    int samples,
+    float p,
+    uint32_t seed,
+    aligned_vector<float> & mean,
+    aligned_vector<float> & var) {
 
-    aligned_vector<float> & bn1_bias,
-    aligned_vector<float> & bn2_bias,
-    aligned_vector<float> & bn3_bias,
-    aligned_vector<float> & bn1_weight,
-    aligned_vector<float> & bn2_weight,
-    aligned_vector<float> & bn3_weight,
-    aligned_vector<float> & bn1_running_mean,
-    aligned_vector<float> & bn2_running_mean,
-    aligned_vector<float> & bn3_running_mean,
-    aligned_vector<float> & bn1_running_var,
-    aligned_vector<float> & bn2_running_var,
-    aligned_vector<float> & bn3_running_var,
+    // The conv stack is deterministic: run it once
+    alignas(64) float arena[kActPlan.arena_size];
+    ConvStack(input.data(), ViewWeights(m), arena);
+    const float* flat3 = arena + kActPlan.offset[kActL3];
 
-    aligned_vector<float> & fc1_bias,
-    aligned_vector<float> & fc2_bias,
-    aligned_vector<float> & fc1_weight,
-    aligned_vector<float> & fc2_weight,
+    // Inverted dropout as in training: keep with probability 1 - p, scale
+    // survivors by 1 / (1 - p)
+    const uint32_t threshold = uint32_t(std::min(double(p), 1.0) * 4294967295.0);
+    const float keep_scale = p < 1.0f ? 1.0f / (1.0f - p) : 0.0f;
+    auto dropout = [&](float* x, int size, uint32_t layer) {
+        for (int s = 0; s < samples; ++s) {
+            const uint32_t key = seed ^ MaskHash(layer * 0x9e3779b9u + s);
+            float* row = x + s * size;
+            for (int i = 0; i < size; ++i)
+                row[i] = MaskHash(key + i) >= threshold ? row[i] * keep_scale : 0.0f;
+        }
+    };
 
-    aligned_vector<float> & output) {
+    // S masked copies of flat3 -> FC1 -> ReLU -> mask -> FC2, each FC as one
+    // batched GEMM over the S passes
+    aligned_vector<float> x(samples * LinearSize1);
+    aligned_vector<float> h(samples * LinearSize2);
+    aligned_vector<float> y(samples * kOutSize);
+    for (int s = 0; s < samples; ++s)
+        memcpy(&x[s * LinearSize1], flat3, LinearSize1 * sizeof(float));
+    dropout(x.data(), LinearSize1, 1);
 
-    //TODO
-    for (int i = 0; i < 1000; ++i) { output[i] = 0; } //TEMPORARY
+    BatchLinear(x.data(), samples, LinearSize1, m.fc1_weight.data(), m.fc1_bias.data(),
+                m.fc1_rank, m.fc1_u.data(), m.fc1_v.data(), LinearSize2, h.data());
+    for (float & a : h) a = max(a, 0.0f);
+    dropout(h.data(), LinearSize2, 2);
 
+    BatchLinear(h.data(), samples, LinearSize2, m.fc2_weight.data(), m.fc2_bias.data(),
+                m.fc2_rank, m.fc2_u.data(), m.fc2_v.data(), kOutSize, y.data());
+
+    // Mean and variance over the passes of the normalized spectra
+    for (int s = 0; s < samples; ++s) RmsNormalize(&y[s * kOutSize], &y[s * kOutSize]);
+    for (int o = 0; o < kOutSize; ++o) mean[o] = 0.0f;
+    for (int s = 0; s < samples; ++s)
+        for (int o = 0; o < kOutSize; ++o) mean[o] += y[s * kOutSize + o];
+    for (int o = 0; o < kOutSize; ++o) mean[o] /= samples;
+    for (int o = 0; o < kOutSize; ++o) var[o] = 0.0f;
+    for (int s = 0; s < samples; ++s)
+        for (int o = 0; o < kOutSize; ++o) {
+            const float d = y[s * kOutSize + o] - mean[o];
+            var[o] += d * d;
+        }
+    for (int o = 0; o < kOutSize; ++o) var[o] /= samples;
 }
 
-void LoadData(
-    const string& data_dir, 
-    aligned_vector<float> & input,
+// Dense FC layer that keeps kTile outputs in registers and streams the
+// matching slice of every weight column; no zero tests in the inner loop
+template <int kTile>
+static void TiledLinear(const float* in, int in_size,
+                        const float* weight, const float* bias,
+                        int out_size, float* out) {
+    int o0 = 0;
+    for (; o0 + kTile <= out_size; o0 += kTile) {
+        float acc[kTile];
+        for (int t = 0; t < kTile; ++t) acc[t] = bias[o0 + t];
+        for (int i = 0; i < in_size; ++i) {
+            const float a = in[i];
+            const float* w = weight + i * out_size + o0;
+            for (int t = 0; t < kTile; ++t) acc[t] += a * w[t];
+        }
+        for (int t = 0; t < kTile; ++t) out[o0 + t] = acc[t];
+    }
+    for (int o = o0; o < out_size; ++o) {
+        float acc = bias[o];
+        for (int i = 0; i < in_size; ++i) acc += in[i] * weight[i * out_size + o];
+        out[o] = acc;
+    }
+}
+
+// One FC layer over a block of rows with the given variant. Factored layers
+// always take the low-rank path of SparseLinear / BatchLinear.
+static void FcBlock(int variant, int tile,
+                    const float* in, int rows, int in_size,
+                    const float* weight, const float* bias,
+                    int rank, const float* u, const float* v,
+                    int out_size, float* out) {
+    if (variant == kFcBatched) {
+        BatchLinear(in, rows, in_size, weight, bias, rank, u, v, out_size, out);
+        return;
+    }
+    for (int r = 0; r < rows; ++r) {
+        const float* x = in + r * in_size;
+        float* y = out + r * out_size;
+        if (variant == kFcSkipZeros || rank > 0) {
+            SparseLinear(x, in_size, weight, bias, rank, u, v, out_size, y);
+        } else {
+            switch (tile) {
+                case 8:  TiledLinear<8>(x, in_size, weight, bias, out_size, y);  break;
+                case 16: TiledLinear<16>(x, in_size, weight, bias, out_size, y); break;
+                case 64: TiledLinear<64>(x, in_size, weight, bias, out_size, y); break;
+                default: TiledLinear<32>(x, in_size, weight, bias, out_size, y); break;
+            }
+        }
+    }
+}
 
-    aligned_vector<float> & conv1_bias,
-    aligned_vector<float> & conv2_bias,
-    aligned_vector<float> & conv3_bias,
-    aligned_vector<float> & conv1_weight,
-    aligned_vector<float> & conv2_weight,
-    aligned_vector<float> & conv3_weight,
-
-    aligned_vector<float> & bn1_bias,
-    aligned_vector<float> & bn2_bias,
-    aligned_vector<float> & bn3_bias,
-    aligned_vector<float> & bn1_weight,
-    aligned_vector<float> & bn2_weight,
-    aligned_vector<float> & bn3_weight,
-    aligned_vector<float> & bn1_running_mean,
-    aligned_vector<float> & bn2_running_mean,
-    aligned_vector<float> & bn3_running_mean,
-    aligned_vector<float> & bn1_running_var,
-    aligned_vector<float> & bn2_running_var,
-    aligned_vector<float> & bn3_running_var,
-
-    aligned_vector<float> & fc1_bias,
-    aligned_vector<float> & fc2_bias,
-    aligned_vector<float> & fc1_weight,
-    aligned_vector<float> & fc2_weight) {
+static void Fc1Block(const CnnWeightView & w, int variant, int tile,
+                     const float* in, int rows, float* out) {
+    FcBlock(variant, tile, in, rows, LinearSize1, w.fc1_weight, w.fc1_bias,
+            w.fc1_rank, w.fc1_u, w.fc1_v, LinearSize2, out);
+}
 
-    // File names
-    const char* kInputFile           = "/input.bin";
+static void Fc2Block(const CnnWeightView & w, int variant, int tile,
+                     const float* in, int rows, float* out) {
+    FcBlock(variant, tile, in, rows, LinearSize2, w.fc2_weight, w.fc2_bias,
+            w.fc2_rank, w.fc2_u, w.fc2_v, kOutSize, out);
+}
+
+void CnnFc1Block(const CnnModel & m, int variant, int tile,
+                 const float* in, int rows, float* out) {
+    Fc1Block(ViewWeights(m), variant, tile, in, rows, out);
+}
+
+void CnnFc2Block(const CnnModel & m, int variant, int tile,
+                 const float* in, int rows, float* out) {
+    Fc2Block(ViewWeights(m), variant, tile, in, rows, out);
+}
+
+void CnnProfileLayers(const float* inputs, int n, const CnnModel & m,
+                      const PerfCounters & counters, LayerProfile & profile) {
+    alignas(64) float arena[kActPlan.arena_size];
+    float* L3 = arena + kActPlan.offset[kActL3];
+    float* L4 = arena + kActPlan.offset[kActL4];
+    float* L5 = arena + kActPlan.offset[kActL5];
+    const CnnWeightView w = ViewWeights(m);
+
+    // Each boundary costs one read() per counter; at ~100 us per sample the
+    // skew this adds to the per-layer numbers is small
+    for (int s = 0; s < n; ++s) {
+        PerfReading last = counters.Read();
+        auto mark = [&](int layer) {
+            PerfReading now = counters.Read();
+            profile.layer[layer] += now - last;
+            last = now;
+        };
+        ConvStack(inputs + s * kInSize, w, arena, mark);
+        SparseLinear(L3, LinearSize1, m.fc1_weight.data(), m.fc1_bias.data(),
+                     m.fc1_rank, m.fc1_u.data(), m.fc1_v.data(), LinearSize2, L4);
+        for (int o = 0; o < LinearSize2; ++o) L4[o] = max(L4[o], 0.0f);
+        mark(kProfFc1);
+        SparseLinear(L4, LinearSize2, m.fc2_weight.data(), m.fc2_bias.data(),
+                     m.fc2_rank, m.fc2_u.data(), m.fc2_v.data(), kOutSize, L5);
+        mark(kProfFc2);
+        RmsNormalize(L5, L5);
+        mark(kProfRms);
+        ++profile.samples;
+    }
+}
+
+// n activations at boundary from (kSplitCpu..kSplitConv2) -> n flat3
+static void ConvFlatFrom(const float* acts, int n, int from, const CnnWeightView & m,
+                         float* flat3) {
+    alignas(64) float arena[kActPlan.arena_size];
+    for (int r = 0; r < n; ++r) {
+        ConvStack(acts + size_t(r) * kSplitSize[from], m, arena, NoLayerMark(), from);
+        memcpy(flat3 + r * LinearSize1, arena + kActPlan.offset[kActL3],
+               LinearSize1 * sizeof(float));
+    }
+}
+
+void CnnConvFlat(const float* inputs, int n, const CnnModel & m, float* flat3) {
+    ConvFlatFrom(inputs, n, kSplitCpu, ViewWeights(m), flat3);
+}
+
+// Raw frames -> model inputs. Every loop is unit-stride over pixels or bins
+// so the compiler vectorizes it; the binning sums pixel j of all bins at once
+// instead of walking each bin's kRawBin pixels.
+void CnnPreprocess(const uint16_t* frames, int n, const CnnModel & m, float* inputs) {
+    const float* dark = m.calib_dark.data();
+    const float* gain = m.calib_gain.data();
+    const float* scale = m.calib_scale.data();
+    const float* shift = m.calib_shift.data();
+    float corrected[kRawSize];
+    float bins[kInSize];
+    for (int s = 0; s < n; ++s) {
+        const uint16_t* raw = frames + size_t(s) * kRawSize;
+        for (int p = 0; p < kRawSize; ++p)
+            corrected[p] = (float(raw[p]) - dark[p]) * gain[p];
+        for (int i = 0; i < kInSize; ++i) bins[i] = 0.0f;
+        for (int j = 0; j < kRawBin; ++j)
+            for (int i = 0; i < kInSize; ++i) bins[i] += corrected[i * kRawBin + j];
+        float total = 0.0f;
+        for (int i = 0; i < kInSize; ++i) total += bins[i];
+        const float inv = total > 0.0f ? 1.0f / total : 0.0f;
+        float* x = inputs + size_t(s) * kInSize;
+        for (int i = 0; i < kInSize; ++i) x[i] = bins[i] * inv * scale[i] + shift[i];
+    }
+}
+
+// Workers pull blocks of samples: conv stack per sample, then both FC layers
+// over the whole block so weight columns are reused across it. stage(first,
+// rows, scratch) returns the block's kInSize inputs, or its activations at
+// boundary `from` (kSplitCpu..kSplitFc1) for the back half of a split batch.
+template <typename InputStage>
+static void RunBatch(int n, const CnnWeightView & m, const CpuConfig & cfg, float* outputs,
+                     InputStage stage, int from = kSplitCpu) {
+    const int block = max(cfg.batch_block, 1);
+    const int num_blocks = (n + block - 1) / block;
+    std::atomic<int> next_block(0);
+
+    auto worker = [&]() {
+        aligned_vector<float> in(block * kInSize);
+        aligned_vector<float> x(block * LinearSize1);
+        aligned_vector<float> h(block * LinearSize2);
+        for (int b = next_block++; b < num_blocks; b = next_block++) {
+            const int first = b * block;
+            const int rows = std::min(block, n - first);
+            const float* act = stage(first, rows, in.data());
+            const float* x3 = act;
+            if (from < kSplitConv3) {
+                ConvFlatFrom(act, rows, from, m, x.data());
+                x3 = x.data();
+            }
+            const float* h1 = act;
+            if (from < kSplitFc1) {
+                Fc1Block(m, cfg.fc1_variant, cfg.fc1_tile, x3, rows, h.data());
+                for (int i = 0; i < rows * LinearSize2; ++i) h[i] = max(h[i], 0.0f);
+                h1 = h.data();
+            }
+            float* y = outputs + size_t(first) * kOutSize;
+            Fc2Block(m, cfg.fc2_variant, cfg.fc2_tile, h1, rows, y);
+            for (int r = 0; r < rows; ++r) RmsNormalize(y + r * kOutSize, y + r * kOutSize);
+        }
+    };
+
+    const int threads = std::min(max(cfg.threads, 1), max(num_blocks, 1));
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto & t : pool) t.join();
+}
+
+void CnnBatch(
+    const float* inputs,
+    int n,
+    const CnnModel & m,
+    const CpuConfig & cfg,
+    float* outputs) {
+    CnnBatch(inputs, n, ViewWeights(m), cfg, outputs);
+}
 
+void CnnBatch(
+    const float* inputs,
+    int n,
+    const CnnWeightView & w,
+    const CpuConfig & cfg,
+    float* outputs) {
+    RunBatch(n, w, cfg, outputs, [&](int first, int, float*) {
+        return inputs + size_t(first) * kInSize;
+    });
+}
+
+void CnnBatchRaw(
+    const uint16_t* frames,
+    int n,
+    const CnnModel & m,
+    const CpuConfig & cfg,
+    float* outputs) {
+    RunBatch(n, ViewWeights(m), cfg, outputs, [&](int first, int rows, float* scratch) {
+        CnnPreprocess(frames + size_t(first) * kRawSize, rows, m, scratch);
+        return static_cast<const float*>(scratch);
+    });
+}
+
+const char* const kRouteNames[kNumRoutes] = {"full", "empty", "saturated", "low-signal", "gate"};
+
+int CnnScreen(const float* x, const float* p) {
+    if (p[kScreenEnabled] == 0.0f) return kRouteFull;
+    float peak = x[0], peak_abs = 0.0f, sum = 0.0f;
+    int saturated = 0;
+    for (int i = 0; i < kInSize; ++i) {
+        peak = max(peak, x[i]);
+        peak_abs = max(peak_abs, std::fabs(x[i]));
+        sum += x[i];
+        saturated += x[i] >= p[kScreenSaturationLevel];
+    }
+    if (p[kScreenEmptyLevel] >= 0.0f && peak_abs <= p[kScreenEmptyLevel]) return kRouteEmpty;
+    if (p[kScreenSaturationLevel] >= 0.0f && saturated >= int(p[kScreenSaturationCount]))
+        return kRouteSaturated;
+    if (p[kScreenSignalThreshold] >= 0.0f && peak - sum / kInSize < p[kScreenSignalThreshold])
+        return kRouteLowSignal;
+    if (p[kScreenUseGate] != 0.0f) {
+        float score = p[kScreenGateB2];
+        for (int h = 0; h < kGateHidden; ++h) {
+            const float* w = p + kScreenGateW1 + h * kInSize;
+            float acc = p[kScreenGateB1 + h];
+            for (int i = 0; i < kInSize; ++i) acc += w[i] * x[i];
+            score += p[kScreenGateW2 + h] * max(acc, 0.0f);
+        }
+        if (score < p[kScreenGateThreshold]) return kRouteGate;
+    }
+    return kRouteFull;
+}
+
+bool PrepareScreen(const CnnModel & m, const ScreenConfig & cfg,
+                   ScreenTables & t, string* error) {
+    if (cfg.fast_mode != kFastFlag && cfg.fast_mode != kFastTemplate) {
+        *error = "Unknown fast path mode " + std::to_string(cfg.fast_mode);
+        return false;
+    }
+    if (cfg.use_gate && !m.has_gate) {
+        *error = "Gate requested but the model has no gate_*.bin";
+        return false;
+    }
+    if (cfg.saturation_count < 1 || cfg.saturation_count > kInSize) {
+        *error = "Saturation count must be 1.." + std::to_string(kInSize);
+        return false;
+    }
+    float* p = t.params.data();
+    std::fill(t.params.begin(), t.params.end(), 0.0f);
+    p[kScreenEnabled] = cfg.enabled;
+    p[kScreenFastMode] = cfg.fast_mode;
+    p[kScreenEmptyLevel] = cfg.empty_level;
+    p[kScreenSaturationLevel] = cfg.saturation_level;
+    p[kScreenSaturationCount] = cfg.saturation_count;
+    p[kScreenSignalThreshold] = cfg.signal_threshold;
+    p[kScreenUseGate] = cfg.use_gate;
+    p[kScreenGateThreshold] = cfg.gate_threshold;
+    if (m.has_gate) {
+        std::copy(m.gate_w1.begin(), m.gate_w1.end(), p + kScreenGateW1);
+        std::copy(m.gate_b1.begin(), m.gate_b1.end(), p + kScreenGateB1);
+        std::copy(m.gate_w2.begin(), m.gate_w2.end(), p + kScreenGateW2);
+        p[kScreenGateB2] = m.gate_b2[0];
+    }
+
+    // Templates are only read in kFastTemplate mode but cheap to keep current
+    std::fill(t.templates.begin(), t.templates.end(), 0.0f);
+    aligned_vector<float> frame(kInSize), out(kOutSize);
+    aligned_vector<int> nnz(kNnzStats);
+    for (int r = kRouteEmpty; r < kNumRoutes; ++r) {
+        const float level = r == kRouteEmpty ? 0.0f
+                          : r == kRouteSaturated ? max(cfg.saturation_level, 0.0f)
+                          : 1.0f / kInSize;
+        std::fill(frame.begin(), frame.end(), level);
+        CnnSequential(frame, m, out, nnz);
+        std::copy(out.begin(), out.end(), t.templates.begin() + r * kOutSize);
+    }
+    return true;
+}
+
+void CnnBatchScreened(
+    const float* inputs,
+    int n,
+    const CnnModel & m,
+    const CpuConfig & cfg,
+    const ScreenTables & screen,
+    float* outputs,
+    int* routes,
+    ScreenStats* stats) {
+    const float* p = screen.params.data();
+    const bool flag_only = int(p[kScreenFastMode]) == kFastFlag;
+
+    // Survivors are gathered into one dense batch so the FC blocks stay full
+    std::vector<int> full;
+    full.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        const int r = CnnScreen(inputs + size_t(i) * kInSize, p);
+        if (routes) routes[i] = r;
+        if (stats) ++stats->count[r];
+        float* y = outputs + size_t(i) * kOutSize;
+        if (r == kRouteFull)
+            full.push_back(i);
+        else if (flag_only)
+            std::fill(y, y + kOutSize, 0.0f);
+        else
+            std::copy(screen.templates.begin() + r * kOutSize,
+                      screen.templates.begin() + (r + 1) * kOutSize, y);
+    }
+    if (full.empty()) return;
+    if (int(full.size()) == n) {
+        CnnBatch(inputs, n, m, cfg, outputs);
+        return;
+    }
+
+    aligned_vector<float> in(full.size() * kInSize), out(full.size() * kOutSize);
+    for (size_t j = 0; j < full.size(); ++j)
+        std::copy(inputs + size_t(full[j]) * kInSize, inputs + size_t(full[j] + 1) * kInSize,
+                  in.begin() + j * kInSize);
+    CnnBatch(in.data(), int(full.size()), m, cfg, out.data());
+    for (size_t j = 0; j < full.size(); ++j)
+        std::copy(out.begin() + j * kOutSize, out.begin() + (j + 1) * kOutSize,
+                  outputs + size_t(full[j]) * kOutSize);
+}
+
+const char* const kSplitNames[kNumSplits] = {
+    "all-cpu", "conv1", "conv2", "conv3", "fc1", "all-device"};
+
+void CnnFinishBatch(
+    const float* acts,
+    int n,
+    int split,
+    const CnnModel & m,
+    const CpuConfig & cfg,
+    float* outputs) {
+    if (split == kSplitDevice) {
+        memcpy(outputs, acts, size_t(n) * kOutSize * sizeof(float));
+        return;
+    }
+    RunBatch(n, ViewWeights(m), cfg, outputs, [&](int first, int, float*) {
+        return acts + size_t(first) * kSplitSize[split];
+    }, split);
+}
+
+uint64_t ModelHash(const CnnModel & m) {
+    // FNV-1a over every parameter array and the factorization ranks
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&](const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; ++i) hash = (hash ^ p[i]) * 1099511628211ull;
+    };
+    for (const aligned_vector<float>* v : {
+             &m.conv1_bias, &m.conv2_bias, &m.conv3_bias,
+             &m.conv1_weight, &m.conv2_weight, &m.conv3_weight,
+             &m.bn1_bias, &m.bn2_bias, &m.bn3_bias,
+             &m.bn1_weight, &m.bn2_weight, &m.bn3_weight,
+             &m.bn1_running_mean, &m.bn2_running_mean, &m.bn3_running_mean,
+             &m.bn1_running_var, &m.bn2_running_var, &m.bn3_running_var,
+             &m.fc1_bias, &m.fc2_bias, &m.fc1_weight, &m.fc2_weight,
+             &m.fc1_u, &m.fc1_v, &m.fc2_u, &m.fc2_v})
+        mix(v->data(), v->size() * sizeof(float));
+    mix(&m.fc1_rank, sizeof(m.fc1_rank));
+    mix(&m.fc2_rank, sizeof(m.fc2_rank));
+    if (m.has_calib) {
+        for (const aligned_vector<float>* v : {
+                 &m.calib_dark, &m.calib_gain, &m.calib_scale, &m.calib_shift})
+            mix(v->data(), v->size() * sizeof(float));
+    }
+    if (m.has_gate) {
+        for (const aligned_vector<float>* v : {&m.gate_w1, &m.gate_b1, &m.gate_w2, &m.gate_b2})
+            mix(v->data(), v->size() * sizeof(float));
+    }
+    // Winograd changes rounding, so results of different tilings don't mix
+    if (m.conv2_tile || m.conv3_tile) {
+        mix(&m.conv2_tile, sizeof(m.conv2_tile));
+        mix(&m.conv3_tile, sizeof(m.conv3_tile));
+    }
+    return hash;
+}
+
+// mmap a raw binary file and copy its first `nbytes` bytes
+static bool ReadBin(const string& path, void* dst, size_t nbytes, string* error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        *error = "Cannot find " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < nbytes) {
+        *error = path + " is too small";
+        close(fd);
+        return false;
+    }
+    void* src = mmap(nullptr, nbytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (src == MAP_FAILED) {
+        *error = "Failed to mmap " + path;
+        close(fd);
+        return false;
+    }
+    memcpy(dst, src, nbytes);
+    munmap(src, nbytes);
+    close(fd);
+    return true;
+}
+
+bool LoadModel(
+    const string& data_dir,
+    CnnModel & m,
+    string* error) {
+
+    // File names
     const char* kConv1BiasFile       = "/conv1_bias.bin";
     const char* kConv1WeightFile     = "/conv1_weight.bin";
     const char* kConv2BiasFile       = "/conv2_bias.bin";
@@ -102,58 +854,217 @@ void LoadData(
     const char* kFC2BiasFile         = "/fc2_bias.bin";
     const char* kFC2WeightFile       = "/fc2_weight.bin";
 
-    // Helper lambda to open & mmap, then memcpy & cleanup
+    // Optional low-rank factors (pth_to_bin.py --fc1-rank / --fc2-rank)
+    const char* kFC1UFile            = "/fc1_u.bin";
+    const char* kFC1VFile            = "/fc1_v.bin";
+    const char* kFC2UFile            = "/fc2_u.bin";
+    const char* kFC2VFile            = "/fc2_v.bin";
+
+    // Optional detector calibration for raw frames (scripts/calib_to_bin.py)
+    const char* kCalibDarkFile       = "/calib_dark.bin";
+    const char* kCalibGainFile       = "/calib_gain.bin";
+    const char* kCalibScaleFile      = "/calib_scale.bin";
+    const char* kCalibShiftFile      = "/calib_shift.bin";
+
+    // Optional pre-screen gating model (scripts/gate_to_bin.py)
+    const char* kGateW1File          = "/gate_w1.bin";
+    const char* kGateB1File          = "/gate_b1.bin";
+    const char* kGateW2File          = "/gate_w2.bin";
+    const char* kGateB2File          = "/gate_b2.bin";
+
+    // Loads stop at the first failure, which is reported through *error
+    bool ok = true;
     auto load_bin = [&](const char* fname, float* dst, size_t count) {
-        string path = data_dir + fname;
-        int fd = open(path.c_str(), O_RDONLY);
-        if (fd == -1) {
-            clog << "Cannot find " << path << "\n";
-            exit(EXIT_FAILURE);
-        }
-        size_t nbytes = count * sizeof(float);
-        float* src = reinterpret_cast<float*>(
-            mmap(nullptr, nbytes, PROT_READ, MAP_SHARED, fd, 0));
-        if (src == MAP_FAILED) {
-            clog << "Failed to mmap " << path << "\n";
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
-        memcpy(dst, src, nbytes);
-        munmap(src, nbytes);
-        close(fd);
+        if (ok) ok = ReadBin(data_dir + fname, dst, count * sizeof(float), error);
+    };
+
+    // PyTorch stores Linear weights row-major [out][in]; the engines read them
+    // column-major (see cnn.h)
+    auto to_col_major = [](aligned_vector<float> & w, int rows, int cols) {
+        aligned_vector<float> t(w.size());
+        for (int r = 0; r < rows; ++r)
+            for (int c = 0; c < cols; ++c)
+                t[c * rows + r] = w[r * cols + c];
+        w.swap(t);
+    };
+
+    // Number of floats in an optional file, 0 if it does not exist
+    auto bin_count = [&](const char* fname) -> size_t {
+        struct stat st;
+        if (stat((data_dir + fname).c_str(), &st) != 0) return 0;
+        return st.st_size / sizeof(float);
     };
 
     // Load all arrays
-    load_bin(kInputFile,       input.data(),           kInSize);
+    load_bin(kConv1BiasFile,   m.conv1_bias.data(),    kChannels1);
+    load_bin(kConv1WeightFile, m.conv1_weight.data(),  kChannels1 * kKernel1);
+    load_bin(kConv2BiasFile,   m.conv2_bias.data(),    kChannels2);
+    load_bin(kConv2WeightFile, m.conv2_weight.data(),  kChannels2 * kChannels1 * kKernel2);
+    load_bin(kConv3BiasFile,   m.conv3_bias.data(),    kChannels3);
+    load_bin(kConv3WeightFile, m.conv3_weight.data(),  kChannels3 * kChannels2 * kKernel3);
+
+    load_bin(kBN1BiasFile,     m.bn1_bias.data(),      kChannels1);
+    load_bin(kBN1WeightFile,   m.bn1_weight.data(),    kChannels1);
+    load_bin(kBN1MeanFile,     m.bn1_running_mean.data(),kChannels1);
+    load_bin(kBN1VarFile,      m.bn1_running_var.data(), kChannels1);
 
-    load_bin(kConv1BiasFile,   conv1_bias.data(),      kChannels1);
-    load_bin(kConv1WeightFile, conv1_weight.data(),    kChannels1 * kKernel1);
-    load_bin(kConv2BiasFile,   conv2_bias.data(),      kChannels2);
-    load_bin(kConv2WeightFile, conv2_weight.data(),    kChannels2 * kChannels1 * kKernel2);
-    load_bin(kConv3BiasFile,   conv3_bias.data(),      kChannels3);
-    load_bin(kConv3WeightFile, conv3_weight.data(),    kChannels3 * kChannels2 * kKernel3);
+    load_bin(kBN2BiasFile,     m.bn2_bias.data(),      kChannels2);
+    load_bin(kBN2WeightFile,   m.bn2_weight.data(),    kChannels2);
+    load_bin(kBN2MeanFile,     m.bn2_running_mean.data(),kChannels2);
+    load_bin(kBN2VarFile,      m.bn2_running_var.data(), kChannels2);
 
-    load_bin(kBN1BiasFile,     bn1_bias.data(),        kChannels1);
-    load_bin(kBN1WeightFile,   bn1_weight.data(),      kChannels1);
-    load_bin(kBN1MeanFile,     bn1_running_mean.data(),kChannels1);
-    load_bin(kBN1VarFile,      bn1_running_var.data(), kChannels1);
+    load_bin(kBN3BiasFile,     m.bn3_bias.data(),      kChannels3);
+    load_bin(kBN3WeightFile,   m.bn3_weight.data(),    kChannels3);
+    load_bin(kBN3MeanFile,     m.bn3_running_mean.data(),kChannels3);
+    load_bin(kBN3VarFile,      m.bn3_running_var.data(), kChannels3);
 
-    load_bin(kBN2BiasFile,     bn2_bias.data(),        kChannels2);
-    load_bin(kBN2WeightFile,   bn2_weight.data(),      kChannels2);
-    load_bin(kBN2MeanFile,     bn2_running_mean.data(),kChannels2);
-    load_bin(kBN2VarFile,      bn2_running_var.data(), kChannels2);
+    load_bin(kFC1BiasFile,     m.fc1_bias.data(),      LinearSize2);
+    load_bin(kFC1WeightFile,   m.fc1_weight.data(),    LinearSize2 * LinearSize1);
+    load_bin(kFC2BiasFile,     m.fc2_bias.data(),      kOutSize);
+    load_bin(kFC2WeightFile,   m.fc2_weight.data(),    kOutSize * LinearSize2);
 
-    load_bin(kBN3BiasFile,     bn3_bias.data(),        kChannels3);
-    load_bin(kBN3WeightFile,   bn3_weight.data(),      kChannels3);
-    load_bin(kBN3MeanFile,     bn3_running_mean.data(),kChannels3);
-    load_bin(kBN3VarFile,      bn3_running_var.data(), kChannels3);
+    if (!ok) return false;
+    to_col_major(m.fc1_weight, LinearSize2, LinearSize1);
+    to_col_major(m.fc2_weight, kOutSize, LinearSize2);
 
-    load_bin(kFC1BiasFile,     fc1_bias.data(),        LinearSize2);
-    load_bin(kFC1WeightFile,   fc1_weight.data(),      LinearSize2 * LinearSize1);
-    load_bin(kFC2BiasFile,     fc2_bias.data(),        kOutSize);
-    load_bin(kFC2WeightFile,   fc2_weight.data(),      kOutSize * LinearSize2);
+    // U is stored [out][rank] and V [rank][in], so the rank follows from V
+    auto load_factors = [&](const char* u_file, const char* v_file,
+                            int out_size, int in_size, int & rank,
+                            aligned_vector<float> & u, aligned_vector<float> & v) {
+        rank = 0;
+        const size_t v_count = bin_count(v_file);
+        if (!ok || v_count == 0) return;
+        if (v_count % in_size != 0 || v_count / in_size > kMaxRank ||
+            bin_count(u_file) != v_count / in_size * out_size) {
+            *error = "Bad low-rank factors " + data_dir + u_file + ", " + data_dir +
+                     v_file + " (max rank " + std::to_string(kMaxRank) + ")";
+            ok = false;
+            return;
+        }
+        rank = v_count / in_size;
+        u.resize(out_size * rank);
+        v.resize(rank * in_size);
+        load_bin(u_file, u.data(), u.size());
+        load_bin(v_file, v.data(), v.size());
+        if (!ok) return;
+        to_col_major(u, out_size, rank);
+        to_col_major(v, rank, in_size);
+    };
+    load_factors(kFC1UFile, kFC1VFile, LinearSize2, LinearSize1, m.fc1_rank, m.fc1_u, m.fc1_v);
+    load_factors(kFC2UFile, kFC2VFile, kOutSize, LinearSize2, m.fc2_rank, m.fc2_u, m.fc2_v);
+
+    // Calibration comes as a complete set or not at all
+    m.has_calib = false;
+    if (ok && bin_count(kCalibDarkFile) != 0) {
+        if (bin_count(kCalibDarkFile) != size_t(kRawSize) ||
+            bin_count(kCalibGainFile) != size_t(kRawSize) ||
+            bin_count(kCalibScaleFile) != size_t(kInSize) ||
+            bin_count(kCalibShiftFile) != size_t(kInSize)) {
+            *error = "Bad detector calibration in " + data_dir + " (expected " +
+                     std::to_string(kRawSize) + " dark/gain and " +
+                     std::to_string(kInSize) + " scale/shift values)";
+            return false;
+        }
+        load_bin(kCalibDarkFile,  m.calib_dark.data(),  kRawSize);
+        load_bin(kCalibGainFile,  m.calib_gain.data(),  kRawSize);
+        load_bin(kCalibScaleFile, m.calib_scale.data(), kInSize);
+        load_bin(kCalibShiftFile, m.calib_shift.data(), kInSize);
+        m.has_calib = ok;
+    }
+
+    // So does the gate
+    m.has_gate = false;
+    if (ok && bin_count(kGateW1File) != 0) {
+        if (bin_count(kGateW1File) != size_t(kGateHidden * kInSize) ||
+            bin_count(kGateB1File) != size_t(kGateHidden) ||
+            bin_count(kGateW2File) != size_t(kGateHidden) ||
+            bin_count(kGateB2File) != 1) {
+            *error = "Bad gating model in " + data_dir + " (expected " +
+                     std::to_string(kGateHidden) + " x " + std::to_string(kInSize) +
+                     " hidden layer and one output)";
+            return false;
+        }
+        load_bin(kGateW1File, m.gate_w1.data(), kGateHidden * kInSize);
+        load_bin(kGateB1File, m.gate_b1.data(), kGateHidden);
+        load_bin(kGateW2File, m.gate_w2.data(), kGateHidden);
+        load_bin(kGateB2File, m.gate_b2.data(), 1);
+        m.has_gate = ok;
+    }
+    return ok;
+}
+
+// G * g per (out, in) filter, accumulated in double
+static void TransformWeights(const aligned_vector<float> & weight, int out_ch, int in_ch,
+                             int kernel, int m, aligned_vector<float> & wino) {
+    const WinogradTransform w = MakeWinograd(m, kernel);
+    wino.assign(size_t(out_ch) * in_ch * w.alpha, 0.0f);
+    for (int f = 0; f < out_ch * in_ch; ++f)
+        for (int i = 0; i < w.alpha; ++i) {
+            double acc = 0;
+            for (int k = 0; k < kernel; ++k) acc += w.g[i][k] * weight[f * kernel + k];
+            wino[f * w.alpha + i] = float(acc);
+        }
+}
+
+bool PrepareWinograd(CnnModel & m, int conv2_tile, int conv3_tile, string* error) {
+    for (int tile : {conv2_tile, conv3_tile}) {
+        if (tile != 0 && (tile < 2 || tile > kMaxWinoTile)) {
+            *error = "Winograd tile " + std::to_string(tile) + " is not 0 or 2.." +
+                     std::to_string(kMaxWinoTile);
+            return false;
+        }
+    }
+    m.conv2_tile = conv2_tile;
+    m.conv3_tile = conv3_tile;
+    if (conv2_tile)
+        TransformWeights(m.conv2_weight, kChannels2, kChannels1, kKernel2, conv2_tile, m.conv2_wino);
+    else
+        m.conv2_wino.assign(1, 0.0f);
+    if (conv3_tile)
+        TransformWeights(m.conv3_weight, kChannels3, kChannels2, kKernel3, conv3_tile, m.conv3_wino);
+    else
+        m.conv3_wino.assign(1, 0.0f);
+    return true;
+}
+
+bool LoadRaw(
+    const string& data_dir,
+    aligned_vector<uint16_t> & frame,
+    string* error) {
+    const char* kRawFile = "/raw.bin";
+    return ReadBin(data_dir + kRawFile, frame.data(), kRawSize * sizeof(uint16_t), error);
+}
+
+bool LoadInput(
+    const string& data_dir,
+    aligned_vector<float> & input,
+    string* error) {
+    const char* kInputFile = "/input.bin";
+    return ReadBin(data_dir + kInputFile, input.data(), kInSize * sizeof(float), error);
+}
+
+bool LoadOutput(
+    const string& data_dir,
+    aligned_vector<float> & output,
+    string* error) {
+    const char* kOutputFile = "/output.bin";
+    return ReadBin(data_dir + kOutputFile, output.data(), kOutSize * sizeof(float), error);
+}
+
+void LoadData(
+    const string& data_dir, 
+    aligned_vector<float> & input,
+    CnnModel & m) {
+
+    string error;
+    if (!LoadInput(data_dir, input, &error) || !LoadModel(data_dir, m, &error)) {
+        clog << error << "\n";
+        exit(EXIT_FAILURE);
+    }
 }
 
+
+
 float IsError(float a, float b) {
     return fabs((a - b) / (a + b)) > 1e-3f && fabs(a - b) > 0.05f;
 }
@@ -162,31 +1073,16 @@ int Verify(const string& data_dir,
            aligned_vector<float>& output) {
 
     int error = 0;
-    const char kOutputFile[] = "/output.bin";
-    string path = data_dir + kOutputFile;
-
-    // 1) Open ground‑truth file
-    int fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1) {
-        std::clog << "Cannot find " << path << std::endl;
-        return EXIT_FAILURE;
-    }
 
-    // 2) mmap it (size = kOutSize floats)
-    size_t mapped_bytes = sizeof(float) * kOutSize;
-    float* ground_truth = reinterpret_cast<float*>(
-        mmap(nullptr,
-             mapped_bytes,
-             PROT_READ,
-             MAP_SHARED,
-             fd, 0));
-    if (ground_truth == MAP_FAILED) {
-        std::clog << "Failed to mmap " << path << std::endl;
-        close(fd);
+    // 1) Load ground truth
+    aligned_vector<float> ground_truth(kOutSize);
+    string load_error;
+    if (!LoadOutput(data_dir, ground_truth, &load_error)) {
+        std::clog << load_error << std::endl;
         return EXIT_FAILURE;
     }
 
-    // 3) Compare element‑wise
+    // 2) Compare element‑wise
     bool first = true;
     for (int i = 0; i < kOutSize; ++i) {
         if (IsError(output[i], ground_truth[i])) {
@@ -200,9 +1096,39 @@ int Verify(const string& data_dir,
         }
     }
 
-    // 4) Clean up
-    munmap(ground_truth, mapped_bytes);
-    close(fd);
+    return error;
+}
+int VerifyPeaks(const string& data_dir,
+                aligned_vector<float>& peaks,
+                int num_peaks) {
+
+    int error = 0;
+    aligned_vector<float> ground_truth(kOutSize);
+    string load_error;
+    if (!LoadOutput(data_dir, ground_truth, &load_error)) {
+        std::clog << load_error << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    num_peaks = ClampPeaks(num_peaks);
+    float expected[kMaxPeaks * kPeakFields];
+    ExtractPeaks(ground_truth.data(), num_peaks, expected);
+
+    // Same peak positions; heights and widths within the Verify tolerance
+    bool first = true;
+    for (int k = 0; k < num_peaks; ++k) {
+        const float* got = &peaks[k * kPeakFields];
+        const float* want = &expected[k * kPeakFields];
+        if (got[0] != want[0] || IsError(got[1], want[1]) || IsError(got[2], want[2])) {
+            if (first) {
+                std::clog << "First peak error: got (" << got[0] << ", " << got[1]
+                          << ", " << got[2] << "), expecting (" << want[0] << ", "
+                          << want[1] << ", " << want[2] << ") @ peak " << k << std::endl;
+                first = false;
+            }
+            ++error;
+        }
+    }
 
     return error;
-}
\ No newline at end of file
+}
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <tapa.h>
+#include "kernel_model.h"
+
+using std::string;
+
+static int CeilDiv(int a, int b) { return (a + b - 1) / b; }
+
+static int Log2Ceil(int n) {
+    int d = 0;
+    while ((1 << d) < n) ++d;
+    return d;
+}
+
+// BRAM18 blocks of `words` 32-bit words split over `banks` partitions
+static int Bram18(int words, int banks) {
+    const int depth = CeilDiv(words, banks);
+    return depth <= kLutramDepth ? 0 : banks * CeilDiv(depth, kBram18Words);
+}
+
+// Beats to stream `floats` through one mmap port
+static int Beats(int floats, int port_bits) { return CeilDiv(floats * 32, port_bits); }
+
+const int kDivSqrtLatency = 28;  // 1 / sqrt(var + eps), once per channel
+const int kMacDsp = kFmulDsp + kFaddDsp;
+
+// Bias and BN parameters, then the input sample
+static StageEstimate Params() {
+    StageEstimate s;
+    s.name = "params";
+    for (int ch : {kChannels1, kChannels2, kChannels3}) {
+        s.cycles += ch + kAxiLatency;
+        s.dram_bytes += 5.0 * ch * sizeof(float);
+    }
+    s.cycles += kInSize + kAxiLatency;
+    s.dram_bytes += kInSize * sizeof(float);
+    s.limit = "axi latency";
+    return s;
+}
+
+// Direct conv: one pipelined loop over x per output channel. Every output
+// reads in_ch * kernel activations from act_banks banks and as many weights
+// from the weight tile (weight_banks banks); the unrolled lanes leave
+// `steps` sequential multiply-add groups per output.
+static StageEstimate DirectConv(const char* name, int in_ch, int out_ch, int kernel, int len,
+                                int u_ic, int u_k, int act_banks, int weight_banks,
+                                bool weight_tile_per_oc, int port_bits) {
+    StageEstimate s;
+    s.name = name;
+    u_ic = std::min(u_ic, in_ch);
+    u_k = std::min(u_k, kernel);
+    const int steps = CeilDiv(in_ch, u_ic) * CeilDiv(kernel, u_k);
+    const int reads = in_ch * kernel;
+    const int act_ii = CeilDiv(reads, 2 * act_banks);
+    const int weight_ii = CeilDiv(reads, 2 * weight_banks);
+    s.ii = max(steps, max(act_ii, weight_ii));
+    s.limit = s.ii == steps ? "lanes" : act_ii >= weight_ii ? "act ports" : "weight ports";
+
+    const int depth = kBramLatency + kFmulLatency +
+                      kFaddLatency * (Log2Ceil(u_ic * u_k) + steps) + 1;
+    const int load = Beats(in_ch * kernel, port_bits) + kAxiLatency;
+    s.cycles = out_ch * ((len - 1) * double(s.ii) + depth);
+    s.cycles += weight_tile_per_oc ? out_ch * double(load) : Beats(out_ch * kernel, port_bits) + kAxiLatency;
+    s.lanes = u_ic * u_k;
+    s.dsp = s.lanes * kMacDsp;
+    s.dram_bytes = double(out_ch) * in_ch * kernel * sizeof(float);
+    s.flops = 2.0 * out_ch * len * in_ch * kernel;
+    return s;
+}
+
+// Winograd conv (WinogradConv in cnn.cpp): input transform per (tile, ic),
+// then per output channel a pipelined loop over tiles doing alpha lanes per
+// unrolled input channel plus the output transform
+static StageEstimate Winograd(const char* name, int in_ch, int out_ch, int kernel, int len,
+                              int m, int ic_unroll, int port_bits) {
+    StageEstimate s;
+    s.name = name;
+    const WinogradTransform w = MakeWinograd(m, kernel);
+    const int alpha = w.alpha;
+    const int tiles = CeilDiv(len, m);
+    const int u_ic = std::min(ic_unroll, in_ch);
+
+    // Constant transforms: adds per nonzero beyond the first, multiplies
+    // for coefficients other than +-1
+    auto count = [](const double* row, int n, int* adds, int* mults, int* widest) {
+        int nz = 0;
+        for (int j = 0; j < n; ++j) {
+            if (row[j] == 0) continue;
+            ++nz;
+            if (row[j] != 1 && row[j] != -1) ++*mults;
+        }
+        *adds += nz > 0 ? nz - 1 : 0;
+        *widest = max(*widest, nz);
+    };
+    int bt_adds = 0, bt_mults = 0, bt_widest = 1, at_adds = 0, at_mults = 0, at_widest = 1;
+    for (int i = 0; i < alpha; ++i) count(w.bt[i], alpha, &bt_adds, &bt_mults, &bt_widest);
+    for (int x = 0; x < m; ++x) count(w.at[x], alpha, &at_adds, &at_mults, &at_widest);
+
+    const int t_ii = CeilDiv(alpha, 2 * ic_unroll);
+    const int t_depth = kBramLatency + kFmulLatency + kFaddLatency * Log2Ceil(bt_widest) + 1;
+    s.cycles = tiles * ((in_ch - 1) * double(t_ii) + t_depth);
+
+    const int steps = CeilDiv(in_ch, u_ic);
+    const int write_ii = CeilDiv(m, 2 * ic_unroll);
+    s.ii = max(steps, write_ii);
+    s.limit = s.ii == steps ? "lanes" : "act ports";
+    const int depth = kBramLatency + kFmulLatency + kFaddLatency * (Log2Ceil(u_ic) + steps) +
+                      kFmulLatency + kFaddLatency * Log2Ceil(at_widest + 1) + 1;
+    const int load = Beats(in_ch * alpha, port_bits) + kAxiLatency;
+    s.cycles += out_ch * (load + (tiles - 1) * double(s.ii) + depth);
+
+    s.lanes = u_ic * alpha;
+    s.dsp = s.lanes * kMacDsp + (bt_mults + at_mults) * kFmulDsp +
+            (bt_adds + at_adds + m) * kFaddDsp;
+    s.bram18 = Bram18(tiles * in_ch * alpha, ic_unroll * alpha);
+    s.dram_bytes = double(out_ch) * in_ch * alpha * sizeof(float);
+    s.flops = 2.0 * out_ch * in_ch * alpha * tiles +
+              double(tiles) * in_ch * (bt_adds + bt_mults) +
+              double(out_ch) * tiles * (at_adds + at_mults + m);
+    return s;
+}
+
+// BN, ReLU and (optionally) max pool after a conv, II = 1 loops
+static StageEstimate BnReluPool(const char* name, int ch, int len, bool pool) {
+    StageEstimate s;
+    s.name = name;
+    const int bn_depth = kBramLatency + 2 * kFaddLatency + 2 * kFmulLatency + 1;
+    s.cycles = ch * (kDivSqrtLatency + (len - 1) + bn_depth);
+    s.cycles += ch * (len - 1 + kBramLatency + 2);
+    if (pool) s.cycles += ch * (len / 2 - 1 + kBramLatency + 2);
+    s.lanes = 1;
+    s.dsp = 2 * kFmulDsp + 2 * kFaddDsp;
+    s.flops = 4.0 * ch * len;
+    s.limit = "trip count";
+    return s;
+}
+
+// LinearSkipZeros: compaction, bias, then one AXI burst per active column
+// (dense) or per active V column and U column (low rank). `lanes` outputs
+// update per cycle, limited by how many floats the weight port delivers.
+static StageEstimate Linear(const char* name, int in_size, int out_size, int active, int rank,
+                            int ic_unroll, int port_bits, bool relu) {
+    StageEstimate s;
+    s.name = name;
+    const int lanes = std::min(ic_unroll, out_size);
+    const int port_ii = max(1, CeilDiv(lanes * 32, port_bits));
+    const int depth = kBramLatency + kFmulLatency + kFaddLatency + 1;
+    s.ii = port_ii;
+    s.cycles = in_size + out_size + kAxiLatency;
+    double burst_cycles, latency_cycles;
+    if (rank == 0) {
+        burst_cycles = double(active) * CeilDiv(out_size, lanes) * port_ii;
+        latency_cycles = double(active) * (kAxiLatency + depth);
+        s.dram_bytes = (double(active) * out_size + out_size) * sizeof(float);
+        s.flops = 2.0 * active * out_size;
+    } else {
+        burst_cycles = double(active) * rank + double(rank) * CeilDiv(out_size, lanes) * port_ii;
+        latency_cycles = double(active + rank) * (kAxiLatency + depth);
+        s.dram_bytes = (double(active) * rank + double(rank) * out_size + out_size) * sizeof(float);
+        s.flops = 2.0 * (double(active) * rank + double(rank) * out_size);
+    }
+    s.cycles += burst_cycles + latency_cycles;
+    if (relu) s.cycles += out_size;
+    s.limit = latency_cycles > burst_cycles ? "axi latency" : port_ii > 1 ? "port width" : "lanes";
+    s.lanes = lanes + (rank > 0 ? 1 : 0);
+    s.dsp = s.lanes * kMacDsp;
+    s.bram18 = Bram18(in_size, 1);  // nonzero index list
+    return s;
+}
+
+static StageEstimate RmsOutput(int port_bits) {
+    StageEstimate s;
+    s.name = "rms+output";
+    const int partials = 8;
+    s.cycles = kOutSize + kBramLatency + kFmulLatency + kFaddLatency;
+    s.cycles += partials * kFaddLatency + kDivSqrtLatency;
+    s.cycles += kOutSize + kBramLatency + kFmulLatency;
+    s.cycles += Beats(kOutSize, port_bits) + kAxiLatency;
+    s.lanes = 1;
+    s.dsp = 2 * kFmulDsp + kFaddDsp;
+    s.dram_bytes = kOutSize * sizeof(float);
+    s.flops = 3.0 * kOutSize;
+    s.limit = "trip count";
+    return s;
+}
+
+bool ValidKnobs(const KernelKnobs & k, string* error) {
+    if (k.ic_unroll < 1 || k.k1_unroll < 1 || k.k2_unroll < 1 || k.k3_unroll < 1) {
+        *error = "unroll factors must be >= 1";
+        return false;
+    }
+    for (int m : {k.wino_m2, k.wino_m3}) {
+        if (m != 0 && (m < 2 || m > kMaxWinoTile)) {
+            *error = "Winograd tiles must be 0 or 2.." + std::to_string(kMaxWinoTile);
+            return false;
+        }
+    }
+    if (k.port_bits < 32 || k.port_bits % 32 != 0 || k.clock_mhz <= 0 || k.dram_gbps <= 0) {
+        *error = "port_bits must be a multiple of 32, clock and bandwidth positive";
+        return false;
+    }
+    return true;
+}
+
+KernelEstimate EstimateKernel(const KernelKnobs & k, const KernelWorkload & work) {
+    KernelEstimate est;
+    auto & st = est.stages;
+    st.push_back(Params());
+    // conv1 reads in0 (K1_UNROLL banks) with its weights fully partitioned
+    st.push_back(DirectConv("conv1", 1, kChannels1, kKernel1, kInSize, 1, k.k1_unroll,
+                            k.k1_unroll, kKernel1, false, k.port_bits));
+    st.push_back(BnReluPool("bn1+pool", kChannels1, kInSize, true));
+    // conv2 / conv3 share the weight tile wt[kChannels2][kKernel2]
+    const int tile_banks = k.ic_unroll * kKernel2;
+    if (k.wino_m2)
+        st.push_back(Winograd("conv2", kChannels1, kChannels2, kKernel2, kSize2, k.wino_m2,
+                              k.ic_unroll, k.port_bits));
+    else
+        st.push_back(DirectConv("conv2", kChannels1, kChannels2, kKernel2, kSize2, k.ic_unroll,
+                                k.k2_unroll, k.ic_unroll, tile_banks, true, k.port_bits));
+    st.push_back(BnReluPool("bn2+pool", kChannels2, kSize2, true));
+    if (k.wino_m3)
+        st.push_back(Winograd("conv3", kChannels2, kChannels3, kKernel3, kSize3, k.wino_m3,
+                              k.ic_unroll, k.port_bits));
+    else
+        st.push_back(DirectConv("conv3", kChannels2, kChannels3, kKernel3, kSize3, k.ic_unroll,
+                                k.k3_unroll, k.ic_unroll, tile_banks, true, k.port_bits));
+    st.push_back(BnReluPool("bn3", kChannels3, kSize3, false));
+    st.push_back(Linear("fc1", LinearSize1, LinearSize2, work.fc1_active, work.fc1_rank,
+                        k.ic_unroll, k.port_bits, true));
+    st.push_back(Linear("fc2", LinearSize2, kOutSize, work.fc2_active, work.fc2_rank,
+                        k.ic_unroll, k.port_bits, false));
+    st.push_back(RmsOutput(k.port_bits));
+
+    for (const StageEstimate & s : st) {
+        est.cycles += s.cycles;
+        est.dsp += s.dsp;
+        est.bram18 += s.bram18;
+        est.dram_bytes += s.dram_bytes;
+        est.flops += s.flops;
+    }
+    // ping / pong activation buffers, cyclic by IC_UNROLL
+    for (int slot = 0; slot < kActPlan.num_slots; ++slot)
+        est.bram18 += Bram18(kActPlan.slot_size[slot], k.ic_unroll);
+    return est;
+}
+
+string DescribeKnobs(const KernelKnobs & k) {
+    std::ostringstream os;
+    os << "IC_UNROLL=" << k.ic_unroll << " K1_UNROLL=" << k.k1_unroll
+       << " K2_UNROLL=" << k.k2_unroll << " K3_UNROLL=" << k.k3_unroll
+       << " WINO_M2=" << k.wino_m2 << " WINO_M3=" << k.wino_m3;
+    return os.str();
+}
+
+string FormatEstimate(const KernelKnobs & k, const KernelEstimate & est) {
+    std::ostringstream os;
+    char line[256];
+    const double hz = k.clock_mhz * 1e6;
+    snprintf(line, sizeof(line), "%-11s %10s %6s %4s %5s %5s %6s %9s %9s %7s %8s %8s  %s\n",
+             "stage", "cycles", "%", "II", "lanes", "DSP", "BRAM18", "DRAM KB", "FLOP",
+             "FLOP/B", "GFLOP/s", "roof", "limit");
+    os << line;
+    for (const StageEstimate & s : est.stages) {
+        const double attained = s.cycles > 0 ? s.flops / (s.cycles / hz) * 1e-9 : 0;
+        // Roofline: the lanes' peak, or what DRAM can feed at this intensity
+        char ai[16] = "-", roof[16] = "-";
+        if (s.flops > 0) {
+            double r = s.lanes * 2.0 * hz * 1e-9;
+            if (s.dram_bytes > 0) {
+                const double intensity = s.flops / s.dram_bytes;
+                snprintf(ai, sizeof(ai), "%.2f", intensity);
+                r = std::min(r, intensity * k.dram_gbps);
+            }
+            snprintf(roof, sizeof(roof), "%.3f", r);
+        }
+        snprintf(line, sizeof(line),
+                 "%-11s %10.0f %5.1f%% %4d %5d %5d %6d %9.1f %9.0f %7s %8.3f %8s  %s\n",
+                 s.name.c_str(), s.cycles, 100.0 * s.cycles / est.cycles, s.ii, s.lanes, s.dsp,
+                 s.bram18, s.dram_bytes / 1024, s.flops, ai, attained, roof, s.limit.c_str());
+        os << line;
+    }
+    const double secs = est.seconds(k);
+    snprintf(line, sizeof(line),
+             "total: %.0f cycles = %.2f us at %.0f MHz (%.0f samples/s), %d DSP, %d BRAM18, "
+             "%.1f KB DRAM/sample (%.3f of %.1f GB/s), %.3f GFLOP/s\n",
+             est.cycles, secs * 1e6, k.clock_mhz, 1.0 / secs, est.dsp, est.bram18,
+             est.dram_bytes / 1024, est.dram_bytes / secs * 1e-9, k.dram_gbps,
+             est.flops / secs * 1e-9);
+    os << line;
+    return os.str();
+}
@@ -0,0 +1,228 @@
+// Offline estimator for CnnKernel's tuning knobs (see kernel_model.h):
+//
+//   ./kernel_model                       estimate the knobs this tree builds with
+//   ./kernel_model --ic_unroll=8 ...     estimate another configuration
+//   ./kernel_model --sweep --top=20      rank every configuration that fits, for
+//                                        each --sweep_port_bits width
+//   ./kernel_model --csynth=<csynth.xml> compare with a synthesis report
+//   ./kernel_model --measured_ms=<ms>    compare with a measured kernel time
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <tapa.h>
+#include "kernel_model.h"
+
+using std::clog;
+using std::string;
+
+DEFINE_int32(ic_unroll, IC_UNROLL, "IC_UNROLL");
+DEFINE_int32(k1_unroll, K1_UNROLL, "K1_UNROLL");
+DEFINE_int32(k2_unroll, K2_UNROLL, "K2_UNROLL");
+DEFINE_int32(k3_unroll, K3_UNROLL, "K3_UNROLL");
+DEFINE_int32(wino_m2, WINO_M2, "WINO_M2, Winograd tile of conv2 (0 = direct)");
+DEFINE_int32(wino_m3, WINO_M3, "WINO_M3, Winograd tile of conv3 (0 = direct)");
+DEFINE_int32(port_bits, 32, "mmap data width in bits");
+DEFINE_double(clock_mhz, 300, "kernel clock");
+DEFINE_double(dram_gbps, 19.2, "DRAM bandwidth available to the kernel");
+DEFINE_int32(fc1_active, LinearSize1 / 2, "active (nonzero) fc1 inputs per sample, see cnn's sparsity report");
+DEFINE_int32(fc2_active, LinearSize2 / 2, "active (nonzero) fc2 inputs per sample");
+DEFINE_int32(fc1_rank, 0, "fc1 factorization rank, 0 = dense");
+DEFINE_int32(fc2_rank, 0, "fc2 factorization rank, 0 = dense");
+DEFINE_bool(sweep, false, "rank all knob combinations that fit the budgets");
+DEFINE_int32(top, 10, "configurations listed by --sweep");
+DEFINE_string(sweep_port_bits, "32,64,128,256,512",
+              "mmap widths --sweep tries; CnnKernel builds 32 (see KernelKnobs::port_bits)");
+DEFINE_int32(dsp_budget, 12288, "DSPs available to the kernel (default: Alveo U250)");
+DEFINE_int32(bram_budget, 5376, "BRAM18s available to the kernel (default: Alveo U250)");
+DEFINE_string(csynth, "", "Vitis HLS csynth.xml of CnnKernel to compare against");
+DEFINE_double(measured_ms, 0, "measured kernel time per sample to compare against");
+
+// Text of the first <tag>...</tag> after `from`, empty if absent
+static string XmlValue(const string & xml, const string & tag, size_t from = 0,
+                       size_t* end = nullptr) {
+    const string open = "<" + tag + ">", close = "</" + tag + ">";
+    const size_t b = xml.find(open, from);
+    if (b == string::npos) return "";
+    const size_t e = xml.find(close, b);
+    if (e == string::npos) return "";
+    if (end) *end = e + close.size();
+    return xml.substr(b + open.size(), e - b - open.size());
+}
+
+static void CompareCsynth(const string & path, const KernelEstimate & est) {
+    std::ifstream in(path);
+    if (!in) {
+        clog << "Cannot open " << path << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const string xml = ss.str();
+
+    const string latency = XmlValue(xml, "SummaryOfOverallLatency");
+    const string best = XmlValue(latency, "Best-caseLatency");
+    const string worst = XmlValue(latency, "Worst-caseLatency");
+    const string area = XmlValue(xml, "Resources");
+    string dsp = XmlValue(area, "DSP");
+    if (dsp.empty()) dsp = XmlValue(area, "DSP48E");
+    const string bram = XmlValue(area, "BRAM_18K");
+    const string period = XmlValue(xml, "EstimatedClockPeriod");
+
+    auto ratio = [](const string & reported, double predicted) -> string {
+        char* end;
+        const double r = strtod(reported.c_str(), &end);
+        if (reported.empty() || *end != '\0' || predicted <= 0) return "n/a";
+        return std::to_string(r / predicted);
+    };
+    clog << "csynth " << path << " (estimated clock period " << (period.empty() ? "?" : period)
+         << " ns):\n"
+         << "  latency best/worst " << (best.empty() ? "?" : best) << " / "
+         << (worst.empty() ? "?" : worst) << " cycles vs model " << est.cycles
+         << " (best/model " << ratio(best, est.cycles) << ", worst/model "
+         << ratio(worst, est.cycles) << ")\n"
+         << "  DSP " << (dsp.empty() ? "?" : dsp) << " vs model " << est.dsp << " ("
+         << ratio(dsp, est.dsp) << "), BRAM18 " << (bram.empty() ? "?" : bram)
+         << " vs model " << est.bram18 << " (" << ratio(bram, est.bram18) << ")\n";
+
+    // Achieved II of every pipelined loop, to match against the stage IIs
+    const string loops = XmlValue(xml, "SummaryOfLoopLatency");
+    size_t pos = 0;
+    while (pos < loops.size()) {
+        const size_t b = loops.find('<', pos);
+        if (b == string::npos || loops[b + 1] == '/') break;
+        const size_t e = loops.find('>', b);
+        const string name = loops.substr(b + 1, e - b - 1);
+        size_t end;
+        const string body = XmlValue(loops, name, b, &end);
+        if (body.empty()) break;
+        const string ii = XmlValue(body, "PipelineII");
+        if (!ii.empty())
+            clog << "  loop " << name << ": II " << ii << ", trips "
+                 << XmlValue(body, "TripCount") << ", latency " << XmlValue(body, "Latency")
+                 << "\n";
+        pos = end;
+    }
+}
+
+int main(int argc, char** argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
+
+    KernelKnobs knobs;
+    knobs.ic_unroll = FLAGS_ic_unroll;
+    knobs.k1_unroll = FLAGS_k1_unroll;
+    knobs.k2_unroll = FLAGS_k2_unroll;
+    knobs.k3_unroll = FLAGS_k3_unroll;
+    knobs.wino_m2 = FLAGS_wino_m2;
+    knobs.wino_m3 = FLAGS_wino_m3;
+    knobs.port_bits = FLAGS_port_bits;
+    knobs.clock_mhz = FLAGS_clock_mhz;
+    knobs.dram_gbps = FLAGS_dram_gbps;
+
+    KernelWorkload work;
+    work.fc1_active = FLAGS_fc1_active;
+    work.fc2_active = FLAGS_fc2_active;
+    work.fc1_rank = FLAGS_fc1_rank;
+    work.fc2_rank = FLAGS_fc2_rank;
+    if (work.fc1_active < 0 || work.fc1_active > LinearSize1 ||
+        work.fc2_active < 0 || work.fc2_active > LinearSize2 ||
+        work.fc1_rank < 0 || work.fc1_rank > kMaxRank ||
+        work.fc2_rank < 0 || work.fc2_rank > kMaxRank) {
+        clog << "FC active inputs or ranks out of range\n";
+        return EXIT_FAILURE;
+    }
+
+    string error;
+    if (!ValidKnobs(knobs, &error)) {
+        clog << error << "\n";
+        return EXIT_FAILURE;
+    }
+
+    const KernelEstimate est = EstimateKernel(knobs, work);
+    clog << DescribeKnobs(knobs) << ", " << knobs.port_bits << "-bit ports, fc1 "
+         << work.fc1_active << "/" << LinearSize1 << " active, fc2 " << work.fc2_active << "/"
+         << LinearSize2 << " active\n"
+         << FormatEstimate(knobs, est);
+
+    if (!FLAGS_csynth.empty()) CompareCsynth(FLAGS_csynth, est);
+    if (FLAGS_measured_ms > 0) {
+        const double predicted_ms = est.seconds(knobs) * 1e3;
+        clog << "Measured " << FLAGS_measured_ms << " ms vs model " << predicted_ms
+             << " ms (measured/model " << FLAGS_measured_ms / predicted_ms << ")\n";
+    }
+
+    if (FLAGS_sweep) {
+        struct Ranked {
+            KernelKnobs knobs;
+            KernelEstimate est;
+        };
+        std::vector<int> ports;
+        std::stringstream widths(FLAGS_sweep_port_bits);
+        for (string w; std::getline(widths, w, ',');) {
+            KernelKnobs c = knobs;
+            c.port_bits = atoi(w.c_str());
+            if (!ValidKnobs(c, &error)) {
+                clog << "--sweep_port_bits " << w << ": " << error << "\n";
+                return EXIT_FAILURE;
+            }
+            ports.push_back(c.port_bits);
+        }
+        std::vector<Ranked> fits;
+        int tried = 0;
+        for (int port : ports)
+            for (int ic : {1, 2, 4, 8, 16, 32})
+                for (int m2 = 0; m2 <= kMaxWinoTile; ++m2)
+                    for (int m3 = 0; m3 <= kMaxWinoTile; ++m3) {
+                        if (m2 == 1 || m3 == 1) continue;
+                        // K2 / K3 unrolls only matter for the direct convs
+                        for (int k1 = 1; k1 <= kKernel1; ++k1)
+                            for (int k2 = m2 ? kKernel2 : 1; k2 <= kKernel2; ++k2)
+                                for (int k3 = m3 ? kKernel3 : 1; k3 <= kKernel3; ++k3) {
+                                    KernelKnobs c = knobs;
+                                    c.port_bits = port;
+                                    c.ic_unroll = ic;
+                                    c.k1_unroll = k1;
+                                    c.k2_unroll = k2;
+                                    c.k3_unroll = k3;
+                                    c.wino_m2 = m2;
+                                    c.wino_m3 = m3;
+                                    ++tried;
+                                    KernelEstimate e = EstimateKernel(c, work);
+                                    if (e.dsp <= FLAGS_dsp_budget && e.bram18 <= FLAGS_bram_budget)
+                                        fits.push_back({c, e});
+                                }
+                    }
+        // Fastest first; among equals the cheaper one
+        std::sort(fits.begin(), fits.end(), [](const Ranked & a, const Ranked & b) {
+            if (a.est.cycles != b.est.cycles) return a.est.cycles < b.est.cycles;
+            if (a.est.dsp != b.est.dsp) return a.est.dsp < b.est.dsp;
+            return a.est.bram18 < b.est.bram18;
+        });
+        clog << "\nSweep: " << fits.size() << " of " << tried << " configurations fit "
+             << FLAGS_dsp_budget << " DSP / " << FLAGS_bram_budget << " BRAM18\n";
+        if (std::any_of(ports.begin(), ports.end(), [](int p) { return p > 32; }))
+            clog << "Ports wider than 32 bits need vector FC ports in CnnKernel "
+                    "(see KernelKnobs::port_bits)\n";
+        char line[256];
+        snprintf(line, sizeof(line), "%4s %10s %9s %6s %6s %4s  %-22s %s\n", "rank", "cycles",
+                 "us", "DSP", "BRAM18", "port", "slowest", "knobs");
+        clog << line;
+        for (int i = 0; i < int(fits.size()) && i < FLAGS_top; ++i) {
+            const Ranked & r = fits[i];
+            const StageEstimate* slowest = &r.est.stages[0];
+            for (const StageEstimate & s : r.est.stages)
+                if (s.cycles > slowest->cycles) slowest = &s;
+            snprintf(line, sizeof(line), "%4d %10.0f %9.2f %6d %6d %4d  %-22s %s\n", i + 1,
+                     r.est.cycles, r.est.seconds(r.knobs) * 1e6, r.est.dsp, r.est.bram18,
+                     r.knobs.port_bits,
+                     (slowest->name + " (" + slowest->limit + ")").c_str(),
+                     DescribeKnobs(r.knobs).c_str());
+            clog << line;
+        }
+    }
+    return EXIT_SUCCESS;
+}
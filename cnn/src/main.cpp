@@ -1,12 +1,24 @@
+#include <cmath>
 #include <chrono>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <sys/stat.h>
 
 // #include <gflags/gflags.h>
 // #include <cstdlib>
 // #include <cstdio>?????
 
 #include "cnn.h"
+#include "kernel_model.h"
+#include "numa_engine.h"
+#include "perf.h"
+#include "registry.h"
+#include "results.h"
+#include "split_engine.h"
+#include "tune.h"
 
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
@@ -16,77 +28,177 @@ using std::endl;
 using std::string;
 
 DEFINE_string(btstm, "", "path to the bitstream file, run csim if empty");
+DEFINE_string(batch_btstm, "", "bitstream built for the CnnBatchKernel top (--pe_batch, "
+              "--split_batch); runs csim if it and --btstm are empty");
 DEFINE_string(dtf, "./data", "data directory, default is ./data");
+DEFINE_string(output_mode, "full", "kernel output: full, peaks (top-K) or half (fp16)");
+DEFINE_int32(num_peaks, 8, "number of peaks returned with --output_mode=peaks");
+DEFINE_int32(mc_samples, 0, "Monte-Carlo dropout passes for uncertainty, 0 disables");
+DEFINE_double(mc_dropout_p, 0.5, "dropout probability used by the Monte-Carlo passes");
+DEFINE_int32(mc_seed, 1, "seed of the Monte-Carlo dropout masks");
+DEFINE_int32(batch, 0, "also run the batched CPU engine on this many samples, 0 skips it");
+DEFINE_bool(autotune, true, "autotune the batched CPU engine (result is cached)");
+DEFINE_bool(retune, false, "ignore the tuning cache and tune again");
+DEFINE_string(tune_cache, "./cnn_tune.cache", "autotuning cache file");
+DEFINE_bool(perf, false, "read hardware performance counters (perf_event_open) per run and per layer");
+DEFINE_int32(perf_samples, 1000, "samples used for the per-layer counter breakdown");
+DEFINE_string(results, "", "write the batch outputs to this chunked result file (.cnnr)");
+DEFINE_string(results_dtype, "float", "result file values: float or half");
+DEFINE_bool(results_delta, false, "delta code rows within each result chunk");
+DEFINE_int32(results_chunk, kResultDefaultChunkRows, "rows per result chunk");
+DEFINE_bool(results_append, false, "append to an existing result file instead of replacing it");
+DEFINE_int32(pe_batch, 0, "run this many samples through the multi-PE batch kernel, 0 skips it");
+DEFINE_bool(raw, false, "feed the raw detector frame (raw.bin) through the preprocessing stage");
+DEFINE_string(swap_dtf, "", "hot-swap to the model in this directory while serving batches, then A/B it");
+DEFINE_int32(swap_batch, 64, "batch size served during the hot-swap demo");
+DEFINE_int32(wino_m2, WINO_M2, "Winograd tile of conv2 in the CPU engine, 0 = direct");
+DEFINE_int32(wino_m3, WINO_M3, "Winograd tile of conv3 in the CPU engine, 0 = direct");
+DEFINE_int32(numa_batch, 0, "samples per batch for the per-NUMA-node engine benchmark, 0 skips it");
+DEFINE_int32(numa_rounds, 20, "batches every node's client submits in the NUMA benchmark");
+DEFINE_int32(numa_threads, 0, "workers per NUMA node, 0 = one per CPU of the node");
+DEFINE_bool(wino_sweep, false, "report the drift against output.bin of every Winograd tile size");
+DEFINE_bool(screen, false, "pre-screen inputs ahead of conv1 so trivial frames skip the network");
+DEFINE_string(screen_fast, "flag", "pre-screen fast path: flag (route only) or template (cached spectrum)");
+DEFINE_double(screen_empty, -1, "route frames with max |x| at or below this as empty, < 0 disables");
+DEFINE_double(screen_saturation, -1, "saturation level of a bin, < 0 disables the check");
+DEFINE_int32(screen_saturation_count, 1, "saturated bins that route a frame as saturated");
+DEFINE_double(screen_signal, -1, "route frames with max - mean below this as low signal, < 0 disables");
+DEFINE_bool(screen_gate, false, "also run the gating model (gate_*.bin) on frames passing the checks");
+DEFINE_double(screen_gate_threshold, 0, "gate scores below this skip the network");
+DEFINE_int32(split_batch, 0, "samples for the device/CPU layer split benchmark, 0 skips it");
+DEFINE_int32(split_chunk, 64, "samples per device run in the split benchmark");
+DEFINE_int32(split, -1, "split point to benchmark (0 = all CPU .. 5 = all device), -1 = every one");
+DEFINE_double(screen_mix, 0.5, "fraction of the --batch samples replaced by trivial frames in the pre-screen benchmark");
 
 int main(int argc, char** argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
 
     //host data
     aligned_vector<float> h_input(kInSize);
 
-    aligned_vector<float> h_conv1_bias(kChannels1);
-    aligned_vector<float> h_conv2_bias(kChannels2);
-    aligned_vector<float> h_conv3_bias(kChannels3);
-    aligned_vector<float> h_conv1_weight(kChannels1 * kKernel1);
-    aligned_vector<float> h_conv2_weight(kChannels2 * kChannels1 * kKernel2);
-    aligned_vector<float> h_conv3_weight(kChannels3 * kChannels2 * kKernel3);
-
-    aligned_vector<float> h_bn1_bias(kChannels1);
-    aligned_vector<float> h_bn2_bias(kChannels2);
-    aligned_vector<float> h_bn3_bias(kChannels3);
-    aligned_vector<float> h_bn1_weight(kChannels1);
-    aligned_vector<float> h_bn2_weight(kChannels2);
-    aligned_vector<float> h_bn3_weight(kChannels3);
-    aligned_vector<float> h_bn1_running_mean(kChannels1);
-    aligned_vector<float> h_bn2_running_mean(kChannels2);
-    aligned_vector<float> h_bn3_running_mean(kChannels3);
-    aligned_vector<float> h_bn1_running_var(kChannels1);
-    aligned_vector<float> h_bn2_running_var(kChannels2);
-    aligned_vector<float> h_bn3_running_var(kChannels3);
-
-    aligned_vector<float> h_fc1_bias(LinearSize2);
-    aligned_vector<float> h_fc2_bias(kOutSize);
-    aligned_vector<float> h_fc1_weight(LinearSize1*LinearSize2);
-    aligned_vector<float> h_fc2_weight(LinearSize2*kOutSize);
+    CnnModel h_model;
+
+    // raw detector frame, used with --raw
+    aligned_vector<uint16_t> h_raw(kRawSize);
 
     aligned_vector<float> h_output(kOutSize);
 
     //a vector on host to store data from FPGA device
     aligned_vector<float> d_output(kOutSize);
+    aligned_vector<float> d_peaks(kMaxPeaks * kPeakFields);
+    aligned_vector<uint16_t> d_output_half(kOutSize);
+
+    // active (nonzero) FC inputs per sample, CPU and device
+    aligned_vector<int> h_nnz(kNnzStats);
+    aligned_vector<int> d_nnz(kNnzStats);
+
+    // pre-screen route the kernel took
+    aligned_vector<int> d_route(1);
+
+    auto report_sparsity = [](const char* who, const aligned_vector<int>& nnz) {
+        clog << who << " FC1 active inputs: " << nnz[0] << "/" << LinearSize1
+             << " (" << 100.0 * (LinearSize1 - nnz[0]) / LinearSize1 << "% skipped), "
+             << "FC2 active inputs: " << nnz[1] << "/" << LinearSize2
+             << " (" << 100.0 * (LinearSize2 - nnz[1]) / LinearSize2 << "% skipped)\n";
+    };
 
     if (argc > 2) {
         clog << "Usage: " << argv[0] << " [data dir]\n";
         return EXIT_FAILURE;
     }
+    if (argc == 2) FLAGS_dtf = argv[1];
 
-    LoadData(
-        FLAGS_dtf,
-        h_input,
-        h_conv1_bias, h_conv2_bias, h_conv3_bias,
-        h_conv1_weight, h_conv2_weight, h_conv3_weight,
-        h_bn1_bias, h_bn2_bias, h_bn3_bias,
-        h_bn1_weight, h_bn2_weight, h_bn3_weight,
-        h_bn1_running_mean, h_bn2_running_mean, h_bn3_running_mean,
-        h_bn1_running_var,  h_bn2_running_var,  h_bn3_running_var,
-        h_fc1_bias, h_fc2_bias,
-        h_fc1_weight, h_fc2_weight
-    );
+    int output_mode = kOutputFull;
+    if (FLAGS_output_mode == "peaks") output_mode = kOutputPeaks;
+    else if (FLAGS_output_mode == "half") output_mode = kOutputHalf;
+    else if (FLAGS_output_mode != "full") {
+        clog << "Unknown --output_mode " << FLAGS_output_mode << "\n";
+        return EXIT_FAILURE;
+    }
+    if (FLAGS_num_peaks < 1 || FLAGS_num_peaks > kMaxPeaks) {
+        clog << "--num_peaks must be in [1, " << kMaxPeaks << "]\n";
+        return EXIT_FAILURE;
+    }
+    if (FLAGS_results_dtype != "float" && FLAGS_results_dtype != "half") {
+        clog << "Unknown --results_dtype " << FLAGS_results_dtype << "\n";
+        return EXIT_FAILURE;
+    }
+
+    LoadData(FLAGS_dtf, h_input, h_model);
+    {
+        string error;
+        if (!PrepareWinograd(h_model, FLAGS_wino_m2, FLAGS_wino_m3, &error)) {
+            clog << error << "\n";
+            return EXIT_FAILURE;
+        }
+        if (h_model.conv2_tile || h_model.conv3_tile)
+            clog << "Winograd: conv2 F(" << h_model.conv2_tile << "," << kKernel2
+                 << "), conv3 F(" << h_model.conv3_tile << "," << kKernel3 << ") (0 = direct)\n";
+    }
+
+    // Raw mode: the model input comes from the detector frame and the
+    // calibration tables loaded with the weights
+    if (FLAGS_raw) {
+        string error;
+        if (!h_model.has_calib) {
+            clog << "--raw needs calib_*.bin in " << FLAGS_dtf << " (scripts/calib_to_bin.py)\n";
+            return EXIT_FAILURE;
+        }
+        if (!LoadRaw(FLAGS_dtf, h_raw, &error)) {
+            clog << error << "\n";
+            return EXIT_FAILURE;
+        }
+        aligned_vector<float> pre(kInSize);
+        CnnPreprocess(h_raw.data(), 1, h_model, pre.data());
+        float drift = 0;
+        for (int i = 0; i < kInSize; ++i)
+            drift = max(drift, std::fabs(pre[i] - h_input[i]));
+        clog << "Preprocessed raw frame vs input.bin: max |diff| " << drift << "\n";
+        h_input = pre;
+    }
+
+    // Pre-screen tables, passed to the kernel even when screening is off
+    ScreenTables screen;
+    if (FLAGS_screen) {
+        ScreenConfig sc;
+        sc.enabled = true;
+        if (FLAGS_screen_fast == "template") sc.fast_mode = kFastTemplate;
+        else if (FLAGS_screen_fast != "flag") {
+            clog << "Unknown --screen_fast " << FLAGS_screen_fast << "\n";
+            return EXIT_FAILURE;
+        }
+        sc.empty_level = FLAGS_screen_empty;
+        sc.saturation_level = FLAGS_screen_saturation;
+        sc.saturation_count = FLAGS_screen_saturation_count;
+        sc.signal_threshold = FLAGS_screen_signal;
+        sc.use_gate = FLAGS_screen_gate;
+        sc.gate_threshold = FLAGS_screen_gate_threshold;
+        string error;
+        if (!PrepareScreen(h_model, sc, screen, &error)) {
+            clog << error << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Hardware counters, if requested and permitted
+    std::unique_ptr<PerfCounters> counters;
+    if (FLAGS_perf) {
+        counters.reset(new PerfCounters());
+        if (!counters->any_available())
+            clog << "perf: hardware counters unavailable (" << counters->error()
+                 << "), reporting wall time only\n";
+        else if (!counters->error().empty())
+            clog << "perf: some counters unavailable (" << counters->error() << ")\n";
+    }
+    PerfReading perf_begin, perf_end;
 
     // CPU reference
     clog << "CNN computation on CPU using CnnSequential\n";
+    if (counters) perf_begin = counters->Read();
     const auto begin = steady_clock::now();
-    CnnSequential(
-        h_input,
-        h_conv1_bias, h_conv2_bias, h_conv3_bias,
-        h_conv1_weight, h_conv2_weight, h_conv3_weight,
-        h_bn1_bias, h_bn2_bias, h_bn3_bias,
-        h_bn1_weight, h_bn2_weight, h_bn3_weight,
-        h_bn1_running_mean, h_bn2_running_mean, h_bn3_running_mean,
-        h_bn1_running_var,  h_bn2_running_var,  h_bn3_running_var,
-        h_fc1_bias, h_fc2_bias,
-        h_fc1_weight, h_fc2_weight,
-        h_output
-    );
+    CnnSequential(h_input, h_model, h_output, h_nnz);
     const auto end = steady_clock::now();
+    if (counters) perf_end = counters->Read();
 
     //See if I can add flops?
     uint64_t run_time_us = duration_cast<microseconds>(end - begin).count();
@@ -101,40 +213,659 @@ int main(int argc, char** argv) {
     float gflops = ops / (run_time_us * 1e3);
     clog << "Time: " << run_time_us * 1e-6 << " s\n";
     clog << "Perf: " << gflops << " GFlops (don't trust if you sw emu hw emu)\n";
+    report_sparsity("CPU", h_nnz);
+
+    // Dense FLOPs above; zero-skipping only pays for the active FC columns
+    double fc_ops = double(h_nnz[0]) * LinearSize2 * 2 + double(h_nnz[1]) * kOutSize * 2;
+    double dense_fc_ops = double(LinearSize1) * LinearSize2 * 2 + double(LinearSize2) * kOutSize * 2;
+    clog << "FC work after zero-skipping: " << 100.0 * fc_ops / dense_fc_ops << "% of dense\n";
+
+    int cpu_error = Verify(FLAGS_dtf, h_output);
+    clog << "CPU: " << (cpu_error == 0 ? "PASS" : "FAIL") << endl;
+
+    if (counters) {
+        clog << "CPU perf: " << FormatPerf(*counters, perf_end - perf_begin, 1, ops) << "\n";
+
+        // Per-layer breakdown over many samples
+        const int n = max(FLAGS_perf_samples, 1);
+        aligned_vector<float> inputs(size_t(n) * kInSize);
+        for (int s = 0; s < n; ++s)
+            std::copy(h_input.begin(), h_input.end(), inputs.begin() + s * kInSize);
+        LayerProfile profile;
+        CnnProfileLayers(inputs.data(), n, h_model, *counters, profile);
+        PerfReading total;
+        for (int l = 0; l < kNumProfiledLayers; ++l) {
+            clog << "CPU perf " << kProfiledLayerNames[l] << ": "
+                 << FormatPerf(*counters, profile.layer[l], n, ProfiledLayerFlops(l) * n) << "\n";
+            total += profile.layer[l];
+        }
+        clog << "CPU perf total (" << n << " samples): "
+             << FormatPerf(*counters, total, n, ops * n) << "\n";
+    }
+
+    // Low-rank FC: report what the factors save and cost against dense weights
+    if (h_model.fc1_rank > 0 || h_model.fc2_rank > 0) {
+        auto weight_kb = [](int rank, int in_size, int out_size) {
+            int count = rank > 0 ? rank * (in_size + out_size) : in_size * out_size;
+            return count * sizeof(float) / 1024.0;
+        };
+        clog << "Low-rank FC: fc1 rank " << h_model.fc1_rank
+             << " (" << weight_kb(h_model.fc1_rank, LinearSize1, LinearSize2) << " KB vs "
+             << weight_kb(0, LinearSize1, LinearSize2) << " KB dense), fc2 rank "
+             << h_model.fc2_rank
+             << " (" << weight_kb(h_model.fc2_rank, LinearSize2, kOutSize) << " KB vs "
+             << weight_kb(0, LinearSize2, kOutSize) << " KB dense)\n";
+
+        CnnModel dense_model = h_model;
+        dense_model.fc1_rank = 0;
+        dense_model.fc2_rank = 0;
+        aligned_vector<float> dense_output(kOutSize);
+        aligned_vector<int> dense_nnz(kNnzStats);
+        CnnSequential(h_input, dense_model, dense_output, dense_nnz);
+        int dense_error = Verify(FLAGS_dtf, dense_output);
+        clog << "Verify pass rate: low-rank "
+             << 100.0 * (kOutSize - cpu_error) / kOutSize << "%, dense "
+             << 100.0 * (kOutSize - dense_error) / kOutSize << "%\n";
+    }
+
+    // Winograd: drift against output.bin, multiplies and CPU time per tiling
+    if (FLAGS_wino_sweep) {
+        aligned_vector<float> truth(kOutSize);
+        string error;
+        if (!LoadOutput(FLAGS_dtf, truth, &error)) {
+            clog << error << "\n";
+            return EXIT_FAILURE;
+        }
+        auto conv_mults = [](int tile, int in_ch, int out_ch, int kernel, int size) {
+            if (tile == 0) return double(out_ch) * in_ch * kernel * size;
+            const int tiles = (size + tile - 1) / tile;
+            return double(out_ch) * in_ch * (tile + kernel - 1) * tiles;
+        };
+        const int runs = 1000;
+        aligned_vector<float> out(kOutSize);
+        aligned_vector<int> nnz(kNnzStats);
+        clog << "Winograd sweep (conv2 m, conv3 m; 0 = direct):\n";
+        for (int m = 0; m <= kMaxWinoTile; ++m) {
+            if (m == 1) continue;
+            const int configs[3][2] = {{m, 0}, {0, m}, {m, m}};
+            for (int c = (m == 0 ? 2 : 0); c < 3; ++c) {
+                CnnModel wm = h_model;
+                if (!PrepareWinograd(wm, configs[c][0], configs[c][1], &error)) {
+                    clog << "  " << error << "\n";
+                    continue;
+                }
+                const auto t0 = steady_clock::now();
+                for (int r = 0; r < runs; ++r) CnnSequential(h_input, wm, out, nnz);
+                const auto t1 = steady_clock::now();
+                double drift = 0;
+                for (int i = 0; i < kOutSize; ++i)
+                    drift = max(drift, double(std::fabs(out[i] - truth[i])));
+                int errors = 0;
+                for (int i = 0; i < kOutSize; ++i) errors += IsError(out[i], truth[i]) != 0;
+                const double mults =
+                    conv_mults(configs[c][0], kChannels1, kChannels2, kKernel2, kSize2) +
+                    conv_mults(configs[c][1], kChannels2, kChannels3, kKernel3, kSize3);
+                clog << "  F(" << configs[c][0] << "," << kKernel2 << ") / F("
+                     << configs[c][1] << "," << kKernel3 << "): max |diff| " << drift
+                     << ", Verify pass rate " << 100.0 * (kOutSize - errors) / kOutSize
+                     << "%, conv2+conv3 mults " << mults << ", CPU "
+                     << duration_cast<microseconds>(t1 - t0).count() / double(runs)
+                     << " us/sample\n";
+            }
+        }
+    }
+
+    // Monte-Carlo dropout uncertainty
+    if (FLAGS_mc_samples > 0) {
+        if (FLAGS_mc_dropout_p < 0.0 || FLAGS_mc_dropout_p >= 1.0) {
+            clog << "--mc_dropout_p must be in [0, 1)\n";
+            return EXIT_FAILURE;
+        }
+        aligned_vector<float> mc_mean(kOutSize), mc_var(kOutSize);
+        const auto mc_begin = steady_clock::now();
+        CnnMcDropout(h_input, h_model, FLAGS_mc_samples, FLAGS_mc_dropout_p,
+                     FLAGS_mc_seed, mc_mean, mc_var);
+        const auto mc_end = steady_clock::now();
+
+        // Baseline: the same number of deterministic full inferences
+        aligned_vector<float> scratch(kOutSize);
+        aligned_vector<int> scratch_nnz(kNnzStats);
+        const auto naive_begin = steady_clock::now();
+        for (int s = 0; s < FLAGS_mc_samples; ++s)
+            CnnSequential(h_input, h_model, scratch, scratch_nnz);
+        const auto naive_end = steady_clock::now();
+
+        double mc_us = duration_cast<microseconds>(mc_end - mc_begin).count();
+        double naive_us = duration_cast<microseconds>(naive_end - naive_begin).count();
+        double mean_std = 0, max_std = 0;
+        int max_std_index = 0;
+        for (int i = 0; i < kOutSize; ++i) {
+            double sd = std::sqrt(mc_var[i]);
+            mean_std += sd / kOutSize;
+            if (sd > max_std) { max_std = sd; max_std_index = i; }
+        }
+        clog << "MC dropout: " << FLAGS_mc_samples << " passes (p = " << FLAGS_mc_dropout_p
+             << ") in " << mc_us << " us, " << naive_us << " us for as many CnnSequential calls ("
+             << (mc_us > 0 ? naive_us / mc_us : 0) << "x)\n";
+        clog << "MC dropout: mean stddev " << mean_std << ", max stddev " << max_std
+             << " @ index " << max_std_index << "\n";
+        int mc_error = Verify(FLAGS_dtf, mc_mean);
+        clog << "MC dropout mean vs ground truth: "
+             << 100.0 * (kOutSize - mc_error) / kOutSize << "% within tolerance\n";
+    }
+
+    // Batched CPU engine throughput, every row checked against its ground truth
+    if (FLAGS_batch > 0) {
+        CpuConfig cfg;
+        if (FLAGS_autotune) cfg = AutotuneCpu(h_model, FLAGS_tune_cache, FLAGS_retune);
+        clog << "CPU batch config: " << DescribeCpuConfig(cfg) << "\n";
+
+        aligned_vector<float> batch_in(size_t(FLAGS_batch) * kInSize);
+        aligned_vector<uint16_t> batch_raw(FLAGS_raw ? size_t(FLAGS_batch) * kRawSize : 0);
+        aligned_vector<float> batch_out(size_t(FLAGS_batch) * kOutSize);
+        // Preprocessed raw frames are copies of raw.bin, never inputs.bin rows
+        const bool per_row =
+            LoadBatchInputs(FLAGS_dtf, h_input, FLAGS_batch, batch_in.data()) && !FLAGS_raw;
+        for (size_t s = 0; s < batch_raw.size() / kRawSize; ++s)
+            std::copy(h_raw.begin(), h_raw.end(), batch_raw.begin() + s * kRawSize);
+
+        if (FLAGS_raw) {
+            const auto pre_begin = steady_clock::now();
+            CnnPreprocess(batch_raw.data(), FLAGS_batch, h_model, batch_in.data());
+            const auto pre_end = steady_clock::now();
+            double pre_us = duration_cast<microseconds>(pre_end - pre_begin).count();
+            clog << "CPU preprocessing: " << FLAGS_batch << " frames in " << pre_us * 1e-3
+                 << " ms, " << FLAGS_batch / (max(pre_us, 1.0) * 1e-6) << " frames/s\n";
+        }
+
+        if (counters) perf_begin = counters->Read();
+        const auto batch_begin = steady_clock::now();
+        if (FLAGS_raw)
+            CnnBatchRaw(batch_raw.data(), FLAGS_batch, h_model, cfg, batch_out.data());
+        else
+            CnnBatch(batch_in.data(), FLAGS_batch, h_model, cfg, batch_out.data());
+        const auto batch_end = steady_clock::now();
+        if (counters) {
+            perf_end = counters->Read();
+            clog << "CPU batch perf: "
+                 << FormatPerf(*counters, perf_end - perf_begin, FLAGS_batch, ops * FLAGS_batch)
+                 << "\n";
+        }
+        double batch_us = duration_cast<microseconds>(batch_end - batch_begin).count();
+        clog << "CPU batch: " << FLAGS_batch << " samples in " << batch_us * 1e-3 << " ms, "
+             << FLAGS_batch / (batch_us * 1e-6) << " samples/s, "
+             << ops * FLAGS_batch / (batch_us * 1e3) << " GFlops (dense equivalent)\n";
+
+        bool missing;
+        int failed = VerifyBatch(FLAGS_dtf, batch_out.data(), 0, FLAGS_batch, per_row,
+                                 ModelHash(h_model), &missing);
+        clog << "CPU batch: " << (failed == 0 ? "PASS" : "FAIL") << " ("
+             << FLAGS_batch - failed << "/" << FLAGS_batch << " samples)" << endl;
+
+        // Persist the batch in a result file, read it back and verify the rows
+        if (!FLAGS_results.empty()) {
+            string error;
+            ResultWriter writer;
+            const int dtype = FLAGS_results_dtype == "half" ? kResultHalf : kResultFloat;
+            const auto write_begin = steady_clock::now();
+            bool ok = writer.Open(FLAGS_results, ModelHash(h_model), dtype, FLAGS_results_delta,
+                                  FLAGS_results_chunk, FLAGS_results_append, &error);
+            const uint64_t first = ok ? writer.rows() : 0;
+            ok = ok && writer.Append(batch_out.data(), FLAGS_batch, &error) &&
+                 writer.Close(&error);
+            const auto write_end = steady_clock::now();
+
+            ResultReader reader;
+            aligned_vector<float> readback(size_t(FLAGS_batch) * kOutSize);
+            ok = ok && reader.Open(FLAGS_results, &error) &&
+                 reader.Read(first, FLAGS_batch, readback.data(), &error);
+            if (!ok) {
+                clog << "Results: " << error << "\n";
+                return EXIT_FAILURE;
+            }
+            struct stat st;
+            stat(FLAGS_results.c_str(), &st);
+            double write_us = duration_cast<microseconds>(write_end - write_begin).count();
+            clog << "Results: " << FLAGS_results << " holds " << reader.rows() << " rows in "
+                 << reader.index().size() << " chunks, " << double(st.st_size) / reader.rows()
+                 << " bytes/row (" << FLAGS_results_dtype
+                 << (FLAGS_results_delta ? ", delta" : "") << "), wrote "
+                 << FLAGS_batch / (max(write_us, 1.0) * 1e-6) << " rows/s\n";
+            failed = VerifyBatch(FLAGS_dtf, readback.data(), 0, FLAGS_batch, per_row,
+                                 ModelHash(h_model), &missing);
+            clog << "Results read back: " << (failed == 0 ? "PASS" : "FAIL") << " ("
+                 << FLAGS_batch - failed << "/" << FLAGS_batch << " samples)" << endl;
+        }
+    }
+
+    // Pre-screen: the batch with a share of trivial frames (zeros, saturated,
+    // flat) mixed in, through the full network vs behind the cascade
+    if (FLAGS_screen && FLAGS_batch > 0) {
+        if (FLAGS_screen_mix < 0.0 || FLAGS_screen_mix > 1.0) {
+            clog << "--screen_mix must be in [0, 1]\n";
+            return EXIT_FAILURE;
+        }
+        CpuConfig cfg;
+        if (FLAGS_autotune) cfg = AutotuneCpu(h_model, FLAGS_tune_cache, FLAGS_retune);
+        const int n = FLAGS_batch;
+        const float sat = FLAGS_screen_saturation >= 0 ? FLAGS_screen_saturation : 1.0f;
+        const float trivial_level[3] = {0.0f, sat, 1.0f / kInSize};
+        aligned_vector<float> in(size_t(n) * kInSize);
+        std::vector<bool> trivial(n);
+        int num_trivial = 0;
+        for (int s = 0; s < n; ++s) {
+            trivial[s] = int(s * FLAGS_screen_mix) != int((s + 1) * FLAGS_screen_mix);
+            float* x = in.data() + size_t(s) * kInSize;
+            if (trivial[s])
+                std::fill(x, x + kInSize, trivial_level[num_trivial++ % 3]);
+            else
+                std::copy(h_input.begin(), h_input.end(), x);
+        }
+
+        aligned_vector<float> full_out(size_t(n) * kOutSize), out(size_t(n) * kOutSize);
+        std::vector<int> routes(n);
+        ScreenStats stats;
+        const auto full_begin = steady_clock::now();
+        CnnBatch(in.data(), n, h_model, cfg, full_out.data());
+        const auto full_end = steady_clock::now();
+        CnnBatchScreened(in.data(), n, h_model, cfg, screen, out.data(), routes.data(), &stats);
+        const auto screen_end = steady_clock::now();
+        const double full_us = duration_cast<microseconds>(full_end - full_begin).count();
+        const double screen_us = duration_cast<microseconds>(screen_end - full_end).count();
+
+        clog << "Pre-screen: " << n << " samples (" << num_trivial << " trivial), routes";
+        for (int r = 0; r < kNumRoutes; ++r) clog << " " << kRouteNames[r] << " " << stats.count[r];
+        clog << "\n";
+        clog << "Pre-screen: " << n / (max(screen_us, 1.0) * 1e-6) << " samples/s vs "
+             << n / (max(full_us, 1.0) * 1e-6) << " samples/s without ("
+             << full_us / max(screen_us, 1.0) << "x)\n";
+
+        // Real frames must all run the network and match output.bin; the
+        // fast path of screened frames is compared with their full inference
+        aligned_vector<float> real_out;
+        int skipped_real = 0;
+        double fast_diff = 0;
+        for (int s = 0; s < n; ++s) {
+            const float* y = out.data() + size_t(s) * kOutSize;
+            if (!trivial[s]) {
+                if (routes[s] != kRouteFull) ++skipped_real;
+                real_out.insert(real_out.end(), y, y + kOutSize);
+            } else if (routes[s] != kRouteFull && FLAGS_screen_fast == "template") {
+                for (int i = 0; i < kOutSize; ++i)
+                    fast_diff = max(fast_diff,
+                                    double(std::fabs(y[i] - full_out[size_t(s) * kOutSize + i])));
+            }
+        }
+        const int real = int(real_out.size() / kOutSize);
+        bool missing;
+        const int failed =
+            real ? VerifyBatch(FLAGS_dtf, real_out.data(), 0, real, false, 0, &missing) : 0;
+        clog << "Pre-screen: " << skipped_real << "/" << real << " real frames screened out, "
+             << (failed == 0 ? "PASS" : "FAIL") << " (" << real - failed << "/" << real
+             << " real samples)";
+        if (FLAGS_screen_fast == "template")
+            clog << ", templates vs full inference max |diff| " << fast_diff;
+        clog << endl;
+    }
+
+    // Per-node engine: one client per NUMA node submits batches whose inputs
+    // live on that node, so every batch runs on local weights and workers
+    if (FLAGS_numa_batch > 0) {
+        CpuConfig cfg;
+        if (FLAGS_autotune) cfg = AutotuneCpu(h_model, FLAGS_tune_cache, FLAGS_retune);
+        NumaEngine engine;
+        string error;
+        if (!engine.Start(h_model, cfg, FLAGS_numa_threads, &error)) {
+            clog << error << "\n";
+            return EXIT_FAILURE;
+        }
+        const int n = FLAGS_numa_batch;
+        const int nodes = engine.nodes();
+        std::vector<float*> node_in(nodes), node_out(nodes);
+        bool per_row = false;
+        int workers = 0;
+        for (int i = 0; i < nodes; ++i) {
+            workers += engine.stats(i).workers;
+            node_in[i] = engine.Buffer(i, size_t(n) * kInSize);
+            node_out[i] = engine.Buffer(i, size_t(n) * kOutSize);
+            if (!node_in[i] || !node_out[i]) {
+                clog << "Cannot map the NUMA benchmark buffers of node "
+                     << engine.stats(i).node << "\n";
+                return EXIT_FAILURE;
+            }
+            per_row = LoadBatchInputs(FLAGS_dtf, h_input, n, node_in[i]);
+        }
+
+        const auto numa_begin = steady_clock::now();
+        std::vector<std::thread> clients;
+        for (int i = 0; i < nodes; ++i)
+            clients.emplace_back([&, i]() {
+                for (int r = 0; r < FLAGS_numa_rounds; ++r)
+                    engine.Run(node_in[i], n, node_out[i]);
+            });
+        for (auto & t : clients) t.join();
+        const double numa_s = duration_cast<microseconds>(steady_clock::now() - numa_begin).count() * 1e-6;
+
+        // Same work on the shared-model engine with as many threads
+        CpuConfig flat_cfg = cfg;
+        flat_cfg.threads = workers;
+        aligned_vector<float> flat_out(size_t(n) * kOutSize);
+        const auto flat_begin = steady_clock::now();
+        for (int r = 0; r < FLAGS_numa_rounds; ++r)
+            for (int i = 0; i < nodes; ++i)
+                CnnBatch(node_in[i], n, h_model, flat_cfg, flat_out.data());
+        const double flat_s = duration_cast<microseconds>(steady_clock::now() - flat_begin).count() * 1e-6;
+
+        const double total = double(n) * FLAGS_numa_rounds * nodes;
+        clog << "NUMA engine: " << nodes << " node" << (nodes > 1 ? "s" : "") << ", "
+             << workers << " pinned workers, " << total / numa_s << " samples/s vs "
+             << total / flat_s << " samples/s unpinned with one model copy\n";
+        for (int i = 0; i < nodes; ++i) {
+            const NumaEngine::NodeStats st = engine.stats(i);
+            bool missing;
+            const int failed =
+                VerifyBatch(FLAGS_dtf, node_out[i], 0, n, per_row, ModelHash(h_model), &missing);
+            clog << "  node " << st.node << ": " << st.workers << " workers, " << st.batches
+                 << " batches, " << st.samples / numa_s << " samples/s, busy "
+                 << 100.0 * st.busy_seconds / (max(st.workers, 1) * numa_s) << "%, weights "
+                 << 100.0 * st.local_weights << "% local, huge pages "
+                 << (st.huge_pages ? "advised" : "unavailable") << ", "
+                 << (missing ? "unverified" : failed == 0 ? "PASS" : "FAIL") << "\n";
+        }
+    }
+
+    // CnnBatchKernel is its own top: a hardware run (--btstm) needs its
+    // bitstream too, the CnnKernel one does not contain it
+    const bool batch_kernel = !FLAGS_batch_btstm.empty() || FLAGS_btstm.empty();
+    if (!batch_kernel && (FLAGS_pe_batch > 0 || FLAGS_split_batch > 0))
+        clog << "No --batch_btstm for the hardware run, skipping the PE batch and split "
+                "benchmarks\n";
+
+    // Multi-PE batch kernel: NUM_PE PEs sharing one weight broadcast
+    if (FLAGS_pe_batch > 0 && batch_kernel) {
+        const int n = FLAGS_pe_batch;
+        aligned_vector<float> pe_in(size_t(n) * kInSize);
+        aligned_vector<float> pe_out(size_t(n) * kOutSize);
+        const bool per_row = LoadBatchInputs(FLAGS_dtf, h_input, n, pe_in.data());
+        double pe_ns = tapa::invoke(
+            CnnBatchKernel, FLAGS_batch_btstm, n, kSplitDevice,
+            tapa::read_only_mmap<float>(pe_in),
+            tapa::read_only_mmap<float>(h_model.conv1_bias),
+            tapa::read_only_mmap<float>(h_model.conv2_bias),
+            tapa::read_only_mmap<float>(h_model.conv3_bias),
+            tapa::read_only_mmap<float>(h_model.conv1_weight),
+            tapa::read_only_mmap<float>(h_model.conv2_weight),
+            tapa::read_only_mmap<float>(h_model.conv3_weight),
+            tapa::read_only_mmap<float>(h_model.bn1_bias),
+            tapa::read_only_mmap<float>(h_model.bn2_bias),
+            tapa::read_only_mmap<float>(h_model.bn3_bias),
+            tapa::read_only_mmap<float>(h_model.bn1_weight),
+            tapa::read_only_mmap<float>(h_model.bn2_weight),
+            tapa::read_only_mmap<float>(h_model.bn3_weight),
+            tapa::read_only_mmap<float>(h_model.bn1_running_mean),
+            tapa::read_only_mmap<float>(h_model.bn2_running_mean),
+            tapa::read_only_mmap<float>(h_model.bn3_running_mean),
+            tapa::read_only_mmap<float>(h_model.bn1_running_var),
+            tapa::read_only_mmap<float>(h_model.bn2_running_var),
+            tapa::read_only_mmap<float>(h_model.bn3_running_var),
+            tapa::read_only_mmap<float>(h_model.fc1_bias),
+            tapa::read_only_mmap<float>(h_model.fc2_bias),
+            tapa::read_only_mmap<float>(h_model.fc1_weight),
+            tapa::read_only_mmap<float>(h_model.fc2_weight),
+            h_model.fc1_rank,
+            tapa::read_only_mmap<float>(h_model.fc1_u),
+            tapa::read_only_mmap<float>(h_model.fc1_v),
+            h_model.fc2_rank,
+            tapa::read_only_mmap<float>(h_model.fc2_u),
+            tapa::read_only_mmap<float>(h_model.fc2_v),
+            tapa::write_only_mmap<float>(pe_out));
+        bool missing;
+        int failed =
+            VerifyBatch(FLAGS_dtf, pe_out.data(), 0, n, per_row, ModelHash(h_model), &missing);
+        // Each round of NUM_PE samples reads the FC weights from DRAM once
+        auto fc_floats = [](int rank, int in_size, int out_size) {
+            return double(rank > 0 ? rank * (in_size + out_size) : in_size * out_size);
+        };
+        const double rounds = (n + NUM_PE - 1) / NUM_PE;
+        const double weight_kb = rounds * sizeof(float) / 1024.0 *
+            (fc_floats(h_model.fc1_rank, LinearSize1, LinearSize2) +
+             fc_floats(h_model.fc2_rank, LinearSize2, kOutSize));
+        clog << "PE batch kernel: " << NUM_PE << " PEs, " << n << " samples in "
+             << pe_ns * 1e-6 << " ms, " << n / (pe_ns * 1e-9) << " samples/s, "
+             << weight_kb / n << " KB FC weight reads/sample, "
+             << (failed == 0 ? "PASS" : "FAIL") << " (" << n - failed << "/" << n
+             << " samples)" << endl;
+    }
+
+    // Device/CPU split: the device runs the layers up to each boundary and
+    // streams the boundary activations back, the CPU engine finishes them
+    if (FLAGS_split_batch > 0 && batch_kernel) {
+        CpuConfig cfg;
+        if (FLAGS_autotune) cfg = AutotuneCpu(h_model, FLAGS_tune_cache, FLAGS_retune);
+        const int n = FLAGS_split_batch;
+        aligned_vector<float> in(size_t(n) * kInSize), out(size_t(n) * kOutSize);
+        const bool per_row = LoadBatchInputs(FLAGS_dtf, h_input, n, in.data());
+        clog << "Split: " << n << " samples, " << FLAGS_split_chunk << " per device run"
+             << (FLAGS_batch_btstm.empty() ? " (software simulation: device times are host times)"
+                                           : "")
+             << "\n";
+        for (int split = kSplitCpu; split <= kSplitDevice; ++split) {
+            if (FLAGS_split >= 0 && split != FLAGS_split) continue;
+            SplitStats st;
+            string error;
+            if (!RunSplit(FLAGS_batch_btstm, h_model, cfg, split, in.data(), n, FLAGS_split_chunk,
+                          out.data(), &st, &error)) {
+                clog << error << "\n";
+                return EXIT_FAILURE;
+            }
+            bool missing;
+            const int failed =
+                VerifyBatch(FLAGS_dtf, out.data(), 0, n, per_row, ModelHash(h_model), &missing);
+            const double busy = st.device_seconds + st.cpu_seconds;
+            clog << "  split " << kSplitNames[split] << ": " << n / st.wall_seconds
+                 << " samples/s, device " << st.device_seconds * 1e3 << " ms, CPU "
+                 << st.cpu_seconds * 1e3 << " ms, wall " << st.wall_seconds * 1e3
+                 << " ms (overlap " << (busy > 0 ? busy / st.wall_seconds : 0) << "x), "
+                 << st.bytes_back / n << " bytes/sample back, "
+                 << (missing ? "unverified" : failed == 0 ? "PASS" : "FAIL") << endl;
+        }
+    }
+
+    // Hot swap: keep serving batches from the registry while a new model
+    // loads in the background, then A/B the two models side by side
+    if (!FLAGS_swap_dtf.empty()) {
+        ModelRegistry registry(FLAGS_wino_m2, FLAGS_wino_m3);
+        string why;
+        if (!registry.Publish("serving", h_model, FLAGS_dtf, &why)) {
+            clog << "Registry: cannot publish " << FLAGS_dtf << ": " << why << "\n";
+            return EXIT_FAILURE;
+        }
+        const int slot = registry.Slot("serving");
+        const int n = max(FLAGS_swap_batch, 1);
+        aligned_vector<float> swap_in(size_t(n) * kInSize);
+        for (int s = 0; s < n; ++s)
+            std::copy(h_input.begin(), h_input.end(), swap_in.begin() + s * kInSize);
+
+        // Served until 10 batches ran on whatever the slot holds after the load
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> swapped_to(0);
+        std::map<uint64_t, int> served;  // version -> batches
+        double max_batch_us = 0;
+        std::thread server([&]() {
+            aligned_vector<float> swap_out(size_t(n) * kOutSize);
+            int after_swap = 0;
+            while (!stop.load() || after_swap < 10) {
+                const auto t0 = steady_clock::now();
+                uint64_t version;
+                {
+                    ModelRegistry::ReadGuard guard(registry);
+                    const RegisteredModel* m = guard.get(slot);
+                    CnnBatch(swap_in.data(), n, m->model, CpuConfig(), swap_out.data());
+                    version = m->version;
+                }
+                const double us = duration_cast<microseconds>(steady_clock::now() - t0).count();
+                if (us > max_batch_us) max_batch_us = us;
+                ++served[version];
+                if (swapped_to.load() != 0 && version == swapped_to.load()) ++after_swap;
+            }
+        });
+
+        registry.LoadAsync("serving", FLAGS_swap_dtf);
+        for (const string & e : registry.WaitForLoads())
+            clog << "Registry: load failed, still serving the old model (" << e << ")\n";
+        {
+            ModelRegistry::ReadGuard guard(registry);
+            swapped_to = guard.get(slot)->version;
+        }
+        stop = true;
+        server.join();
+        for (const auto & v : served)
+            clog << "Registry: model version " << v.first << " served " << v.second
+                 << " batches of " << n << "\n";
+        clog << "Registry: max batch latency across the swap " << max_batch_us * 1e-3 << " ms\n";
+
+        // A/B: the original and the swapped-in model resident side by side
+        if (registry.Publish("a", h_model, FLAGS_dtf, &why)) {
+            registry.LoadAsync("b", FLAGS_swap_dtf);
+            registry.WaitForLoads();
+            ModelRegistry::ReadGuard guard(registry);
+            const RegisteredModel* a = guard.get(registry.Slot("a"));
+            const RegisteredModel* b = guard.get(registry.Slot("b"));
+            if (a && b) {
+                aligned_vector<float> out_a(kOutSize), out_b(kOutSize);
+                aligned_vector<int> nnz(kNnzStats);
+                CnnSequential(h_input, a->model, out_a, nnz);
+                CnnSequential(h_input, b->model, out_b, nnz);
+                double max_diff = 0;
+                for (int i = 0; i < kOutSize; ++i)
+                    max_diff = max(max_diff, double(std::fabs(out_a[i] - out_b[i])));
+                int err_a = Verify(FLAGS_dtf, out_a);
+                int err_b = Verify(FLAGS_dtf, out_b);
+                clog << "A/B: " << FLAGS_dtf << " vs " << FLAGS_swap_dtf << ", max |diff| "
+                     << max_diff << ", Verify pass rate A "
+                     << 100.0 * (kOutSize - err_a) / kOutSize << "%, B "
+                     << 100.0 * (kOutSize - err_b) / kOutSize << "%\n";
+            }
+        }
+    }
+
+    // The kernel's Winograd tiles are fixed at build time (WINO_M2 / WINO_M3)
+    aligned_vector<float> k_conv2_wino = h_model.conv2_wino;
+    aligned_vector<float> k_conv3_wino = h_model.conv3_wino;
+    if (h_model.conv2_tile != WINO_M2 || h_model.conv3_tile != WINO_M3) {
+        CnnModel km = h_model;
+        string error;
+        PrepareWinograd(km, WINO_M2, WINO_M3, &error);
+        k_conv2_wino = km.conv2_wino;
+        k_conv3_wino = km.conv3_wino;
+    }
 
     // FPGA kernel invocation
     double time_taken = tapa::invoke(
         CnnKernel, FLAGS_btstm,
         tapa::read_only_mmap<float>(h_input),
-        tapa::read_only_mmap<float>(h_conv1_bias),
-        tapa::read_only_mmap<float>(h_conv2_bias),
-        tapa::read_only_mmap<float>(h_conv3_bias),
-        tapa::read_only_mmap<float>(h_conv1_weight),
-        tapa::read_only_mmap<float>(h_conv2_weight),
-        tapa::read_only_mmap<float>(h_conv3_weight),
-        tapa::read_only_mmap<float>(h_bn1_bias),
-        tapa::read_only_mmap<float>(h_bn2_bias),
-        tapa::read_only_mmap<float>(h_bn3_bias),
-        tapa::read_only_mmap<float>(h_bn1_weight),
-        tapa::read_only_mmap<float>(h_bn2_weight),
-        tapa::read_only_mmap<float>(h_bn3_weight),
-        tapa::read_only_mmap<float>(h_bn1_running_mean),
-        tapa::read_only_mmap<float>(h_bn2_running_mean),
-        tapa::read_only_mmap<float>(h_bn3_running_mean),
-        tapa::read_only_mmap<float>(h_bn1_running_var),
-        tapa::read_only_mmap<float>(h_bn2_running_var),
-        tapa::read_only_mmap<float>(h_bn3_running_var),
-        tapa::read_only_mmap<float>(h_fc1_bias),
-        tapa::read_only_mmap<float>(h_fc2_bias),
-        tapa::read_only_mmap<float>(h_fc1_weight),
-        tapa::read_only_mmap<float>(h_fc2_weight),
-        tapa::write_only_mmap<float>(d_output)
+        FLAGS_raw ? kInputRaw : kInputFloat,
+        tapa::read_only_mmap<uint16_t>(h_raw),
+        tapa::read_only_mmap<float>(h_model.calib_dark),
+        tapa::read_only_mmap<float>(h_model.calib_gain),
+        tapa::read_only_mmap<float>(h_model.calib_scale),
+        tapa::read_only_mmap<float>(h_model.calib_shift),
+        tapa::read_only_mmap<float>(screen.params),
+        tapa::read_only_mmap<float>(screen.templates),
+        tapa::read_only_mmap<float>(h_model.conv1_bias),
+        tapa::read_only_mmap<float>(h_model.conv2_bias),
+        tapa::read_only_mmap<float>(h_model.conv3_bias),
+        tapa::read_only_mmap<float>(h_model.conv1_weight),
+        tapa::read_only_mmap<float>(h_model.conv2_weight),
+        tapa::read_only_mmap<float>(h_model.conv3_weight),
+        tapa::read_only_mmap<float>(k_conv2_wino),
+        tapa::read_only_mmap<float>(k_conv3_wino),
+        tapa::read_only_mmap<float>(h_model.bn1_bias),
+        tapa::read_only_mmap<float>(h_model.bn2_bias),
+        tapa::read_only_mmap<float>(h_model.bn3_bias),
+        tapa::read_only_mmap<float>(h_model.bn1_weight),
+        tapa::read_only_mmap<float>(h_model.bn2_weight),
+        tapa::read_only_mmap<float>(h_model.bn3_weight),
+        tapa::read_only_mmap<float>(h_model.bn1_running_mean),
+        tapa::read_only_mmap<float>(h_model.bn2_running_mean),
+        tapa::read_only_mmap<float>(h_model.bn3_running_mean),
+        tapa::read_only_mmap<float>(h_model.bn1_running_var),
+        tapa::read_only_mmap<float>(h_model.bn2_running_var),
+        tapa::read_only_mmap<float>(h_model.bn3_running_var),
+        tapa::read_only_mmap<float>(h_model.fc1_bias),
+        tapa::read_only_mmap<float>(h_model.fc2_bias),
+        tapa::read_only_mmap<float>(h_model.fc1_weight),
+        tapa::read_only_mmap<float>(h_model.fc2_weight),
+        h_model.fc1_rank,
+        tapa::read_only_mmap<float>(h_model.fc1_u),
+        tapa::read_only_mmap<float>(h_model.fc1_v),
+        h_model.fc2_rank,
+        tapa::read_only_mmap<float>(h_model.fc2_u),
+        tapa::read_only_mmap<float>(h_model.fc2_v),
+        output_mode, FLAGS_num_peaks,
+        tapa::write_only_mmap<float>(d_output),
+        tapa::write_only_mmap<float>(d_peaks),
+        tapa::write_only_mmap<uint16_t>(d_output_half),
+        tapa::write_only_mmap<int>(d_nnz),
+        tapa::write_only_mmap<int>(d_route)
     );
     time_taken *= 1e-6; // total time in mini second
     printf("Kernel time is %f ms\n", time_taken * 1000);
+    report_sparsity("Kernel", d_nnz);
+    if (FLAGS_screen) clog << "Kernel pre-screen route: " << kRouteNames[d_route[0]] << "\n";
+
+    // Analytical estimate for the knobs this kernel was built with and the
+    // sparsity it just saw (kernel_model explores other knobs offline)
+    {
+        KernelKnobs knobs;
+        KernelWorkload work;
+        work.fc1_active = d_nnz[0];
+        work.fc2_active = d_nnz[1];
+        work.fc1_rank = h_model.fc1_rank;
+        work.fc2_rank = h_model.fc2_rank;
+        const KernelEstimate est = EstimateKernel(knobs, work);
+        clog << "Kernel model: " << est.cycles << " cycles, " << est.seconds(knobs) * 1e3
+             << " ms at " << knobs.clock_mhz << " MHz, " << est.dsp << " DSP, "
+             << est.bram18 << " BRAM18 (" << DescribeKnobs(knobs) << ")";
+        if (FLAGS_btstm.empty())
+            clog << "; software simulation runs on the host, compare against hw_emu or hardware\n";
+        else
+            // time_taken is in ms by now (see above), compare ms to ms
+            clog << ", measured/model " << time_taken / (est.seconds(knobs) * 1e3) << "\n";
+    }
+
+    // Bytes leaving the device per sample in the selected format
+    size_t out_bytes = kOutSize * sizeof(float);
+    if (output_mode == kOutputPeaks) out_bytes = FLAGS_num_peaks * kPeakFields * sizeof(float);
+    if (output_mode == kOutputHalf) out_bytes = kOutSize * sizeof(uint16_t);
+    clog << "Output: " << FLAGS_output_mode << ", " << out_bytes << " bytes/sample ("
+         << double(kOutSize * sizeof(float)) / out_bytes << "x less than fp32)\n";
 
-    // Verification
-    int error = Verify(FLAGS_dtf, d_output);
+    // Verification; a fast-path result is not the network's output
+    if (d_route[0] != kRouteFull) {
+        clog << "Kernel took the " << kRouteNames[d_route[0]] << " fast path";
+        if (FLAGS_screen_fast == "template" && output_mode == kOutputFull) {
+            const float* t = screen.templates.data() + d_route[0] * kOutSize;
+            int mismatched = 0;
+            for (int i = 0; i < kOutSize; ++i) mismatched += d_output[i] != t[i];
+            clog << ", template " << (mismatched == 0 ? "PASS" : "FAIL") << endl;
+            return mismatched == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        clog << ", output not checked against output.bin" << endl;
+        return EXIT_SUCCESS;
+    }
+    int error;
+    if (output_mode == kOutputPeaks) {
+        for (int k = 0; k < FLAGS_num_peaks; ++k)
+            clog << "Peak " << k << ": index " << d_peaks[k * kPeakFields]
+                 << ", value " << d_peaks[k * kPeakFields + 1]
+                 << ", width " << d_peaks[k * kPeakFields + 2] << "\n";
+        error = VerifyPeaks(FLAGS_dtf, d_peaks, FLAGS_num_peaks);
+    } else {
+        if (output_mode == kOutputHalf)
+            for (int i = 0; i < kOutSize; ++i) d_output[i] = HalfToFloat(d_output_half[i]);
+        error = Verify(FLAGS_dtf, d_output);
+    }
     if (error != 0) {
         clog << "Found " << error << " error" << (error > 1 ? "s\n" : "\n");
         clog << "FAIL" << endl;
@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <tapa.h>
+#include "numa_engine.h"
+
+using std::string;
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+static std::vector<int> ParseCpuList(const string & list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        const size_t dash = range.find('-');
+        const int lo = std::stoi(range.substr(0, dash));
+        const int hi = dash == string::npos ? lo : std::stoi(range.substr(dash + 1));
+        for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+static string ReadLine(const string & path) {
+    std::ifstream in(path);
+    string line;
+    std::getline(in, line);
+    return line;
+}
+
+NumaTopology DetectNuma() {
+    NumaTopology topo;
+    const string online = ReadLine("/sys/devices/system/node/online");
+    if (!online.empty()) {
+        for (int node : ParseCpuList(online)) {
+            const string list =
+                ReadLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::vector<int> cpus = ParseCpuList(list);
+            if (cpus.empty()) continue;  // memory-only node
+            topo.nodes.push_back(node);
+            topo.cpus.push_back(cpus);
+        }
+    }
+    if (topo.nodes.empty()) {
+        const int n = max(int(std::thread::hardware_concurrency()), 1);
+        topo.nodes.push_back(0);
+        topo.cpus.emplace_back();
+        for (int c = 0; c < n; ++c) topo.cpus[0].push_back(c);
+    }
+    return topo;
+}
+
+static uintptr_t PageSize() {
+    static const uintptr_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+int NumaNodeOf(const void* p) {
+    void* page = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(p) & ~(PageSize() - 1));
+    int status = -1;
+    if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0) return -1;
+    return status >= 0 ? status : -1;
+}
+
+// Whole pages inside [p, p + bytes), as [*first, *first + *len)
+static bool InnerPages(const void* p, size_t bytes, uintptr_t* first, size_t* len) {
+    const uintptr_t page = PageSize();
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(p) + page - 1) & ~(page - 1);
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + bytes) & ~(page - 1);
+    if (end <= begin) return false;
+    *first = begin;
+    *len = end - begin;
+    return true;
+}
+
+// Binds the whole pages of [p, p + bytes) to node, moving any already
+// touched. Only used on regions the engine mapped itself (MapRegion): binding
+// heap memory would also pin whatever the allocator places next to it.
+static bool NumaBind(const void* p, size_t bytes, int node) {
+    uintptr_t first;
+    size_t len;
+    if (!InnerPages(p, bytes, &first, &len)) return true;  // nothing page-sized to move
+    const int kMaskBits = 1024;
+    if (node < 0 || node >= kMaskBits) return false;
+    unsigned long mask[kMaskBits / (8 * sizeof(unsigned long))] = {};
+    mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, first, len, MPOL_BIND, mask, kMaskBits + 1, MPOL_MF_MOVE) == 0;
+}
+
+bool TransparentHugePages() {
+    const string mode = ReadLine("/sys/kernel/mm/transparent_hugepage/enabled");
+    return mode.find("[always]") != string::npos || mode.find("[madvise]") != string::npos;
+}
+
+// Anonymous mapping owned by the engine
+struct Region {
+    char* base = nullptr;
+    size_t size = 0;
+};
+
+// Region of at least bytes bound to node, advised onto huge pages when thp.
+// Sets *advised to whether madvise took; false if mmap fails.
+static bool MapRegion(size_t bytes, int node, bool thp, Region* r, bool* advised) {
+    const size_t size = (max(bytes, size_t(1)) + PageSize() - 1) & ~(PageSize() - 1);
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return false;
+    *advised = thp && madvise(p, size, MADV_HUGEPAGE) == 0;
+    NumaBind(p, size, node);  // best effort, CountLocalPages reports the outcome
+    r->base = static_cast<char*>(p);
+    r->size = size;
+    return true;
+}
+
+static void UnmapRegion(Region* r) {
+    if (r->base) munmap(r->base, r->size);
+    *r = Region();
+}
+
+// Arrays packed into a replica start on cache lines
+static size_t CacheLines(size_t bytes) {
+    return (bytes + 63) & ~size_t(63);
+}
+
+// Whole pages of [p, p + bytes) on node, added to *local out of *total
+static void CountLocalPages(const void* p, size_t bytes, int node,
+                            size_t* local, size_t* total) {
+    uintptr_t first;
+    size_t len;
+    if (!InnerPages(p, bytes, &first, &len)) return;
+    const size_t count = len / PageSize();
+    std::vector<void*> pages(count);
+    std::vector<int> status(count, -1);
+    for (size_t i = 0; i < count; ++i)
+        pages[i] = reinterpret_cast<void*>(first + i * PageSize());
+    if (syscall(SYS_move_pages, 0, count, pages.data(), nullptr, status.data(), 0) != 0) return;
+    for (int s : status) *local += s == node;
+    *total += count;
+}
+
+static void PinToCpus(const std::vector<int> & cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);  // best effort
+}
+
+struct NumaEngine::Job {
+    const float* inputs;
+    float* outputs;
+    int n;
+    int blocks;
+    int next = 0;  // guarded by the node mutex
+    std::atomic<int> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+};
+
+struct NumaEngine::Node {
+    int id = 0;
+    std::vector<int> cpus;
+    Region replica;                // the node's copy of every weight array
+    CnnWeightView weights;         // points into replica
+    std::vector<Region> buffers;   // handed out by Buffer
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;  // queue, stop
+    std::condition_variable wake;
+    std::deque<Job*> queue;
+    bool stop = false;
+
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> busy_ns{0};
+    double local_weights = 0;
+    bool huge_pages = false;
+
+    ~Node() {
+        UnmapRegion(&replica);
+        for (auto & r : buffers) UnmapRegion(&r);
+    }
+};
+
+NumaEngine::NumaEngine() = default;
+
+NumaEngine::~NumaEngine() {
+    for (auto & node : nodes_) {
+        {
+            std::lock_guard<std::mutex> lock(node->mutex);
+            node->stop = true;
+        }
+        node->wake.notify_all();
+        for (auto & t : node->workers) t.join();
+    }
+}
+
+bool NumaEngine::Start(const CnnModel & model, const CpuConfig & cfg, int threads_per_node,
+                       string* error) {
+    if (!nodes_.empty()) {
+        *error = "NumaEngine already started";
+        return false;
+    }
+    cfg_ = cfg;
+    cfg_.threads = 1;  // every worker runs its blocks alone
+    const NumaTopology topo = DetectNuma();
+    const bool thp = TransparentHugePages();
+
+    for (size_t i = 0; i < topo.nodes.size(); ++i) {
+        std::unique_ptr<Node> node(new Node());
+        node->id = topo.nodes[i];
+        node->cpus = topo.cpus[i];
+
+        // Copy the weights into a region mapped and bound for the node, on
+        // the node's CPUs
+        Node* n = node.get();
+        bool mapped = false;
+        std::thread replicate([n, &model, thp, &mapped]() {
+            PinToCpus(n->cpus);
+            CnnWeightView & w = n->weights;
+            w = ViewWeights(model);  // tiles and ranks; every pointer is replaced
+            const std::pair<const float**, const aligned_vector<float>*> arrays[] = {
+                {&w.conv1_bias, &model.conv1_bias},
+                {&w.conv2_bias, &model.conv2_bias},
+                {&w.conv3_bias, &model.conv3_bias},
+                {&w.conv1_weight, &model.conv1_weight},
+                {&w.conv2_weight, &model.conv2_weight},
+                {&w.conv3_weight, &model.conv3_weight},
+                {&w.conv2_wino, &model.conv2_wino},
+                {&w.conv3_wino, &model.conv3_wino},
+                {&w.bn1_bias, &model.bn1_bias},
+                {&w.bn2_bias, &model.bn2_bias},
+                {&w.bn3_bias, &model.bn3_bias},
+                {&w.bn1_weight, &model.bn1_weight},
+                {&w.bn2_weight, &model.bn2_weight},
+                {&w.bn3_weight, &model.bn3_weight},
+                {&w.bn1_running_mean, &model.bn1_running_mean},
+                {&w.bn2_running_mean, &model.bn2_running_mean},
+                {&w.bn3_running_mean, &model.bn3_running_mean},
+                {&w.bn1_running_var, &model.bn1_running_var},
+                {&w.bn2_running_var, &model.bn2_running_var},
+                {&w.bn3_running_var, &model.bn3_running_var},
+                {&w.fc1_bias, &model.fc1_bias},
+                {&w.fc2_bias, &model.fc2_bias},
+                {&w.fc1_weight, &model.fc1_weight},
+                {&w.fc2_weight, &model.fc2_weight},
+                {&w.fc1_u, &model.fc1_u},
+                {&w.fc1_v, &model.fc1_v},
+                {&w.fc2_u, &model.fc2_u},
+                {&w.fc2_v, &model.fc2_v},
+            };
+            size_t bytes = 0;
+            for (const auto & a : arrays) bytes += CacheLines(a.second->size() * sizeof(float));
+            bool advised = false;
+            if (!MapRegion(bytes, n->id, thp, &n->replica, &advised)) return;
+            char* next = n->replica.base;
+            for (const auto & a : arrays) {
+                const size_t size = a.second->size() * sizeof(float);
+                memcpy(next, a.second->data(), size);
+                *a.first = reinterpret_cast<const float*>(next);
+                next += CacheLines(size);
+            }
+            size_t local = 0, total = 0;
+            CountLocalPages(n->replica.base, n->replica.size, n->id, &local, &total);
+            mapped = true;
+            n->local_weights = total ? double(local) / total : 1.0;
+            n->huge_pages = advised;
+        });
+        replicate.join();
+        if (!mapped) {
+            *error = "Cannot map the weight replica of NUMA node " + std::to_string(n->id);
+            return false;
+        }
+
+        const int workers = threads_per_node > 0 ? threads_per_node : int(node->cpus.size());
+        for (int w = 0; w < workers; ++w)
+            node->workers.emplace_back([this, n]() {
+                PinToCpus(n->cpus);
+                Work(*n);
+            });
+        nodes_.push_back(std::move(node));
+    }
+    return true;
+}
+
+void NumaEngine::Work(Node & node) {
+    for (;;) {
+        Job* job;
+        int b;
+        {
+            std::unique_lock<std::mutex> lock(node.mutex);
+            node.wake.wait(lock, [&] { return node.stop || !node.queue.empty(); });
+            if (node.queue.empty()) return;  // stopping
+            job = node.queue.front();
+            b = job->next++;
+            if (job->next == job->blocks) node.queue.pop_front();
+        }
+
+        const auto begin = std::chrono::steady_clock::now();
+        const int block = max(cfg_.batch_block, 1);
+        const int first = b * block;
+        const int rows = std::min(block, job->n - first);
+        CnnBatch(job->inputs + size_t(first) * kInSize, rows, node.weights, cfg_,
+                 job->outputs + size_t(first) * kOutSize);
+        node.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - begin).count();
+
+        if (--job->remaining == 0) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->finished = true;
+            job->done.notify_all();
+        }
+    }
+}
+
+void NumaEngine::Run(const float* inputs, int n, float* outputs) {
+    if (n <= 0 || nodes_.empty()) return;
+    const int owner = NumaNodeOf(inputs);
+    Node* node = nullptr;
+    for (auto & candidate : nodes_)
+        if (candidate->id == owner) node = candidate.get();
+    if (!node) node = nodes_[next_node_++ % nodes_.size()].get();
+
+    Job job;
+    job.inputs = inputs;
+    job.outputs = outputs;
+    job.n = n;
+    job.blocks = (n + max(cfg_.batch_block, 1) - 1) / max(cfg_.batch_block, 1);
+    job.remaining = job.blocks;
+    {
+        std::lock_guard<std::mutex> lock(node->mutex);
+        node->queue.push_back(&job);
+    }
+    node->wake.notify_all();
+
+    std::unique_lock<std::mutex> lock(job.mutex);
+    job.done.wait(lock, [&] { return job.finished; });
+    ++node->batches;
+    node->samples += n;
+}
+
+float* NumaEngine::Buffer(int i, size_t count) {
+    Node & node = *nodes_[i];
+    Region r;
+    bool advised;
+    if (!MapRegion(count * sizeof(float), node.id, false, &r, &advised)) return nullptr;
+    node.buffers.push_back(r);
+    return reinterpret_cast<float*>(r.base);
+}
+
+NumaEngine::NodeStats NumaEngine::stats(int i) const {
+    const Node & node = *nodes_[i];
+    NodeStats s;
+    s.node = node.id;
+    s.workers = int(node.workers.size());
+    s.batches = node.batches;
+    s.samples = node.samples;
+    s.busy_seconds = node.busy_ns * 1e-9;
+    s.local_weights = node.local_weights;
+    s.huge_pages = node.huge_pages;
+    return s;
+}
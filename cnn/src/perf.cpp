@@ -0,0 +1,118 @@
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf.h"
+
+using std::string;
+
+const char* const kProfiledLayerNames[kNumProfiledLayers] = {
+    "conv1", "conv2", "conv3", "fc1", "fc2", "rms"};
+
+static const char* const kEventNames[kNumPerfEvents] = {
+    "cycles", "instructions", "L1D misses", "LLC misses"};
+
+PerfReading PerfReading::operator-(const PerfReading & o) const {
+    PerfReading d;
+    for (int e = 0; e < kNumPerfEvents; ++e) d.count[e] = count[e] - o.count[e];
+    d.seconds = seconds - o.seconds;
+    return d;
+}
+
+PerfReading & PerfReading::operator+=(const PerfReading & o) {
+    for (int e = 0; e < kNumPerfEvents; ++e) count[e] += o.count[e];
+    seconds += o.seconds;
+    return *this;
+}
+
+static int OpenEvent(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;          // include worker threads spawned later
+    attr.exclude_kernel = 1;   // allowed at perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0 /* this thread */, -1, -1, 0);
+}
+
+PerfCounters::PerfCounters() {
+    const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint32_t types[kNumPerfEvents] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[kNumPerfEvents] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, l1d_read_miss,
+        PERF_COUNT_HW_CACHE_MISSES};
+
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+        fd_[e] = OpenEvent(types[e], configs[e]);
+        if (fd_[e] < 0) {
+            if (!error_.empty()) error_ += ", ";
+            error_ += string(kEventNames[e]) + ": " + strerror(errno);
+            continue;
+        }
+        ioctl(fd_[e], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (int e = 0; e < kNumPerfEvents; ++e)
+        if (fd_[e] >= 0) close(fd_[e]);
+}
+
+bool PerfCounters::any_available() const {
+    for (int e = 0; e < kNumPerfEvents; ++e)
+        if (fd_[e] >= 0) return true;
+    return false;
+}
+
+PerfReading PerfCounters::Read() const {
+    PerfReading r;
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+        uint64_t value = 0;
+        if (fd_[e] >= 0 && read(fd_[e], &value, sizeof(value)) == sizeof(value))
+            r.count[e] = value;
+    }
+    r.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    return r;
+}
+
+string FormatPerf(const PerfCounters & counters, const PerfReading & d,
+                  double samples, double flops) {
+    std::ostringstream os;
+    os << d.seconds * 1e6 / samples << " us/sample, "
+       << (d.seconds > 0 ? flops / d.seconds * 1e-9 : 0) << " GFlops";
+    if (counters.available(kPerfCycles) && counters.available(kPerfInstructions) &&
+        d.count[kPerfCycles] > 0)
+        os << ", IPC " << double(d.count[kPerfInstructions]) / d.count[kPerfCycles];
+    if (counters.available(kPerfL1dMisses))
+        os << ", L1D misses/sample " << d.count[kPerfL1dMisses] / samples;
+    if (counters.available(kPerfLlcMisses)) {
+        os << ", LLC misses/sample " << d.count[kPerfLlcMisses] / samples;
+        if (d.seconds > 0)
+            os << ", ~" << d.count[kPerfLlcMisses] * 64.0 / d.seconds * 1e-9 << " GB/s";
+    }
+    return os.str();
+}
+
+double ProfiledLayerFlops(int layer) {
+    switch (layer) {
+        case kProfConv1: return 2.0 * kChannels1 * kInSize * kKernel1;
+        case kProfConv2: return 2.0 * kChannels2 * kSize2 * kChannels1 * kKernel2;
+        case kProfConv3: return 2.0 * kChannels3 * kSize3 * kChannels2 * kKernel3;
+        case kProfFc1:   return 2.0 * LinearSize2 * LinearSize1;
+        case kProfFc2:   return 2.0 * kOutSize * LinearSize2;
+        default:         return 2.0 * kOutSize;
+    }
+}
@@ -0,0 +1,344 @@
+// Python bindings: `import pycnn` after `make pycnn`.
+//
+//   model = pycnn.Model("./data")                  # or Model(dir, tune_cache=path)
+//   x = np.ascontiguousarray(spectra, np.float32)   # (N, 41); torch: t.numpy()
+//   y = np.empty((len(x), 1000), np.float32)
+//   model.infer(x, y)                               # batched CPU engine
+//   model.infer_kernel(x, y, bitstream="")          # TAPA path, csim if empty
+//   model.infer_raw(frames, y)                      # uint16 (N, 328) detector
+//   model.infer_kernel(frames, y, raw=True)         # frames, calibrated in-engine
+//
+// Inputs and outputs go through the buffer protocol and are never copied:
+// the engines read and write the caller's memory directly, with the GIL
+// released. Torch CPU tensors share memory with `t.numpy()`.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string>
+
+#include "cnn.h"
+#include "tune.h"
+
+using std::string;
+
+namespace {
+
+struct PyModel {
+    PyObject_HEAD
+    CnnModel* model;
+    CpuConfig* config;
+    uint64_t hash;
+};
+
+// Borrows a C-contiguous (rows, cols) buffer of float32 ('f') or uint16
+// ('H'); sets a Python exception and returns false when obj is anything else
+bool GetMatrix(PyObject* obj, char type, int cols, bool writable, const char* what,
+               Py_buffer* view, Py_ssize_t* rows) {
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+    if (PyObject_GetBuffer(obj, view, flags) != 0) return false;
+    const char* fmt = view->format ? view->format : "B";
+    if (*fmt == '<' || *fmt == '=' || *fmt == '@') ++fmt;
+    const Py_ssize_t itemsize = type == 'f' ? sizeof(float) : sizeof(uint16_t);
+    if (fmt[0] != type || fmt[1] != '\0' || view->itemsize != itemsize) {
+        PyErr_Format(PyExc_TypeError, "%s must be %s, got format '%s'", what,
+                     type == 'f' ? "float32" : "uint16", view->format ? view->format : "B");
+    } else if (view->ndim != 2 || view->shape[1] != cols) {
+        PyErr_Format(PyExc_ValueError, "%s must have shape (N, %d)", what, cols);
+    } else {
+        *rows = view->shape[0];
+        return true;
+    }
+    PyBuffer_Release(view);
+    return false;
+}
+
+// Both matrices of an inference call, released together
+struct Batch {
+    Py_buffer in, out;
+    Py_ssize_t n = 0;
+
+    bool Get(PyObject* inputs, PyObject* outputs, bool raw = false) {
+        Py_ssize_t n_out;
+        if (!GetMatrix(inputs, raw ? 'H' : 'f', raw ? kRawSize : kInSize, false,
+                       raw ? "frames" : "inputs", &in, &n))
+            return false;
+        if (!GetMatrix(outputs, 'f', kOutSize, true, "outputs", &out, &n_out)) {
+            PyBuffer_Release(&in);
+            return false;
+        }
+        if (n_out != n) {
+            PyErr_Format(PyExc_ValueError, "outputs has %zd rows, inputs has %zd", n_out, n);
+            Release();
+            return false;
+        }
+        return true;
+    }
+    void Release() {
+        PyBuffer_Release(&in);
+        PyBuffer_Release(&out);
+    }
+    const float* input() const { return static_cast<const float*>(in.buf); }
+    const uint16_t* frames() const { return static_cast<const uint16_t*>(in.buf); }
+    float* output() const { return static_cast<float*>(out.buf); }
+};
+
+int Model_init(PyModel* self, PyObject* args, PyObject* kwds) {
+    static const char* kwlist[] = {"data_dir", "tune_cache", nullptr};
+    const char* data_dir;
+    const char* tune_cache = nullptr;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", const_cast<char**>(kwlist),
+                                     &data_dir, &tune_cache))
+        return -1;
+
+    CnnModel* model = new CnnModel();
+    CpuConfig* config = new CpuConfig();
+    string error;
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    // Winograd tiles as built, so the CPU engine and the kernel agree
+    ok = LoadModel(data_dir, *model, &error) &&
+         PrepareWinograd(*model, WINO_M2, WINO_M3, &error);
+    if (ok) {
+        if (tune_cache) *config = AutotuneCpu(*model, tune_cache);
+        self->hash = ModelHash(*model);
+    }
+    Py_END_ALLOW_THREADS
+    if (!ok) {
+        delete model;
+        delete config;
+        PyErr_SetString(PyExc_OSError, error.c_str());
+        return -1;
+    }
+    delete self->model;
+    delete self->config;
+    self->model = model;
+    self->config = config;
+    return 0;
+}
+
+void Model_dealloc(PyModel* self) {
+    delete self->model;
+    delete self->config;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+bool CheckLoaded(PyModel* self) {
+    if (self->model) return true;
+    PyErr_SetString(PyExc_RuntimeError, "Model was not initialized");
+    return false;
+}
+
+bool CheckCalib(PyModel* self) {
+    if (self->model->has_calib) return true;
+    PyErr_SetString(PyExc_RuntimeError,
+                    "raw frames need calib_*.bin next to the weights (scripts/calib_to_bin.py)");
+    return false;
+}
+
+PyObject* Model_infer(PyModel* self, PyObject* args, PyObject* kwds) {
+    static const char* kwlist[] = {"inputs", "outputs", "threads", nullptr};
+    PyObject *inputs, *outputs;
+    int threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", const_cast<char**>(kwlist),
+                                     &inputs, &outputs, &threads))
+        return nullptr;
+    if (!CheckLoaded(self)) return nullptr;
+    Batch batch;
+    if (!batch.Get(inputs, outputs)) return nullptr;
+
+    CpuConfig config = *self->config;
+    if (threads > 0) config.threads = threads;
+    Py_BEGIN_ALLOW_THREADS
+    CnnBatch(batch.input(), int(batch.n), *self->model, config, batch.output());
+    Py_END_ALLOW_THREADS
+    batch.Release();
+    Py_RETURN_NONE;
+}
+
+PyObject* Model_infer_raw(PyModel* self, PyObject* args, PyObject* kwds) {
+    static const char* kwlist[] = {"frames", "outputs", "threads", nullptr};
+    PyObject *frames, *outputs;
+    int threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", const_cast<char**>(kwlist),
+                                     &frames, &outputs, &threads))
+        return nullptr;
+    if (!CheckLoaded(self) || !CheckCalib(self)) return nullptr;
+    Batch batch;
+    if (!batch.Get(frames, outputs, /*raw=*/true)) return nullptr;
+
+    CpuConfig config = *self->config;
+    if (threads > 0) config.threads = threads;
+    Py_BEGIN_ALLOW_THREADS
+    CnnBatchRaw(batch.frames(), int(batch.n), *self->model, config, batch.output());
+    Py_END_ALLOW_THREADS
+    batch.Release();
+    Py_RETURN_NONE;
+}
+
+PyObject* Model_infer_kernel(PyModel* self, PyObject* args, PyObject* kwds) {
+    static const char* kwlist[] = {"inputs", "outputs", "bitstream", "raw", nullptr};
+    PyObject *inputs, *outputs;
+    const char* bitstream = "";
+    int raw = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|sp", const_cast<char**>(kwlist),
+                                     &inputs, &outputs, &bitstream, &raw))
+        return nullptr;
+    if (!CheckLoaded(self) || (raw && !CheckCalib(self))) return nullptr;
+    Batch batch;
+    if (!batch.Get(inputs, outputs, raw)) return nullptr;
+
+    // The kernel takes one sample per invocation; rows map straight onto the
+    // caller's buffers, only the unused ports get scratch space
+    CnnModel & m = *self->model;
+    const string btstm = bitstream;
+    double kernel_ns = 0;
+    Py_BEGIN_ALLOW_THREADS
+    aligned_vector<float> peaks(kMaxPeaks * kPeakFields);
+    aligned_vector<uint16_t> output_half(kOutSize);
+    aligned_vector<int> nnz(kNnzStats);
+    aligned_vector<int> route(1);
+    ScreenTables no_screen;  // screening off: every row runs the network
+    aligned_vector<float> unused_input(kInSize);
+    aligned_vector<uint16_t> unused_raw(kRawSize);
+    for (Py_ssize_t s = 0; s < batch.n; ++s) {
+        float* in = raw ? unused_input.data()
+                        : const_cast<float*>(batch.input() + s * kInSize);
+        uint16_t* frame = raw ? const_cast<uint16_t*>(batch.frames() + s * kRawSize)
+                              : unused_raw.data();
+        kernel_ns += tapa::invoke(
+            CnnKernel, btstm,
+            tapa::read_only_mmap<float>(in, kInSize),
+            raw ? kInputRaw : kInputFloat,
+            tapa::read_only_mmap<uint16_t>(frame, kRawSize),
+            tapa::read_only_mmap<float>(m.calib_dark),
+            tapa::read_only_mmap<float>(m.calib_gain),
+            tapa::read_only_mmap<float>(m.calib_scale),
+            tapa::read_only_mmap<float>(m.calib_shift),
+            tapa::read_only_mmap<float>(no_screen.params),
+            tapa::read_only_mmap<float>(no_screen.templates),
+            tapa::read_only_mmap<float>(m.conv1_bias),
+            tapa::read_only_mmap<float>(m.conv2_bias),
+            tapa::read_only_mmap<float>(m.conv3_bias),
+            tapa::read_only_mmap<float>(m.conv1_weight),
+            tapa::read_only_mmap<float>(m.conv2_weight),
+            tapa::read_only_mmap<float>(m.conv3_weight),
+            tapa::read_only_mmap<float>(m.conv2_wino),
+            tapa::read_only_mmap<float>(m.conv3_wino),
+            tapa::read_only_mmap<float>(m.bn1_bias),
+            tapa::read_only_mmap<float>(m.bn2_bias),
+            tapa::read_only_mmap<float>(m.bn3_bias),
+            tapa::read_only_mmap<float>(m.bn1_weight),
+            tapa::read_only_mmap<float>(m.bn2_weight),
+            tapa::read_only_mmap<float>(m.bn3_weight),
+            tapa::read_only_mmap<float>(m.bn1_running_mean),
+            tapa::read_only_mmap<float>(m.bn2_running_mean),
+            tapa::read_only_mmap<float>(m.bn3_running_mean),
+            tapa::read_only_mmap<float>(m.bn1_running_var),
+            tapa::read_only_mmap<float>(m.bn2_running_var),
+            tapa::read_only_mmap<float>(m.bn3_running_var),
+            tapa::read_only_mmap<float>(m.fc1_bias),
+            tapa::read_only_mmap<float>(m.fc2_bias),
+            tapa::read_only_mmap<float>(m.fc1_weight),
+            tapa::read_only_mmap<float>(m.fc2_weight),
+            m.fc1_rank,
+            tapa::read_only_mmap<float>(m.fc1_u),
+            tapa::read_only_mmap<float>(m.fc1_v),
+            m.fc2_rank,
+            tapa::read_only_mmap<float>(m.fc2_u),
+            tapa::read_only_mmap<float>(m.fc2_v),
+            kOutputFull, 1,
+            tapa::write_only_mmap<float>(batch.output() + s * kOutSize, kOutSize),
+            tapa::write_only_mmap<float>(peaks),
+            tapa::write_only_mmap<uint16_t>(output_half),
+            tapa::write_only_mmap<int>(nnz),
+            tapa::write_only_mmap<int>(route));
+    }
+    Py_END_ALLOW_THREADS
+    batch.Release();
+    return PyFloat_FromDouble(kernel_ns * 1e-9);
+}
+
+PyObject* Model_get_hash(PyModel* self, void*) {
+    if (!CheckLoaded(self)) return nullptr;
+    return PyLong_FromUnsignedLongLong(self->hash);
+}
+
+PyObject* Model_get_config(PyModel* self, void*) {
+    if (!CheckLoaded(self)) return nullptr;
+    return PyUnicode_FromString(DescribeCpuConfig(*self->config).c_str());
+}
+
+PyObject* Model_get_has_calib(PyModel* self, void*) {
+    if (!CheckLoaded(self)) return nullptr;
+    return PyBool_FromLong(self->model->has_calib);
+}
+
+PyMethodDef kModelMethods[] = {
+    {"infer", reinterpret_cast<PyCFunction>(Model_infer), METH_VARARGS | METH_KEYWORDS,
+     "infer(inputs, outputs, threads=0)\n\n"
+     "Runs the batched CPU engine on float32 inputs of shape (N, 41), writing\n"
+     "float32 outputs of shape (N, 1000) in place. threads > 0 overrides the\n"
+     "configured worker count."},
+    {"infer_kernel", reinterpret_cast<PyCFunction>(Model_infer_kernel),
+     METH_VARARGS | METH_KEYWORDS,
+     "infer_kernel(inputs, outputs, bitstream='', raw=False)\n\n"
+     "Runs CnnKernel through tapa::invoke once per row (software simulation when\n"
+     "bitstream is empty). With raw=True, inputs are uint16 detector frames of\n"
+     "shape (N, RAW_SIZE) preprocessed on chip. Returns the summed kernel time in\n"
+     "seconds."},
+    {"infer_raw", reinterpret_cast<PyCFunction>(Model_infer_raw), METH_VARARGS | METH_KEYWORDS,
+     "infer_raw(frames, outputs, threads=0)\n\n"
+     "Like infer(), on uint16 detector frames of shape (N, RAW_SIZE): dark\n"
+     "subtraction, gain correction, binning and normalization run in the engine\n"
+     "with the calibration loaded alongside the weights."},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyGetSetDef kModelGetSet[] = {
+    {"hash", reinterpret_cast<getter>(Model_get_hash), nullptr,
+     "content hash of the parameters (ModelHash)", nullptr},
+    {"config", reinterpret_cast<getter>(Model_get_config), nullptr,
+     "CPU engine configuration used by infer()", nullptr},
+    {"has_calib", reinterpret_cast<getter>(Model_get_has_calib), nullptr,
+     "whether detector calibration was loaded (needed for raw frames)", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr},
+};
+
+PyTypeObject kModelType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyModuleDef kModule = {
+    PyModuleDef_HEAD_INIT, "pycnn",
+    "Spectrometer CNN inference over caller-owned float32 buffers.", -1,
+};
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_pycnn() {
+    kModelType.tp_name = "pycnn.Model";
+    kModelType.tp_doc =
+        "Model(data_dir, tune_cache=None)\n\n"
+        "Loads the .bin parameters written by scripts/pth_to_bin.py. With\n"
+        "tune_cache, the CPU engine is autotuned (and the result cached).";
+    kModelType.tp_basicsize = sizeof(PyModel);
+    kModelType.tp_flags = Py_TPFLAGS_DEFAULT;
+    kModelType.tp_new = PyType_GenericNew;
+    kModelType.tp_init = reinterpret_cast<initproc>(Model_init);
+    kModelType.tp_dealloc = reinterpret_cast<destructor>(Model_dealloc);
+    kModelType.tp_methods = kModelMethods;
+    kModelType.tp_getset = kModelGetSet;
+    if (PyType_Ready(&kModelType) < 0) return nullptr;
+
+    PyObject* module = PyModule_Create(&kModule);
+    if (!module) return nullptr;
+    Py_INCREF(&kModelType);
+    if (PyModule_AddObject(module, "Model", reinterpret_cast<PyObject*>(&kModelType)) < 0) {
+        Py_DECREF(&kModelType);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    PyModule_AddIntConstant(module, "IN_SIZE", kInSize);
+    PyModule_AddIntConstant(module, "OUT_SIZE", kOutSize);
+    PyModule_AddIntConstant(module, "RAW_SIZE", kRawSize);
+    return module;
+}
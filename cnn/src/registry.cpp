@@ -0,0 +1,186 @@
+#include <cmath>
+#include <string>
+#include <utility>
+#include <sys/stat.h>
+#include <tapa.h>
+#include "registry.h"
+
+using std::string;
+
+ModelRegistry::ModelRegistry(int conv2_tile, int conv3_tile)
+    : epoch_(1), conv2_tile_(conv2_tile), conv3_tile_(conv3_tile) {
+    for (auto & m : models_) m.store(nullptr);
+    for (auto & r : readers_) r.store(0);
+}
+
+ModelRegistry::~ModelRegistry() {
+    WaitForLoads();
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    for (auto & m : models_) delete m.exchange(nullptr);
+    for (auto & r : retired_) delete r.first;
+    retired_.clear();
+}
+
+int ModelRegistry::Slot(const string & name) {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    for (int i = 0; i < kMaxModels; ++i)
+        if (names_[i] == name) return i;
+    for (int i = 0; i < kMaxModels; ++i) {
+        if (names_[i].empty()) {
+            names_[i] = name;
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool ModelRegistry::Publish(const string & name, CnnModel model, const string & source,
+                            string* error) {
+    if ((model.conv2_tile != conv2_tile_ || model.conv3_tile != conv3_tile_) &&
+        !PrepareWinograd(model, conv2_tile_, conv3_tile_, error))
+        return false;
+    if (!ValidateModel(model, source, error)) return false;
+    const int slot = Slot(name);
+    if (slot < 0) {
+        *error = "no free model slot for " + name;
+        return false;
+    }
+
+    RegisteredModel* entry = new RegisteredModel();
+    entry->hash = ModelHash(model);
+    entry->model = std::move(model);
+    entry->source = source;
+
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    entry->version = next_version_++;
+    const RegisteredModel* old = models_[slot].exchange(entry);
+    // Readers that pinned an epoch up to this one may still hold `old`
+    const uint64_t retire_epoch = epoch_.fetch_add(1);
+    if (old) retired_.emplace_back(old, retire_epoch);
+    return true;
+}
+
+void ModelRegistry::Reclaim() {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    uint64_t oldest = UINT64_MAX;
+    for (auto & r : readers_) {
+        const uint64_t e = r.load();
+        if (e != 0 && e < oldest) oldest = e;
+    }
+    size_t kept = 0;
+    for (auto & r : retired_) {
+        if (r.second < oldest) delete r.first;
+        else retired_[kept++] = r;
+    }
+    retired_.resize(kept);
+}
+
+void ModelRegistry::LoadAsync(const string & name, const string & data_dir) {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    loaders_.emplace_back([this, name, data_dir]() {
+        CnnModel model;
+        string error;
+        if (!LoadModel(data_dir, model, &error) ||
+            !Publish(name, std::move(model), data_dir, &error)) {
+            std::lock_guard<std::mutex> lock(writer_mutex_);
+            load_errors_.push_back(name + ": " + error);
+            return;
+        }
+        Reclaim();
+    });
+}
+
+std::vector<string> ModelRegistry::WaitForLoads() {
+    std::vector<std::thread> loaders;
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        loaders.swap(loaders_);
+    }
+    for (auto & t : loaders) t.join();
+    Reclaim();
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    std::vector<string> errors;
+    errors.swap(load_errors_);
+    return errors;
+}
+
+ModelRegistry::ReadGuard::ReadGuard(ModelRegistry & registry)
+    : registry_(registry), reader_(-1) {
+    // Claim an idle reader slot with the current epoch. The slot store is
+    // ordered before the model loads in get(), so a publisher that scans the
+    // slots after its exchange either sees this epoch or we see its model.
+    for (;;) {
+        const uint64_t epoch = registry_.epoch_.load();
+        for (int i = 0; i < kMaxReaders; ++i) {
+            uint64_t idle = 0;
+            if (registry_.readers_[i].compare_exchange_strong(idle, epoch)) {
+                reader_ = i;
+                return;
+            }
+        }
+        std::this_thread::yield();  // more than kMaxReaders concurrent batches
+    }
+}
+
+ModelRegistry::ReadGuard::~ReadGuard() {
+    registry_.readers_[reader_].store(0);
+}
+
+bool ValidateModel(const CnnModel & m, const string & data_dir, string* error) {
+    const std::pair<const char*, const aligned_vector<float>*> params[] = {
+        {"conv1_bias", &m.conv1_bias}, {"conv2_bias", &m.conv2_bias},
+        {"conv3_bias", &m.conv3_bias}, {"conv1_weight", &m.conv1_weight},
+        {"conv2_weight", &m.conv2_weight}, {"conv3_weight", &m.conv3_weight},
+        {"bn1_bias", &m.bn1_bias}, {"bn2_bias", &m.bn2_bias}, {"bn3_bias", &m.bn3_bias},
+        {"bn1_weight", &m.bn1_weight}, {"bn2_weight", &m.bn2_weight},
+        {"bn3_weight", &m.bn3_weight}, {"bn1_running_mean", &m.bn1_running_mean},
+        {"bn2_running_mean", &m.bn2_running_mean}, {"bn3_running_mean", &m.bn3_running_mean},
+        {"bn1_running_var", &m.bn1_running_var}, {"bn2_running_var", &m.bn2_running_var},
+        {"bn3_running_var", &m.bn3_running_var}, {"fc1_bias", &m.fc1_bias},
+        {"fc2_bias", &m.fc2_bias}, {"fc1_weight", &m.fc1_weight},
+        {"fc2_weight", &m.fc2_weight}, {"fc1_u", &m.fc1_u}, {"fc1_v", &m.fc1_v},
+        {"fc2_u", &m.fc2_u}, {"fc2_v", &m.fc2_v}, {"calib_dark", &m.calib_dark},
+        {"calib_gain", &m.calib_gain}, {"calib_scale", &m.calib_scale},
+        {"calib_shift", &m.calib_shift}, {"gate_w1", &m.gate_w1}, {"gate_b1", &m.gate_b1},
+        {"gate_w2", &m.gate_w2}, {"gate_b2", &m.gate_b2},
+    };
+    for (const auto & p : params) {
+        for (float v : *p.second) {
+            if (!std::isfinite(v)) {
+                *error = string(p.first) + " has non-finite values";
+                return false;
+            }
+        }
+    }
+    for (const aligned_vector<float>* var : {&m.bn1_running_var, &m.bn2_running_var,
+                                             &m.bn3_running_var}) {
+        for (float v : *var) {
+            if (v < 0.0f) {
+                *error = "negative batch-norm running variance";
+                return false;
+            }
+        }
+    }
+
+    // Self-test against the reference pair shipped with the weights
+    struct stat st;
+    if (data_dir.empty() || stat((data_dir + "/input.bin").c_str(), &st) != 0 ||
+        stat((data_dir + "/output.bin").c_str(), &st) != 0)
+        return true;
+    aligned_vector<float> input(kInSize);
+    string load_error;
+    if (!LoadInput(data_dir, input, &load_error)) {
+        *error = load_error;
+        return false;
+    }
+    aligned_vector<float> output(kOutSize);
+    aligned_vector<int> nnz(kNnzStats);
+    CnnSequential(input, m, output, nnz);
+    const int errors = Verify(data_dir, output);
+    if (errors != 0) {
+        *error = "self-test against " + data_dir + "/output.bin failed (" +
+                 std::to_string(errors) + " mismatches)";
+        return false;
+    }
+    return true;
+}
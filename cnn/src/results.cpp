@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tapa.h>
+#include "results.h"
+
+using std::clog;
+using std::string;
+
+namespace {
+
+const char kHeaderMagic[8] = "CNNRES1";
+const char kTrailerMagic[8] = "CNNRIDX";
+const uint32_t kVersion = 1;
+
+struct ResultTrailer {
+    uint64_t index_offset;
+    uint64_t chunks;
+    uint64_t rows;
+    char magic[8];
+};
+
+static_assert(sizeof(ResultHeader) <= kResultAlign, "header must fit its page");
+
+uint64_t AlignUp(uint64_t x) {
+    return (x + kResultAlign - 1) / kResultAlign * kResultAlign;
+}
+
+size_t ValueBytes(uint32_t dtype) {
+    return dtype == kResultHalf ? sizeof(uint16_t) : sizeof(float);
+}
+
+bool WriteAt(int fd, const void* data, size_t bytes, uint64_t offset, string* error) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t w = pwrite(fd, p, bytes, offset);
+        if (w <= 0) {
+            *error = string("write failed: ") + strerror(errno);
+            return false;
+        }
+        p += w;
+        bytes -= w;
+        offset += w;
+    }
+    return true;
+}
+
+// Row encoders: values -> stored bit patterns, minus the previous row's
+// patterns when delta coding (prev is updated to the current row)
+template <typename Bits>
+void EncodeRow(const Bits* cur, Bits* prev, bool delta, Bits* out, int size) {
+    for (int i = 0; i < size; ++i) {
+        out[i] = delta ? Bits(cur[i] - prev[i]) : cur[i];
+        prev[i] = cur[i];
+    }
+}
+
+}  // namespace
+
+ResultWriter::~ResultWriter() {
+    string error;
+    if (fd_ >= 0 && !Close(&error)) clog << "ResultWriter: " << error << "\n";
+}
+
+bool ResultWriter::Open(const string & path, uint64_t model_hash, int dtype, bool delta,
+                        int chunk_rows, bool append, string* error) {
+    if (chunk_rows < 1 || (dtype != kResultFloat && dtype != kResultHalf)) {
+        *error = "bad result file options for " + path;
+        return false;
+    }
+    if (chunk_rows > kResultMaxChunkRows) {
+        *error = "result chunks hold at most " + std::to_string(kResultMaxChunkRows) + " rows";
+        return false;
+    }
+    struct stat st;
+    const bool exists = stat(path.c_str(), &st) == 0 && st.st_size > 0;
+
+    index_.clear();
+    if (append && exists) {
+        // Take over the existing chunks; new ones go where the index was
+        ResultReader reader;
+        if (!reader.Open(path, error)) return false;
+        const ResultHeader & h = reader.header();
+        if (h.dtype != uint32_t(dtype) || h.delta != uint32_t(delta) ||
+            h.row_size != uint32_t(kOutSize) || h.model_hash != model_hash) {
+            *error = path + " has a different dtype, encoding, row size or model hash";
+            return false;
+        }
+        if (h.chunk_rows < 1 || h.chunk_rows > uint32_t(kResultMaxChunkRows)) {
+            *error = path + " has a bad chunk size";
+            return false;
+        }
+        header_ = h;
+        end_ = h.index_offset;
+        index_ = reader.index();
+        fd_ = open(path.c_str(), O_RDWR);
+    } else {
+        header_ = ResultHeader();
+        memcpy(header_.magic, kHeaderMagic, sizeof(kHeaderMagic));
+        header_.version = kVersion;
+        header_.dtype = dtype;
+        header_.delta = delta;
+        header_.row_size = kOutSize;
+        header_.input_size = kInSize;
+        header_.chunk_rows = chunk_rows;
+        header_.model_hash = model_hash;
+        end_ = kResultAlign;
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd_ < 0) {
+        *error = "Cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    // Until Close, the file has no index and readers reject it
+    header_.index_offset = 0;
+    bool ok = WriteAt(fd_, &header_, sizeof(header_), 0, error);
+    if (ok && ftruncate(fd_, end_) != 0) {
+        *error = "Cannot truncate " + path;
+        ok = false;
+    }
+    if (!ok) {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    buffer_.assign(size_t(header_.chunk_rows) * kOutSize, 0.0f);
+    encoded_.assign(size_t(header_.chunk_rows) * kOutSize * ValueBytes(header_.dtype), 0);
+    pending_ = 0;
+    return true;
+}
+
+bool ResultWriter::Append(const float* rows, int n, string* error) {
+    const int chunk_rows = header_.chunk_rows;
+    while (n > 0) {
+        const int take = std::min(n, chunk_rows - pending_);
+        memcpy(&buffer_[size_t(pending_) * kOutSize], rows, size_t(take) * kOutSize * sizeof(float));
+        pending_ += take;
+        rows += size_t(take) * kOutSize;
+        n -= take;
+        if (pending_ == chunk_rows && !FlushChunk(error)) return false;
+    }
+    return true;
+}
+
+bool ResultWriter::FlushChunk(string* error) {
+    if (pending_ == 0) return true;
+    const bool delta = header_.delta != 0;
+    size_t bytes;
+    if (header_.dtype == kResultHalf) {
+        std::vector<uint16_t> cur(kOutSize), prev(kOutSize, 0);
+        uint16_t* out = reinterpret_cast<uint16_t*>(encoded_.data());
+        for (int r = 0; r < pending_; ++r) {
+            const float* row = &buffer_[size_t(r) * kOutSize];
+            for (int i = 0; i < kOutSize; ++i) cur[i] = FloatToHalf(row[i]);
+            EncodeRow(cur.data(), prev.data(), delta, out + size_t(r) * kOutSize, kOutSize);
+        }
+        bytes = size_t(pending_) * kOutSize * sizeof(uint16_t);
+    } else {
+        std::vector<uint32_t> prev(kOutSize, 0);
+        uint32_t* out = reinterpret_cast<uint32_t*>(encoded_.data());
+        for (int r = 0; r < pending_; ++r) {
+            const uint32_t* cur = reinterpret_cast<const uint32_t*>(&buffer_[size_t(r) * kOutSize]);
+            EncodeRow(cur, prev.data(), delta, out + size_t(r) * kOutSize, kOutSize);
+        }
+        bytes = size_t(pending_) * kOutSize * sizeof(float);
+    }
+    if (!WriteAt(fd_, encoded_.data(), bytes, end_, error)) return false;
+    index_.push_back({end_, uint32_t(pending_), uint32_t(bytes)});
+    header_.rows += pending_;
+    end_ = AlignUp(end_ + bytes);
+    pending_ = 0;
+    return true;
+}
+
+bool ResultWriter::Close(string* error) {
+    if (fd_ < 0) return true;
+    bool ok = FlushChunk(error);
+    if (ok) {
+        header_.index_offset = end_;
+        ResultTrailer trailer = {end_, index_.size(), header_.rows, {}};
+        memcpy(trailer.magic, kTrailerMagic, sizeof(kTrailerMagic));
+        const size_t index_bytes = index_.size() * sizeof(ResultChunk);
+        ok = WriteAt(fd_, index_.data(), index_bytes, end_, error) &&
+             WriteAt(fd_, &trailer, sizeof(trailer), end_ + index_bytes, error) &&
+             WriteAt(fd_, &header_, sizeof(header_), 0, error);
+        if (ok && ftruncate(fd_, end_ + index_bytes + sizeof(trailer)) != 0) {
+            *error = string("truncate failed: ") + strerror(errno);
+            ok = false;
+        }
+    }
+    close(fd_);
+    fd_ = -1;
+    return ok;
+}
+
+ResultReader::~ResultReader() {
+    if (base_) munmap(const_cast<char*>(base_), size_);
+    if (fd_ >= 0) close(fd_);
+}
+
+bool ResultReader::Open(const string & path, string* error) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ == -1) {
+        *error = "Cannot find " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || size_t(st.st_size) < kResultAlign + sizeof(ResultTrailer)) {
+        *error = path + " is too small for a result file";
+        return false;
+    }
+    size_ = st.st_size;
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        *error = "Failed to mmap " + path;
+        return false;
+    }
+    base_ = static_cast<const char*>(p);
+
+    memcpy(&header_, base_, sizeof(header_));
+    ResultTrailer trailer;
+    memcpy(&trailer, base_ + size_ - sizeof(trailer), sizeof(trailer));
+    if (memcmp(header_.magic, kHeaderMagic, sizeof(kHeaderMagic)) != 0 ||
+        header_.version != kVersion) {
+        *error = path + " is not a result file";
+        return false;
+    }
+    if (header_.row_size != uint32_t(kOutSize) || header_.input_size != uint32_t(kInSize) ||
+        (header_.dtype != kResultFloat && header_.dtype != kResultHalf)) {
+        *error = path + " was written for another network shape or encoding";
+        return false;
+    }
+    if (memcmp(trailer.magic, kTrailerMagic, sizeof(kTrailerMagic)) != 0 ||
+        trailer.index_offset != header_.index_offset ||
+        trailer.index_offset + trailer.chunks * sizeof(ResultChunk) + sizeof(trailer) != size_) {
+        *error = path + " has no valid index (writer not closed?)";
+        return false;
+    }
+
+    index_.resize(trailer.chunks);
+    memcpy(index_.data(), base_ + trailer.index_offset, trailer.chunks * sizeof(ResultChunk));
+    first_rows_.resize(trailer.chunks);
+    const size_t row_bytes = header_.row_size * ValueBytes(header_.dtype);
+    uint64_t rows = 0;
+    for (size_t c = 0; c < index_.size(); ++c) {
+        const ResultChunk & k = index_[c];
+        if (k.offset % kResultAlign != 0 || k.offset + k.bytes > trailer.index_offset ||
+            k.bytes != k.rows * row_bytes) {
+            *error = path + " has a corrupt chunk index";
+            return false;
+        }
+        first_rows_[c] = rows;
+        rows += k.rows;
+    }
+    if (rows != trailer.rows || rows != header_.rows) {
+        *error = path + " row count does not match its index";
+        return false;
+    }
+    return true;
+}
+
+const ResultChunk* ResultReader::Find(uint64_t row, uint64_t* first_row) const {
+    // Chunks are full except the ones before an append and the last, so
+    // search instead of dividing by chunk_rows
+    size_t lo = 0, hi = first_rows_.size();
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (first_rows_[mid] <= row) lo = mid;
+        else hi = mid;
+    }
+    if (lo >= index_.size() || row >= first_rows_[lo] + index_[lo].rows) return nullptr;
+    *first_row = first_rows_[lo];
+    return &index_[lo];
+}
+
+const float* ResultReader::Row(uint64_t i) const {
+    if (header_.dtype != kResultFloat || header_.delta) return nullptr;
+    uint64_t first;
+    const ResultChunk* chunk = Find(i, &first);
+    if (!chunk) return nullptr;
+    return reinterpret_cast<const float*>(base_ + chunk->offset) + (i - first) * header_.row_size;
+}
+
+bool ResultReader::Read(uint64_t first, int n, float* out, string* error) const {
+    const int size = header_.row_size;
+    const bool half = header_.dtype == kResultHalf;
+    std::vector<uint32_t> acc(size);
+    uint64_t row = first;
+    while (row < first + n) {
+        uint64_t chunk_first;
+        const ResultChunk* chunk = Find(row, &chunk_first);
+        if (!chunk) {
+            *error = "row " + std::to_string(row) + " is past the end (" +
+                     std::to_string(header_.rows) + " rows)";
+            return false;
+        }
+        const char* data = base_ + chunk->offset;
+        const uint64_t end = std::min<uint64_t>(first + n, chunk_first + chunk->rows);
+        // Delta rows decode from the start of their chunk
+        const uint64_t start = header_.delta ? chunk_first : row;
+        std::fill(acc.begin(), acc.end(), 0);
+        for (uint64_t r = start; r < end; ++r) {
+            const uint64_t k = (r - chunk_first) * size;
+            for (int i = 0; i < size; ++i) {
+                const uint32_t v = half ? reinterpret_cast<const uint16_t*>(data)[k + i]
+                                        : reinterpret_cast<const uint32_t*>(data)[k + i];
+                acc[i] = header_.delta ? acc[i] + v : v;
+                if (half) acc[i] &= 0xffff;
+            }
+            if (r < row) continue;
+            float* dst = out + (r - first) * size;
+            for (int i = 0; i < size; ++i) {
+                if (half) {
+                    dst[i] = HalfToFloat(uint16_t(acc[i]));
+                } else {
+                    memcpy(&dst[i], &acc[i], sizeof(float));
+                }
+            }
+        }
+        row = end;
+    }
+    return true;
+}
+
+bool LoadBatchInputs(const string & data_dir, const aligned_vector<float> & input, int n,
+                     float* inputs) {
+    const string multi = data_dir + "/inputs.bin";
+    const size_t bytes = size_t(n) * kInSize * sizeof(float);
+    struct stat st;
+    if (stat(multi.c_str(), &st) == 0) {
+        int fd = open(multi.c_str(), O_RDONLY);
+        const bool ok = fd != -1 && size_t(st.st_size) >= bytes &&
+                        pread(fd, inputs, bytes, 0) == ssize_t(bytes);
+        if (fd != -1) close(fd);
+        if (ok) return true;
+        clog << multi << " holds fewer than " << n << " samples, using copies of input.bin\n";
+    }
+    for (int r = 0; r < n; ++r)
+        std::copy(input.begin(), input.end(), inputs + size_t(r) * kInSize);
+    return false;
+}
+
+int VerifyBatch(const string & data_dir, const float* outputs, uint64_t first, int n,
+                bool per_row, uint64_t model_hash, bool* missing) {
+    *missing = false;
+    std::vector<float> truth(size_t(kOutSize) * n);
+    string error;
+    if (per_row) {
+        const string multi = data_dir + "/output.cnnr";
+        ResultReader reader;
+        bool ok = reader.Open(multi, &error);
+        if (ok && reader.header().model_hash != model_hash) {
+            error = multi + " was written by another model";
+            ok = false;
+        }
+        if (!ok || !reader.Read(first, n, truth.data(), &error)) {
+            clog << error << "\n";
+            *missing = true;
+            return n;
+        }
+    } else {
+        aligned_vector<float> single(kOutSize);
+        if (!LoadOutput(data_dir, single, &error)) {
+            clog << error << "\n";
+            *missing = true;
+            return n;
+        }
+        for (int r = 0; r < n; ++r)
+            std::copy(single.begin(), single.end(), truth.begin() + size_t(r) * kOutSize);
+    }
+
+    int failed = 0;
+    for (int r = 0; r < n; ++r) {
+        const float* got = outputs + size_t(r) * kOutSize;
+        const float* want = &truth[size_t(r) * kOutSize];
+        for (int i = 0; i < kOutSize; ++i) {
+            if (IsError(got[i], want[i])) {
+                if (failed == 0)
+                    clog << "First error: row " << first + r << ", got " << got[i]
+                         << ", expecting " << want[i] << " @ index " << i << "\n";
+                ++failed;
+                break;
+            }
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tapa.h>
+#include "split_engine.h"
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::string;
+
+// Read-only view of a host array for tapa::invoke
+static tapa::read_only_mmap<float> Port(const float* p, size_t count) {
+    return tapa::read_only_mmap<float>(const_cast<float*>(p), count);
+}
+
+static tapa::read_only_mmap<float> Port(const aligned_vector<float> & v) {
+    return Port(v.data(), v.size());
+}
+
+// Front half of one chunk: rows inputs -> rows activations at split
+static double RunDevice(const string & bitstream, const CnnModel & m, int split,
+                        const float* inputs, int rows, float* acts) {
+    return tapa::invoke(
+        CnnBatchKernel, bitstream, rows, split,
+        Port(inputs, size_t(rows) * kInSize),
+        Port(m.conv1_bias),
+        Port(m.conv2_bias),
+        Port(m.conv3_bias),
+        Port(m.conv1_weight),
+        Port(m.conv2_weight),
+        Port(m.conv3_weight),
+        Port(m.bn1_bias),
+        Port(m.bn2_bias),
+        Port(m.bn3_bias),
+        Port(m.bn1_weight),
+        Port(m.bn2_weight),
+        Port(m.bn3_weight),
+        Port(m.bn1_running_mean),
+        Port(m.bn2_running_mean),
+        Port(m.bn3_running_mean),
+        Port(m.bn1_running_var),
+        Port(m.bn2_running_var),
+        Port(m.bn3_running_var),
+        Port(m.fc1_bias),
+        Port(m.fc2_bias),
+        Port(m.fc1_weight),
+        Port(m.fc2_weight),
+        m.fc1_rank,
+        Port(m.fc1_u),
+        Port(m.fc1_v),
+        m.fc2_rank,
+        Port(m.fc2_u),
+        Port(m.fc2_v),
+        tapa::write_only_mmap<float>(acts, size_t(rows) * kSplitSize[split]));
+}
+
+bool RunSplit(
+    const string & bitstream,
+    const CnnModel & m,
+    const CpuConfig & cfg,
+    int split,
+    const float* inputs,
+    int n,
+    int chunk,
+    float* outputs,
+    SplitStats* stats,
+    string* error) {
+    if (split < kSplitCpu || split > kSplitDevice) {
+        *error = "Split " + std::to_string(split) + " is not a layer boundary (0.." +
+                 std::to_string(kSplitDevice) + ")";
+        return false;
+    }
+    if (chunk < 1) {
+        *error = "Split chunk must be at least one sample";
+        return false;
+    }
+    SplitStats s;
+    const auto begin = steady_clock::now();
+    if (split == kSplitCpu || n <= 0) {
+        CnnBatch(inputs, n, m, cfg, outputs);
+        s.wall_seconds = duration_cast<nanoseconds>(steady_clock::now() - begin).count() * 1e-9;
+        s.cpu_seconds = s.wall_seconds;
+        *stats = s;
+        return true;
+    }
+
+    // Two buffers: the device fills one while the CPU drains the other.
+    // ready[b] is the chunk buffer b holds, -1 while it is free.
+    const int size = kSplitSize[split];
+    const int chunks = (n + chunk - 1) / chunk;
+    aligned_vector<float> buffer[2] = {aligned_vector<float>(size_t(chunk) * size),
+                                       aligned_vector<float>(size_t(chunk) * size)};
+    int ready[2] = {-1, -1};
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    std::thread device([&]() {
+        for (int c = 0; c < chunks; ++c) {
+            const int b = c % 2;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return ready[b] < 0; });
+            }
+            const int first = c * chunk;
+            const int rows = std::min(chunk, n - first);
+            const double ns = RunDevice(bitstream, m, split, inputs + size_t(first) * kInSize,
+                                        rows, buffer[b].data());
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                s.device_seconds += ns * 1e-9;
+                ready[b] = c;
+            }
+            changed.notify_all();
+        }
+    });
+
+    for (int c = 0; c < chunks; ++c) {
+        const int b = c % 2;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return ready[b] == c; });
+        }
+        const int first = c * chunk;
+        const int rows = std::min(chunk, n - first);
+        const auto t0 = steady_clock::now();
+        CnnFinishBatch(buffer[b].data(), rows, split, m, cfg, outputs + size_t(first) * kOutSize);
+        s.cpu_seconds += duration_cast<nanoseconds>(steady_clock::now() - t0).count() * 1e-9;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[b] = -1;
+        }
+        changed.notify_all();
+    }
+    device.join();
+
+    s.chunks = chunks;
+    s.bytes_back = double(n) * size * sizeof(float);
+    s.wall_seconds = duration_cast<nanoseconds>(steady_clock::now() - begin).count() * 1e-9;
+    *stats = s;
+    return true;
+}
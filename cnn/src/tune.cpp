@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tapa.h>
+#include "tune.h"
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::clog;
+using std::string;
+
+static string CpuModelName() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") != 0) continue;
+        size_t colon = line.find(':');
+        if (colon != string::npos) return line.substr(line.find_first_not_of(" \t", colon + 1));
+    }
+    return "unknown-cpu";
+}
+
+// Best of `reps` runs, in microseconds
+static double TimeUs(const std::function<void()> & run, int reps) {
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r) {
+        const auto begin = steady_clock::now();
+        run();
+        best = std::min(best, duration<double, std::micro>(steady_clock::now() - begin).count());
+    }
+    return best;
+}
+
+static const char* VariantName(int variant) {
+    return variant == kFcBatched ? "batched" : variant == kFcTiled ? "tiled" : "skip-zeros";
+}
+
+string DescribeCpuConfig(const CpuConfig & cfg) {
+    std::ostringstream os;
+    os << "fc1 " << VariantName(cfg.fc1_variant);
+    if (cfg.fc1_variant == kFcTiled) os << "/" << cfg.fc1_tile;
+    os << ", fc2 " << VariantName(cfg.fc2_variant);
+    if (cfg.fc2_variant == kFcTiled) os << "/" << cfg.fc2_tile;
+    os << ", batch block " << cfg.batch_block << ", " << cfg.threads << " thread"
+       << (cfg.threads > 1 ? "s" : "");
+    return os.str();
+}
+
+// Cache lines: <model hash> TAB <cpu model> TAB <fc1 variant> <fc1 tile>
+// <fc2 variant> <fc2 tile> <batch block> <threads>
+static bool LookupCache(const string & path, const string & hash, const string & cpu,
+                        CpuConfig & cfg) {
+    std::ifstream in(path);
+    string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        string h, c, rest;
+        if (!std::getline(fields, h, '\t') || !std::getline(fields, c, '\t') ||
+            !std::getline(fields, rest))
+            continue;
+        if (h != hash || c != cpu) continue;
+        std::istringstream values(rest);
+        CpuConfig found;
+        if (values >> found.fc1_variant >> found.fc1_tile >> found.fc2_variant
+                   >> found.fc2_tile >> found.batch_block >> found.threads) {
+            cfg = found;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replaces the (hash, cpu) line, keeping every other entry; written to a
+// temporary file and renamed so a crash never leaves a truncated cache
+static void StoreCache(const string & path, const string & hash, const string & cpu,
+                       const CpuConfig & cfg) {
+    std::vector<string> kept;
+    {
+        std::ifstream in(path);
+        const string key = hash + '\t' + cpu + '\t';
+        string line;
+        while (std::getline(in, line))
+            if (line.compare(0, key.size(), key) != 0) kept.push_back(line);
+    }
+    const string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out) {
+            clog << "autotune: cannot write " << path << ", tuning will rerun next time\n";
+            return;
+        }
+        for (const string & line : kept) out << line << '\n';
+        out << hash << '\t' << cpu << '\t' << cfg.fc1_variant << ' ' << cfg.fc1_tile << ' '
+            << cfg.fc2_variant << ' ' << cfg.fc2_tile << ' ' << cfg.batch_block << ' '
+            << cfg.threads << '\n';
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        clog << "autotune: cannot replace " << path << ", tuning will rerun next time\n";
+}
+
+CpuConfig AutotuneCpu(const CnnModel & m, const string & cache_path, bool retune) {
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)ModelHash(m));
+    const string cpu = CpuModelName();
+
+    CpuConfig cfg;
+    if (!retune && LookupCache(cache_path, hash, cpu, cfg)) {
+        clog << "autotune: cached for " << cpu << ": " << DescribeCpuConfig(cfg) << "\n";
+        return cfg;
+    }
+    clog << "autotune: tuning for " << cpu << " (model " << hash << ")\n";
+
+    // Deterministic spectra-like inputs; the FC layers are tuned on the real
+    // activations they produce so the zero-skipping variants see real sparsity
+    constexpr int kRows = 64;
+    constexpr int kReps = 5;
+    std::vector<float> inputs(kRows * kInSize);
+    uint32_t state = 12345;
+    for (float & v : inputs) {
+        state = state * 1664525u + 1013904223u;
+        v = (state >> 8) * (1.0f / 16777216.0f);
+    }
+    std::vector<float> flat3(kRows * LinearSize1), hidden(kRows * LinearSize2);
+    std::vector<float> spectra(kRows * kOutSize);
+
+    // Per-layer variant search
+    struct Candidate { int variant; int tile; };
+    const Candidate candidates[] = {
+        {kFcSkipZeros, 0}, {kFcBatched, 0},
+        {kFcTiled, 8}, {kFcTiled, 16}, {kFcTiled, 32}, {kFcTiled, 64},
+    };
+    auto tune_layer = [&](const char* name, const float* in, float* out,
+                          void (*layer)(const CnnModel &, int, int, const float*, int, float*),
+                          int & best_variant, int & best_tile) {
+        double best = 1e30;
+        for (const Candidate & c : candidates) {
+            double us = TimeUs([&] { layer(m, c.variant, c.tile, in, kRows, out); }, kReps) / kRows;
+            clog << "autotune: " << name << " " << VariantName(c.variant);
+            if (c.variant == kFcTiled) clog << "/" << c.tile;
+            clog << ": " << us << " us/sample\n";
+            if (us < best) { best = us; best_variant = c.variant; best_tile = c.tile ? c.tile : 32; }
+        }
+    };
+    CnnConvFlat(inputs.data(), kRows, m, flat3.data());
+    tune_layer("fc1", flat3.data(), hidden.data(), CnnFc1Block, cfg.fc1_variant, cfg.fc1_tile);
+    CnnFc1Block(m, kFcSkipZeros, 0, flat3.data(), kRows, hidden.data());
+    for (float & v : hidden) v = max(v, 0.0f);
+    tune_layer("fc2", hidden.data(), spectra.data(), CnnFc2Block, cfg.fc2_variant, cfg.fc2_tile);
+
+    // Batch blocking, single thread, whole network
+    constexpr int kBatch = 256;
+    std::vector<float> batch_in(kBatch * kInSize), batch_out(kBatch * kOutSize);
+    for (int i = 0; i < kBatch * kInSize; ++i) batch_in[i] = inputs[i % inputs.size()];
+    double best = 1e30;
+    int best_block = cfg.batch_block;
+    for (int block : {1, 2, 4, 8, 16, 32, 64}) {
+        CpuConfig trial = cfg;
+        trial.batch_block = block;
+        trial.threads = 1;
+        double us = TimeUs([&] { CnnBatch(batch_in.data(), kBatch, m, trial, batch_out.data()); },
+                           kReps) / kBatch;
+        clog << "autotune: batch block " << block << ": " << us << " us/sample\n";
+        if (us < best) { best = us; best_block = block; }
+    }
+    cfg.batch_block = best_block;
+
+    // Thread count on a batch large enough to keep every thread busy
+    const int hw_threads = std::thread::hardware_concurrency();
+    const int max_threads = hw_threads > 0 ? hw_threads : 1;
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2) thread_counts.push_back(threads);
+    thread_counts.push_back(max_threads);
+    std::vector<float> big_in, big_out;
+    best = 1e30;
+    for (int threads : thread_counts) {
+        const int n = kBatch * threads;
+        big_in.resize(n * kInSize);
+        big_out.resize(n * kOutSize);
+        for (int i = 0; i < n * kInSize; ++i) big_in[i] = inputs[i % inputs.size()];
+        CpuConfig trial = cfg;
+        trial.threads = threads;
+        double us = TimeUs([&] { CnnBatch(big_in.data(), n, m, trial, big_out.data()); }, kReps) / n;
+        clog << "autotune: " << threads << " threads: " << us << " us/sample\n";
+        if (us < best) { best = us; cfg.threads = threads; }
+    }
+
+    clog << "autotune: picked " << DescribeCpuConfig(cfg) << "\n";
+    StoreCache(cache_path, hash, cpu, cfg);
+    return cfg;
+}
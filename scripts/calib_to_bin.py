@@ -0,0 +1,83 @@
+import os
+import argparse
+
+import numpy as np
+
+# Must match kInSize / kRawBin in cnn/include/cnn.h
+IN_SIZE = 41
+RAW_BIN = 8
+RAW_SIZE = IN_SIZE * RAW_BIN
+
+def preprocess(raw, dark, gain, scale, shift):
+    """Reference of the in-engine preprocessing (CnnPreprocess)."""
+    c = (raw.astype(np.float32) - dark) * gain
+    b = c.reshape(-1, IN_SIZE, RAW_BIN).sum(axis=2)
+    total = b.sum(axis=1, keepdims=True)
+    inv = np.where(total > 0, 1.0 / np.where(total > 0, total, 1), 0)
+    return (b * inv * scale + shift).astype(np.float32)
+
+def synthesize(input_path, seed):
+    """Random dark/gain and a frame whose preprocessing reproduces input.bin,
+    so swsim can check the raw path against the existing output.bin."""
+    rng = np.random.default_rng(seed)
+    x = np.fromfile(input_path, dtype=np.float32)[:IN_SIZE]
+    dark = rng.uniform(90, 110, RAW_SIZE).astype(np.float32)
+    gain = rng.uniform(0.8, 1.2, RAW_SIZE).astype(np.float32)
+    counts = rng.uniform(500, 5000, RAW_SIZE)
+    raw = np.clip(np.round(dark + counts / gain), 0, 65535).astype(np.uint16)
+    scale = np.ones(IN_SIZE, np.float32)
+    shift = np.zeros(IN_SIZE, np.float32)
+    shift = x - preprocess(raw[None], dark, gain, scale, shift)[0]
+    return raw, dict(dark=dark, gain=gain, scale=scale, shift=shift.astype(np.float32))
+
+def main(args):
+    os.makedirs(args.output_dir, exist_ok=True)
+    if args.synthesize:
+        raw, calib = synthesize(os.path.join(args.output_dir, "input.bin"), args.seed)
+    else:
+        npz = np.load(args.calib)
+        calib = {k: np.asarray(npz[k], np.float32).ravel() for k in ("dark", "gain")}
+        calib["scale"] = np.asarray(npz["scale"] if "scale" in npz else np.ones(IN_SIZE),
+                                    np.float32).ravel()
+        calib["shift"] = np.asarray(npz["shift"] if "shift" in npz else np.zeros(IN_SIZE),
+                                    np.float32).ravel()
+        raw = np.load(args.frame).astype(np.uint16).ravel() if args.frame else None
+
+    sizes = dict(dark=RAW_SIZE, gain=RAW_SIZE, scale=IN_SIZE, shift=IN_SIZE)
+    for name, arr in calib.items():
+        if arr.size != sizes[name]:
+            raise SystemExit(f"{name} has {arr.size} values, expected {sizes[name]}")
+        path = os.path.join(args.output_dir, f"calib_{name}.bin")
+        arr.tofile(path)
+        print(f"Wrote calib_{name:5s} → {path}  ({arr.size} values)")
+    if raw is not None:
+        path = os.path.join(args.output_dir, "raw.bin")
+        raw[:RAW_SIZE].tofile(path)
+        print(f"Wrote raw frame   → {path}  ({RAW_SIZE} uint16 counts)")
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(
+        description="Write detector calibration (calib_*.bin) next to the model weights"
+    )
+    p.add_argument(
+        "--output-dir", "-o", default="bins",
+        help="Model directory (as written by pth_to_bin.py)"
+    )
+    p.add_argument(
+        "--calib", "-c",
+        help=f".npz with dark[{RAW_SIZE}], gain[{RAW_SIZE}] and optional "
+             f"scale[{IN_SIZE}] / shift[{IN_SIZE}] (default 1 / 0)"
+    )
+    p.add_argument(
+        "--frame", "-f",
+        help="Optional .npy raw frame to write as raw.bin for cnn --raw"
+    )
+    p.add_argument(
+        "--synthesize", action="store_true",
+        help="Random calibration plus a raw.bin that reproduces the directory's input.bin"
+    )
+    p.add_argument("--seed", type=int, default=0, help="Seed for --synthesize")
+    args = p.parse_args()
+    if not args.synthesize and not args.calib:
+        p.error("one of --calib or --synthesize is required")
+    main(args)
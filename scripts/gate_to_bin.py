@@ -0,0 +1,88 @@
+import os
+import argparse
+
+import numpy as np
+
+# Must match kInSize / kGateHidden in cnn/include/cnn.h
+IN_SIZE = 41
+GATE_HIDDEN = 8
+
+def gate_score(x, w1, b1, w2, b2):
+    """Reference of the pre-screen gate (CnnScreen): w2 . relu(W1 x + b1) + b2."""
+    return np.maximum(x @ w1.T + b1, 0) @ w2 + b2[0]
+
+def train(x, y, seed, ridge):
+    """Random ReLU features with a ridge-regressed readout: y = 1 for frames
+    that need the network, 0 for trivial ones. Scores land around +-1, so the
+    kernel's default threshold 0 sits halfway."""
+    rng = np.random.default_rng(seed)
+    mean = x.mean(axis=0)
+    std = x.std(axis=0) + 1e-6
+    w1 = rng.normal(0, 1 / np.sqrt(IN_SIZE), (GATE_HIDDEN, IN_SIZE)) / std
+    b1 = -(w1 @ mean) + rng.normal(0, 0.1, GATE_HIDDEN)
+    h = np.maximum(x @ w1.T + b1, 0)
+    h1 = np.hstack([h, np.ones((len(h), 1))])
+    t = np.where(y > 0, 1.0, -1.0)
+    coef = np.linalg.solve(h1.T @ h1 + ridge * np.eye(GATE_HIDDEN + 1), h1.T @ t)
+    gate = dict(w1=w1, b1=b1, w2=coef[:GATE_HIDDEN], b2=coef[GATE_HIDDEN:])
+    return {k: np.asarray(v, np.float32) for k, v in gate.items()}
+
+def synthesize(input_path, count, seed):
+    """Jittered copies of input.bin (need the network) against near-flat,
+    low-level and noise-only frames (trivial)."""
+    rng = np.random.default_rng(seed)
+    x = np.fromfile(input_path, dtype=np.float32)[:IN_SIZE]
+    real = x * rng.uniform(0.7, 1.3, (count, 1)) + rng.normal(0, 0.05, (count, IN_SIZE))
+    level = rng.uniform(0, x.mean(), (count, 1))
+    trivial = level + rng.normal(0, 0.02, (count, IN_SIZE))
+    frames = np.vstack([real, trivial]).astype(np.float32)
+    labels = np.concatenate([np.ones(count), np.zeros(count)])
+    return frames, labels
+
+def main(args):
+    os.makedirs(args.output_dir, exist_ok=True)
+    if args.synthesize:
+        x, y = synthesize(os.path.join(args.output_dir, "input.bin"), args.count, args.seed)
+    else:
+        npz = np.load(args.train)
+        x = np.asarray(npz["x"], np.float32).reshape(-1, IN_SIZE)
+        y = np.asarray(npz["y"]).ravel()
+        if len(y) != len(x):
+            raise SystemExit(f"{len(x)} frames but {len(y)} labels")
+    gate = train(x, y, args.seed, args.ridge)
+
+    score = gate_score(x, **gate)
+    keep = score >= args.threshold
+    print(f"Threshold {args.threshold}: {np.mean(keep[y > 0]) * 100:.2f}% of real frames "
+          f"run the network, {np.mean(~keep[y <= 0]) * 100:.2f}% of trivial frames skip it")
+
+    for name, arr in gate.items():
+        path = os.path.join(args.output_dir, f"gate_{name}.bin")
+        arr.ravel().tofile(path)
+        print(f"Wrote gate_{name} → {path}  ({arr.size} values)")
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(
+        description="Fit the pre-screen gating model (gate_*.bin) next to the model weights"
+    )
+    p.add_argument(
+        "--output-dir", "-o", default="bins",
+        help="Model directory (as written by pth_to_bin.py)"
+    )
+    p.add_argument(
+        "--train", "-t",
+        help=f".npz with x[N, {IN_SIZE}] model inputs and y[N] labels (1 = needs the network)"
+    )
+    p.add_argument(
+        "--synthesize", action="store_true",
+        help="Train on jittered input.bin frames against synthetic trivial frames"
+    )
+    p.add_argument("--count", type=int, default=2000, help="Frames per class for --synthesize")
+    p.add_argument("--ridge", type=float, default=1e-3, help="Ridge penalty of the readout")
+    p.add_argument("--threshold", type=float, default=0.0,
+                   help="Score threshold to report (cnn --screen_gate_threshold)")
+    p.add_argument("--seed", type=int, default=0, help="Seed of the features and --synthesize")
+    args = p.parse_args()
+    if not args.synthesize and not args.train:
+        p.error("one of --train or --synthesize is required")
+    main(args)
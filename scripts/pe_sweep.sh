@@ -0,0 +1,36 @@
+#!/bin/bash
+# Sweep the number of replicated PEs in CnnBatchKernel: rebuild with each
+# NUM_PE, run the batch kernel and collect samples/s.
+#
+# Without BATCH_BTSTM this runs software simulation, where PEs are threads:
+# use a host with at least NUM_PE cores, and the numbers only show the
+# host's parallelism. For hardware, set BATCH_BTSTM to the CnnBatchKernel
+# bitstreams, with %s standing for the PE count of each, e.g.
+#   BATCH_BTSTM=build/cnn_batch_pe%s.xclbin scripts/pe_sweep.sh data
+#
+# usage: scripts/pe_sweep.sh <data dir> [samples] [pe counts...]
+set -e
+
+DATA=$1
+SAMPLES=${2:-1024}
+shift 2 || shift $#
+PES=${@:-"1 2 4 8"}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+cd "$ROOT/cnn"
+
+printf "%4s  %14s  %s\n" PEs samples/s "weight KB/sample"
+for p in $PES; do
+    BITSTREAM=""
+    if [ -n "$BATCH_BTSTM" ]; then
+        BITSTREAM=$(printf "$BATCH_BTSTM" "$p")
+        [ -f "$BITSTREAM" ] || { echo "missing $BITSTREAM" >&2; exit 1; }
+    fi
+    make clean >/dev/null 2>&1 || true
+    make NUM_PE="$p" >/dev/null
+    line=$(./cnn --dtf="$DATA" --pe_batch="$SAMPLES" --batch_btstm="$BITSTREAM" 2>&1 |
+           grep "PE batch kernel")
+    rate=$(echo "$line" | sed -n 's/.* ms, \([0-9.e+]*\) samples\/s.*/\1/p')
+    kb=$(echo "$line" | sed -n 's/.*samples\/s, \([0-9.e+]*\) KB.*/\1/p')
+    printf "%4s  %14s  %s\n" "$p" "$rate" "$kb"
+done
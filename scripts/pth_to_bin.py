@@ -4,7 +4,15 @@ import argparse
 import torch
 import numpy as np
 
-def main(model_path: str, output_dir: str):
+def low_rank(weight: torch.Tensor, rank: int):
+    """Truncated SVD W ~= U @ V with U (out x rank) and V (rank x in)."""
+    U, S, Vh = torch.linalg.svd(weight.double(), full_matrices=False)
+    u = (U[:, :rank] * S[:rank]).float()
+    v = Vh[:rank, :].float()
+    err = torch.linalg.norm(weight - u @ v) / torch.linalg.norm(weight)
+    return u, v, err.item()
+
+def main(model_path: str, output_dir: str, ranks: dict):
     # 1) Load checkpoint
     ckpt = torch.load(model_path, map_location="cpu")
     state_dict = ckpt.get("state_dict", ckpt)
@@ -25,6 +33,22 @@ def main(model_path: str, output_dir: str):
         arr.tofile(out_path)
         print(f"Wrote {name:30s} → {out_path}  (shape={arr.shape})")
 
+    # 4) Optional low-rank factors, picked up by LoadData as fc*_u.bin / fc*_v.bin
+    for layer, rank in ranks.items():
+        u_path = os.path.join(output_dir, f"{layer}_u.bin")
+        v_path = os.path.join(output_dir, f"{layer}_v.bin")
+        if not rank:
+            # stale factors from an earlier run would silently be used
+            for path in (u_path, v_path):
+                if os.path.exists(path):
+                    os.remove(path)
+            continue
+        weight = state_dict[f"{layer}.weight"].cpu().float()
+        u, v, err = low_rank(weight, rank)
+        u.numpy().tofile(u_path)
+        v.numpy().tofile(v_path)
+        print(f"Factored {layer} at rank {rank}: relative Frobenius error {err:.6f}")
+
     print(f"\nAll done! {len(state_dict)} files written to {output_dir!r}.")
 
 if __name__ == "__main__":
@@ -39,5 +63,14 @@ if __name__ == "__main__":
         "--output-dir", "-o", default="bins",
         help="Directory to write .bin files into"
     )
+    p.add_argument(
+        "--fc1-rank", type=int, default=0,
+        help="Also write a rank-r factorization of fc1 (0 = dense only)"
+    )
+    p.add_argument(
+        "--fc2-rank", type=int, default=0,
+        help="Also write a rank-r factorization of fc2 (0 = dense only)"
+    )
     args = p.parse_args()
-    main(args.model_path, args.output_dir)
+    main(args.model_path, args.output_dir,
+         {"fc1": args.fc1_rank, "fc2": args.fc2_rank})
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Sweep the fc2 rank: factor the checkpoint at each rank, run the benchmark
+# and collect the reconstruction error and Verify pass rate.
+#
+# usage: scripts/rank_sweep.sh <model.pth> <data dir with input.bin/output.bin> [ranks...]
+set -e
+
+MODEL=$1
+DATA=$2
+shift 2
+RANKS=${@:-"4 8 16 32 64"}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cp "$DATA/input.bin" "$DATA/output.bin" "$WORK/"
+
+printf "%6s  %12s  %s\n" rank "rel. error" "pass rate"
+for r in $RANKS; do
+    err=$(python3 "$ROOT/scripts/pth_to_bin.py" -m "$MODEL" -o "$WORK" --fc2-rank "$r" \
+          | sed -n 's/.*relative Frobenius error //p')
+    rate=$("$ROOT/cnn/cnn" --dtf="$WORK" 2>&1 | sed -n 's/.*low-rank \([0-9.]*%\).*/\1/p')
+    printf "%6s  %12s  %s\n" "$r" "$err" "$rate"
+done